@@ -0,0 +1,358 @@
+#!/usr/bin/env python3
+"""
+Fleet load generator for update_server.py.
+
+Simulates N devices running the firmware's OTA flow on one keep-alive
+connection each: /api/version, then /api/firmware, resuming with a Range
+request after a broken download (at most OTA_MAX_DOWNLOAD_RETRIES attempts,
+like ota_mgmt.c). Field conditions are modelled with a random start jitter,
+a share of slow links that read at a limited rate, and mid-stream
+disconnects.
+
+Either benchmarks a running server (--host/--port, optionally --server-pid
+for resource usage) or spawns one on --firmware itself. The result is
+written as JSON: throughput, latency percentiles, error counts and the
+server's peak RSS and CPU usage sampled from /proc.
+"""
+
+import argparse
+import asyncio
+import json
+import os
+import random
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+import update_server
+
+MAX_DOWNLOAD_RETRIES = 3      # OTA_MAX_DOWNLOAD_RETRIES in app_config.h
+READ_CHUNK = 1024             # http_recv_buf size on the device
+
+
+class HttpError(Exception):
+    pass
+
+
+class DeviceConnection:
+    """Minimal HTTP/1.1 keep-alive client on asyncio streams."""
+    def __init__(self, host, port, timeout):
+        self.host = host
+        self.port = port
+        self.timeout = timeout
+        self.reader = None
+        self.writer = None
+
+    async def close(self):
+        if self.writer is not None:
+            self.writer.close()
+            try:
+                await self.writer.wait_closed()
+            except OSError:
+                pass
+        self.reader = self.writer = None
+
+    async def request(self, path, headers=None, body_sink=None):
+        """Sends a GET and returns (status, headers, body). The body goes to body_sink if given."""
+        if self.writer is None:
+            self.reader, self.writer = await asyncio.wait_for(
+                asyncio.open_connection(self.host, self.port), self.timeout)
+
+        lines = [f"GET {path} HTTP/1.1", f"Host: {self.host}"]
+        lines += [f"{name}: {value}" for name, value in (headers or {}).items()]
+        self.writer.write(("\r\n".join(lines) + "\r\n\r\n").encode())
+        await self.writer.drain()
+
+        head = await asyncio.wait_for(self.reader.readuntil(b"\r\n\r\n"), self.timeout)
+        status_line, *header_lines = head.decode('latin-1').split("\r\n")
+        status = int(status_line.split()[1])
+        rsp_headers = {}
+        for line in header_lines:
+            if ':' in line:
+                name, value = line.split(':', 1)
+                rsp_headers[name.strip().lower()] = value.strip()
+
+        length = int(rsp_headers.get('content-length', 0))
+        body = bytearray()
+        while length > 0:
+            chunk = await asyncio.wait_for(self.reader.read(min(READ_CHUNK, length)), self.timeout)
+            if not chunk:
+                raise HttpError("connection closed mid-body")
+            length -= len(chunk)
+            if body_sink is None:
+                body.extend(chunk)
+            else:
+                await body_sink(chunk)
+
+        if rsp_headers.get('connection', '').lower() == 'close':
+            await self.close()
+        return status, rsp_headers, bytes(body)
+
+
+class Stats:
+    def __init__(self):
+        self.version_latency = []
+        self.first_byte_latency = []
+        self.download_time = []
+        self.bytes = 0
+        self.requests = 0
+        self.completed = 0
+        self.deferred = 0
+        self.resumes = 0
+        self.errors = {}
+
+    def error(self, kind):
+        self.errors[kind] = self.errors.get(kind, 0) + 1
+
+
+async def run_device(index, args, stats):
+    rng = random.Random(args.seed + index)
+    conn = DeviceConnection(args.host, args.port, args.timeout)
+    slow = rng.random() < args.slow_fraction
+    await asyncio.sleep(rng.uniform(0, args.jitter))
+
+    try:
+        for _ in range(args.rounds):
+            start = time.monotonic()
+            try:
+                status, headers, body = await conn.request(
+                    f"/api/version?version={args.device_version}&board={args.board}&device=sim-{index}")
+                stats.requests += 1
+                while status == 503 and args.retry_scale > 0:
+                    # held back by the rollout controller, come back when told (scaled to keep runs short)
+                    stats.deferred += 1
+                    await asyncio.sleep(float(headers.get('retry-after', 30)) * args.retry_scale)
+                    status, headers, body = await conn.request(
+                        f"/api/version?version={args.device_version}&board={args.board}&device=sim-{index}")
+                    stats.requests += 1
+            except (OSError, asyncio.TimeoutError, asyncio.IncompleteReadError, HttpError) as e:
+                stats.error(f"version_{type(e).__name__}")
+                await conn.close()
+                continue
+            stats.version_latency.append(time.monotonic() - start)
+            if status != 200:
+                stats.error(f"version_http_{status}")
+                continue
+
+            info = json.loads(body)
+            if info['version'] == args.device_version:
+                continue
+
+            await download(conn, info['size'], slow, rng, args, stats, index)
+    finally:
+        await conn.close()
+
+
+async def download(conn, size, slow, rng, args, stats, index):
+    received = 0
+    start = time.monotonic()
+    first_byte = None
+    drop_at = rng.randrange(size) if rng.random() < args.drop_rate else None
+
+    async def sink(chunk):
+        nonlocal received, first_byte, drop_at
+        if first_byte is None:
+            first_byte = time.monotonic()
+        received += len(chunk)
+        stats.bytes += len(chunk)
+        if drop_at is not None and received >= drop_at:
+            drop_at = None
+            raise HttpError("simulated disconnect")
+        if slow:
+            await asyncio.sleep(len(chunk) / args.slow_rate)
+
+    for attempt in range(MAX_DOWNLOAD_RETRIES):
+        headers = {'Range': f"bytes={received}-"} if received > 0 else None
+        try:
+            status, _, _ = await conn.request(f"/api/firmware?board={args.board}&device=sim-{index}", headers, sink)
+            stats.requests += 1
+        except HttpError as e:
+            kind = "download_dropped" if "simulated" in str(e) else "download_closed"
+            stats.error(kind)
+        except (OSError, asyncio.TimeoutError, asyncio.IncompleteReadError) as e:
+            stats.error(f"download_{type(e).__name__}")
+        else:
+            if status not in (200, 206):
+                stats.error(f"download_http_{status}")
+            elif received == size:
+                stats.completed += 1
+                stats.first_byte_latency.append(first_byte - start)
+                stats.download_time.append(time.monotonic() - start)
+                return
+            else:
+                stats.error("download_short")
+
+        # the stream is in an unknown state, reconnect and resume like the device does
+        await conn.close()
+        if received > 0:
+            stats.resumes += 1
+        await asyncio.sleep(args.retry_delay)
+
+    stats.error("download_gave_up")
+
+
+class ProcessSampler:
+    """Samples RSS and CPU time of a process from /proc."""
+    def __init__(self, pid):
+        self.pid = pid
+        self.peak_rss_kb = 0
+        self.cpu_start = self.cpu_seconds()
+        self.wall_start = time.monotonic()
+
+    def cpu_seconds(self):
+        try:
+            with open(f"/proc/{self.pid}/stat") as f:
+                fields = f.read().rsplit(')', 1)[1].split()
+            return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+        except (OSError, IndexError):
+            return 0.0
+
+    def sample(self):
+        try:
+            with open(f"/proc/{self.pid}/status") as f:
+                for line in f:
+                    if line.startswith('VmRSS:'):
+                        self.peak_rss_kb = max(self.peak_rss_kb, int(line.split()[1]))
+        except OSError:
+            pass
+
+    async def run(self, interval):
+        while True:
+            self.sample()
+            await asyncio.sleep(interval)
+
+    def result(self):
+        cpu = self.cpu_seconds() - self.cpu_start
+        wall = time.monotonic() - self.wall_start
+        return {
+            "pid": self.pid,
+            "peak_rss_kb": self.peak_rss_kb,
+            "cpu_seconds": round(cpu, 3),
+            "cpu_percent": round(100 * cpu / wall, 1) if wall > 0 else 0.0,
+        }
+
+
+def percentiles(values):
+    if not values:
+        return None
+    values = sorted(values)
+
+    def pick(p):
+        return round(values[min(len(values) - 1, int(p / 100 * len(values)))] * 1000, 2)
+
+    return {"p50_ms": pick(50), "p90_ms": pick(90), "p99_ms": pick(99), "max_ms": round(values[-1] * 1000, 2)}
+
+
+def spawn_server(args, builds_dir):
+    latest = os.path.join(builds_dir, args.board, update_server.LATEST_IMAGE)
+    os.makedirs(os.path.dirname(latest))
+    shutil.copyfile(args.firmware, latest)
+
+    server = subprocess.Popen([sys.executable, "update_server.py", "--builds", builds_dir, "--port", str(args.port),
+                               "--board", args.board, *args.server_arg],
+                              cwd=os.path.dirname(os.path.abspath(__file__)),
+                              stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+    deadline = time.monotonic() + 10
+    while time.monotonic() < deadline:
+        try:
+            socket.create_connection((args.host, args.port), timeout=0.2).close()
+            return server
+        except OSError:
+            time.sleep(0.1)
+    server.kill()
+    raise RuntimeError("Spawned update server did not come up")
+
+
+async def benchmark(args, server_pid):
+    stats = Stats()
+    sampler = ProcessSampler(server_pid) if server_pid else None
+    sampler_task = asyncio.create_task(sampler.run(0.2)) if sampler else None
+
+    start = time.monotonic()
+    await asyncio.gather(*(run_device(i, args, stats) for i in range(args.devices)))
+    elapsed = time.monotonic() - start
+
+    if sampler_task:
+        sampler_task.cancel()
+        sampler.sample()
+
+    downloads_started = stats.completed + stats.errors.get("download_gave_up", 0)
+    return {
+        "config": {
+            "devices": args.devices,
+            "rounds": args.rounds,
+            "jitter_s": args.jitter,
+            "slow_fraction": args.slow_fraction,
+            "slow_rate_bps": args.slow_rate,
+            "drop_rate": args.drop_rate,
+            "device_version": args.device_version,
+        },
+        "elapsed_s": round(elapsed, 3),
+        "requests": stats.requests,
+        "downloads_completed": stats.completed,
+        "deferred": stats.deferred,
+        "resumes": stats.resumes,
+        "bytes": stats.bytes,
+        "throughput_mbps": round(stats.bytes * 8 / elapsed / 1e6, 3) if elapsed > 0 else 0.0,
+        "version_latency": percentiles(stats.version_latency),
+        "first_byte_latency": percentiles(stats.first_byte_latency),
+        "download_time": percentiles(stats.download_time),
+        "errors": stats.errors,
+        "error_rate": round(sum(stats.errors.values()) / max(stats.requests + sum(stats.errors.values()), 1), 4),
+        "download_failure_rate": round(stats.errors.get("download_gave_up", 0) / max(downloads_started, 1), 4),
+        "server": sampler.result() if sampler else None,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Fleet benchmark for the OTA update server')
+    parser.add_argument('--host', default='127.0.0.1', help='Server host')
+    parser.add_argument('--port', type=int, default=update_server.DEFAULT_PORT, help='Server port')
+    parser.add_argument('--firmware', help='Spawn a local server serving this image instead of using a running one')
+    parser.add_argument('--server-pid', type=int, help='PID of a running server to sample RSS/CPU from')
+    parser.add_argument('--board', default=update_server.BOARD, help='Board the simulated devices report')
+    parser.add_argument('--devices', type=int, default=100, help='Number of simulated devices')
+    parser.add_argument('--rounds', type=int, default=1, help='Update checks per device')
+    parser.add_argument('--device-version', default='0.0.0', help='Version the simulated devices report')
+    parser.add_argument('--jitter', type=float, default=5.0, help='Devices start within this many seconds')
+    parser.add_argument('--slow-fraction', type=float, default=0.1, help='Share of devices on a slow link')
+    parser.add_argument('--slow-rate', type=float, default=64 * 1024, help='Slow link rate in bytes/s')
+    parser.add_argument('--drop-rate', type=float, default=0.05, help='Share of downloads cut mid-stream')
+    parser.add_argument('--retry-delay', type=float, default=0.5, help='Pause before resuming a download')
+    parser.add_argument('--timeout', type=float, default=30.0, help='Socket timeout in seconds')
+    parser.add_argument('--seed', type=int, default=1, help='Seed for jitter, link speeds and drops')
+    parser.add_argument('--retry-scale', type=float, default=0.1,
+                        help='Scale of the Retry-After of deferred checks, 0 to count them as errors')
+    parser.add_argument('--server-arg', action='append', default=[],
+                        help='Extra argument for a spawned server, e.g. --server-arg=--max-concurrent=10')
+    parser.add_argument('--output', help='Write the JSON result to this file instead of stdout')
+    args = parser.parse_args()
+
+    builds_dir = tempfile.mkdtemp(prefix='ota-bench-') if args.firmware else None
+    server = spawn_server(args, builds_dir) if args.firmware else None
+    server_pid = server.pid if server else args.server_pid
+    try:
+        result = asyncio.run(benchmark(args, server_pid))
+    finally:
+        if server:
+            # SIGINT lets the server clean up its image copies
+            server.send_signal(signal.SIGINT)
+            server.wait()
+            shutil.rmtree(builds_dir, ignore_errors=True)
+
+    output = json.dumps(result, indent=2)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(output + "\n")
+    else:
+        print(output)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
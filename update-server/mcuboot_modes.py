@@ -0,0 +1,361 @@
+#!/usr/bin/env python3
+"""
+Compares the MCUboot upgrade modes on a model of the board's flash.
+
+MCUboot can't chain-load an app on native_sim, so this replays what the
+bootloader does on the first boot after boot_request_upgrade() on a
+simulated NOR flash: byte-accurate slot contents, sector erases, writes and
+reads, each with a duration. The modes follow bootutil:
+  overwrite  BOOT_UPGRADE_ONLY: slot1 is copied over slot0 (OVERWRITE_ONLY_FAST), no revert
+  move       SWAP_USING_MOVE: slot0 moves up one sector, then both slots swap sector by sector
+  scratch    SWAP_USING_SCRATCH: each sector swaps through the scratch area
+  xip        DIRECT_XIP: the newest valid slot runs in place, nothing is copied
+The swap modes record each step in the slot0 trailer and resume from it.
+
+Per mode it measures the bootloader time until the app starts, bytes erased
+and written, the most erased sector (wear), the revert of an unconfirmed
+image, and the recovery from power losses during the upgrade: the flash
+stops at the given share of the upgrade's operations and the next boot must
+still end with the right images in both slots.
+
+Slot layout comes from a build's zephyr.dts (--build-dir), flash timings from
+the board: sector erase time and write rate from 'ota bench flash', hash rate
+and signature time from the 'validate' phase of 'ota stats' (slot1 is checked
+there the way MCUboot checks it). The defaults are datasheet values of a
+typical SPI NOR flash. Prints JSON, or a Markdown table with --table.
+"""
+
+import argparse
+import json
+import random
+import struct
+import sys
+
+import sim_flow
+import update_server
+
+ERASED = 0xff
+MODES = ('overwrite', 'move', 'scratch', 'xip')
+TRAILER_FIXED = 48            # magic, swap size, swap info, copy done, image ok (bootutil/bootutil_priv.h)
+STATUS_STATES = 3             # status entries per sector: BOOT_STATUS_STATE_COUNT, or move + 2 swap states
+
+
+class PowerLoss(Exception):
+    pass
+
+
+class Flash:
+    """NOR flash: writes only go to erased bytes, each operation takes its time and may be the last one."""
+    def __init__(self, size, sector, erase_s, write_rate, read_rate):
+        self.data = bytearray([ERASED]) * size
+        self.sector = sector
+        self.erase_s = erase_s
+        self.write_rate = write_rate
+        self.read_rate = read_rate
+        self.erase_count = [0] * (size // sector)
+        self.ops_left = None
+        self.reset_counters()
+
+    def reset_counters(self):
+        self.elapsed = 0.0
+        self.ops = 0
+        self.erased = 0
+        self.written = 0
+        self.erase_count = [0] * len(self.erase_count)
+
+    def op(self):
+        if self.ops_left is not None:
+            if self.ops_left == 0:
+                raise PowerLoss()
+            self.ops_left -= 1
+        self.ops += 1
+
+    def erase(self, off, size):
+        for pos in range(off, off + size, self.sector):
+            self.op()
+            self.data[pos:pos + self.sector] = bytes([ERASED]) * self.sector
+            self.erase_count[pos // self.sector] += 1
+            self.erased += self.sector
+            self.elapsed += self.erase_s
+
+    def write(self, off, data):
+        self.op()
+        if any(b != ERASED for b in self.data[off:off + len(data)]):
+            raise RuntimeError(f"Write to non-erased flash at 0x{off:x}")
+        self.data[off:off + len(data)] = data
+        self.written += len(data)
+        self.elapsed += len(data) / self.write_rate
+
+    def read(self, off, size):
+        self.elapsed += size / self.read_rate
+        return bytes(self.data[off:off + size])
+
+
+class Bootloader:
+    """The first boot after an upgrade request in one MCUboot mode, resumable after a power loss."""
+    def __init__(self, mode, flash, slot_size, scratch_off, image_size, write_size, hash_rate, verify_s):
+        self.mode = mode
+        self.flash = flash
+        self.slots = (0, slot_size)
+        self.slot_size = slot_size
+        self.scratch_off = scratch_off
+        self.sector = flash.sector
+        self.sectors = -(-image_size // self.sector)
+        self.image_size = image_size
+        self.write_size = write_size
+        self.hash_rate = hash_rate
+        self.verify_s = verify_s
+
+        slot_sectors = slot_size // self.sector
+        trailer = TRAILER_FIXED + slot_sectors * STATUS_STATES * write_size
+        self.trailer_off = slot_size - -(-trailer // self.sector) * self.sector
+        self.status_off = slot_size - trailer
+        self.status_len = slot_sectors * STATUS_STATES * write_size
+        self.magic_off = slot_size - 16
+        self.copy_done_off = self.magic_off - write_size
+
+        usable = self.trailer_off - (self.sector if mode == 'move' else 0)
+        if self.sectors * self.sector > usable:
+            raise ValueError(f"{mode}: image of {image_size} bytes needs {self.sectors} sectors, "
+                             f"the slot has {usable // self.sector} besides the trailer")
+
+    # trailer flags, a flag is set when its bytes are written
+    def flag(self, slot, off):
+        return self.flash.data[self.slots[slot] + off] != ERASED
+
+    def set_flag(self, slot, off, size=None):
+        self.flash.write(self.slots[slot] + off, b'\x01' * (size or self.write_size))
+
+    def request_upgrade(self):
+        """What boot_request_upgrade() leaves in slot1, done by the app and not counted."""
+        self.flash.data[self.slots[1] + self.magic_off:self.slots[1] + self.slot_size] = b'\x01' * 16
+
+    def validate(self, slot):
+        """bootutil_img_validate(): read and hash the image, check the signature. Only the header is modelled."""
+        header = self.flash.read(self.slots[slot], 4)
+        if struct.unpack('<I', header)[0] != update_server.IMAGE_MAGIC:
+            return False
+        self.flash.read(self.slots[slot] + 4, self.image_size - 4)
+        self.flash.elapsed += self.image_size / self.hash_rate + self.verify_s
+        return True
+
+    def copy_sector(self, src, dst):
+        data = self.flash.read(src, self.sector)
+        self.flash.erase(dst, self.sector)
+        self.flash.write(dst, data)
+
+    def swap_steps(self):
+        """Flash operations of a swap in order, each is safe to repeat until its status entry is written."""
+        p, s, sz = self.slots[0], self.slots[1], self.sector
+        steps = []
+        if self.mode == 'move':
+            for i in reversed(range(self.sectors)):
+                steps.append((p + i * sz, p + (i + 1) * sz))
+            for i in range(self.sectors):
+                steps.append((s + i * sz, p + i * sz))
+                steps.append((p + (i + 1) * sz, s + i * sz))
+        else:
+            for i in reversed(range(self.sectors)):
+                steps.append((s + i * sz, self.scratch_off))
+                steps.append((p + i * sz, s + i * sz))
+                steps.append((self.scratch_off, p + i * sz))
+        return steps
+
+    def status_done(self):
+        """Status entries written so far, read from the slot0 trailer."""
+        count = 0
+        data = self.flash.read(self.slots[0] + self.status_off, self.status_len)
+        while count * self.write_size < len(data) and data[count * self.write_size] != ERASED:
+            count += 1
+        return count
+
+    def swap(self):
+        if not self.flag(0, self.magic_off):
+            # new swap: fresh slot0 trailer, then the swap state
+            self.flash.erase(self.slots[0] + self.trailer_off, self.slot_size - self.trailer_off)
+            self.set_flag(0, self.magic_off, 16)
+        done = self.status_done()
+        for src, dst in self.swap_steps()[done:]:
+            self.copy_sector(src, dst)
+            self.flash.write(self.slots[0] + self.status_off + done * self.write_size, b'\x01' * self.write_size)
+            done += 1
+        # slot1 now holds the old image without a request, slot0 is waiting for its image_ok
+        self.flash.erase(self.slots[1] + self.trailer_off, self.slot_size - self.trailer_off)
+        self.set_flag(0, self.copy_done_off)
+
+    def boot(self):
+        """Runs the bootloader until it jumps to the app, resuming whatever a power loss interrupted."""
+        if self.mode == 'xip':
+            self.validate(1)
+            return
+        if self.mode == 'overwrite':
+            if self.flag(1, self.magic_off):
+                if self.validate(1):
+                    for i in range(self.sectors):
+                        self.copy_sector(self.slots[1] + i * self.sector, self.slots[0] + i * self.sector)
+                    # remove the header so the copy isn't repeated
+                    self.flash.erase(self.slots[1], self.sector)
+                self.flash.erase(self.slots[1] + self.trailer_off, self.slot_size - self.trailer_off)
+            self.validate(0)
+            return
+
+        swapping = self.flag(0, self.magic_off) and not self.flag(0, self.copy_done_off)
+        if not swapping and self.flag(1, self.magic_off) and not self.validate(1):
+            self.flash.erase(self.slots[1] + self.trailer_off, self.slot_size - self.trailer_off)
+        elif swapping or self.flag(1, self.magic_off):
+            self.swap()
+        self.validate(0)
+
+    def revert(self):
+        """Boot after the new image didn't confirm itself: swap back and make the old image permanent."""
+        self.flash.data[self.slots[0] + self.trailer_off:self.slots[0] + self.slot_size] = \
+            bytes([ERASED]) * (self.slot_size - self.trailer_off)
+        self.swap()
+        self.validate(0)
+
+
+def make_flash(args, layout, image_size, old, new):
+    slot_size, scratch_size = layout
+    flash = Flash(2 * slot_size + scratch_size, args.sector_size, args.erase_ms / 1000, args.write_rate,
+                  args.read_rate)
+    flash.data[:len(old)] = old
+    flash.data[slot_size:slot_size + len(new)] = new
+    return flash
+
+
+def run_mode(mode, args, layout, old, new, cuts):
+    slot_size, _ = layout
+    image_size = len(new)
+
+    def setup():
+        flash = make_flash(args, layout, image_size, old, new)
+        boot = Bootloader(mode, flash, slot_size, 2 * slot_size, image_size, args.write_size,
+                          args.hash_rate, args.verify_ms / 1000)
+        boot.request_upgrade()
+        return flash, boot
+
+    def images_ok(flash):
+        if mode == 'xip':
+            return flash.data[slot_size:slot_size + image_size] == new
+        primary_ok = flash.data[:image_size] == new
+        if mode == 'overwrite':
+            return primary_ok
+        return primary_ok and flash.data[slot_size:slot_size + image_size] == old
+
+    flash, boot = setup()
+    boot.boot()
+    result = {
+        "time_to_app_ms": round(flash.elapsed * 1000, 1),
+        "erased_bytes": flash.erased,
+        "written_bytes": flash.written,
+        "max_sector_erases": max(flash.erase_count),
+        "ok": images_ok(flash),
+    }
+    upgrade_ops = flash.ops
+
+    flash.reset_counters()
+    boot.boot()
+    result["normal_boot_ms"] = round(flash.elapsed * 1000, 1)
+
+    if mode in ('move', 'scratch'):
+        flash.reset_counters()
+        boot.revert()
+        result["revert_ms"] = round(flash.elapsed * 1000, 1)
+        result["revert_erased_bytes"] = flash.erased
+        result["ok"] = result["ok"] and flash.data[:image_size] == old
+
+    # nothing to interrupt without flash operations (xip)
+    result["power_loss"] = []
+    for cut in (cuts if upgrade_ops > 0 else []):
+        flash, boot = setup()
+        flash.ops_left = int(cut * upgrade_ops)
+        try:
+            boot.boot()
+        except PowerLoss:
+            pass
+        before_ms = flash.elapsed * 1000
+        flash.ops_left = None
+        flash.reset_counters()
+        boot.boot()
+        recovery_ms = flash.elapsed * 1000
+        result["power_loss"].append({
+            "cut_at": cut,
+            "recovery_ms": round(recovery_ms, 1),
+            "lost_ms": round(before_ms + recovery_ms - result["time_to_app_ms"], 1),
+            "ok": images_ok(flash),
+        })
+        result["ok"] = result["ok"] and images_ok(flash)
+    return result
+
+
+def print_table(result):
+    print(f"Image {result['image_size']} bytes, slots {result['slot_size']} bytes, "
+          f"{result['sector_size']} byte sectors\n")
+    print("| mode | time to app | normal boot | erased | written | max erases/sector | revert "
+          "| worst recovery | worst lost | ok |")
+    print("|---|---|---|---|---|---|---|---|---|---|")
+    for mode in MODES:
+        r = result[mode]
+        if "error" in r:
+            print(f"| {mode} | {r['error']} |||||||||")
+            continue
+        revert = f"{r['revert_ms']:.0f} ms" if "revert_ms" in r else "none"
+        recovery = lost = "n/a"
+        if r["power_loss"]:
+            worst = max(r["power_loss"], key=lambda p: p["recovery_ms"])
+            recovery = f"{worst['recovery_ms']:.0f} ms"
+            lost = f"{max(p['lost_ms'] for p in r['power_loss']):.0f} ms"
+        print(f"| {mode} | {r['time_to_app_ms']:.0f} ms | {r['normal_boot_ms']:.0f} ms | {r['erased_bytes']} "
+              f"| {r['written_bytes']} | {r['max_sector_erases']} | {revert} | {recovery} | {lost} "
+              f"| {'yes' if r['ok'] else 'NO'} |")
+
+
+def main():
+    parser = argparse.ArgumentParser(description='MCUboot upgrade modes on a model of the board flash')
+    parser.add_argument('--build-dir', help='Zephyr build directory, slot and scratch sizes come from zephyr.dts')
+    parser.add_argument('--image', help='Signed image to upgrade to (zephyr.signed.bin), default a random one')
+    parser.add_argument('--image-size', type=int, default=512 * 1024, help='Size of the random image')
+    parser.add_argument('--slot-size', type=lambda v: int(v, 0), default=0x100000, help='Without --build-dir')
+    parser.add_argument('--scratch-size', type=lambda v: int(v, 0), default=0x1000, help='Without --build-dir')
+    parser.add_argument('--sector-size', type=int, default=4096, help='Erase sector size')
+    parser.add_argument('--write-size', type=int, default=4, help='Flash write block size (status entries)')
+    parser.add_argument('--erase-ms', type=float, default=45, help='Time to erase one sector')
+    parser.add_argument('--write-rate', type=float, default=360e3, help='Bytes/s written (page program)')
+    parser.add_argument('--read-rate', type=float, default=10e6, help='Bytes/s read by the bootloader')
+    parser.add_argument('--hash-rate', type=float, default=2e6, help='Bytes/s hashed by the bootloader')
+    parser.add_argument('--verify-ms', type=float, default=100, help='ECDSA-P256 signature check')
+    parser.add_argument('--cuts', type=float, nargs='+', default=[0.1, 0.5, 0.9],
+                        help='Power losses at these shares of the upgrade flash operations')
+    parser.add_argument('--table', action='store_true', help='Print a Markdown table instead of JSON')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    layout = (args.slot_size, args.scratch_size)
+    if args.build_dir:
+        partitions = sim_flow.read_partitions(args.build_dir)
+        layout = (partitions['slot0'][1], partitions.get('scratch', (0, args.sector_size))[1])
+    # random images only need the header magic, the old one has the size of the new one
+    magic = struct.pack('<I', update_server.IMAGE_MAGIC)
+    if args.image:
+        with open(args.image, 'rb') as f:
+            new = f.read()
+    else:
+        new = magic + random.Random(args.seed).randbytes(args.image_size - len(magic))
+    old = magic + random.Random(args.seed + 1).randbytes(len(new) - len(magic))
+
+    result = {"image_size": len(new), "slot_size": layout[0], "sector_size": args.sector_size}
+    for mode in MODES:
+        try:
+            result[mode] = run_mode(mode, args, layout, old, new, args.cuts)
+        except ValueError as e:
+            result[mode] = {"error": str(e), "ok": False}
+
+    if args.table:
+        print_table(result)
+    else:
+        print(json.dumps(result, indent=2))
+    return 0 if all(result[mode]["ok"] for mode in MODES) else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
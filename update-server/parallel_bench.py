@@ -0,0 +1,318 @@
+#!/usr/bin/env python3
+"""
+Compares a single stream download with the parallel chunked download of
+ota_parallel.c over an emulated lossy link.
+
+A local proxy between client and update_server.py shapes what the server
+sends: every connection is capped at --flow-rate (what one TCP stream with a
+small receive window gets over the air), all connections together at
+--link-rate, and each 1460 byte segment is lost with probability --loss,
+which stalls its connection for --rto seconds like a retransmission timeout.
+--corrupt flips a byte in a segment, to see chunks being fetched again.
+
+The parallel client works like the device: the CBOR manifest lists the
+chunk hashes, N connections fetch chunks with Range requests at most N
+chunks ahead of the in-order writer, and a chunk that fails or doesn't match
+its hash is fetched again. Prints total time, throughput and chunk latency
+percentiles per mode as JSON.
+"""
+
+import argparse
+import hashlib
+import http.client
+import json
+import os
+import random
+import shutil
+import socket
+import sys
+import tempfile
+import threading
+import time
+
+import sim_flow
+import update_server
+
+SEGMENT = 1460
+CHUNK_ATTEMPTS = 4            # OTA_PARALLEL_CHUNK_ATTEMPTS in app_config.h
+CHUNK_HASH_LEN = 8            # OTA_MANIFEST_CHUNK_HASH_LEN, the device only keeps this much of each hash
+
+
+def cbor_decode(data, pos=0):
+    """Decodes the CBOR subset update_server.cbor_encode() writes, returns (value, next position)."""
+    major, info = data[pos] >> 5, data[pos] & 0x1f
+    pos += 1
+    if info < 24:
+        arg = info
+    else:
+        size = 1 << (info - 24)
+        arg = int.from_bytes(data[pos:pos + size], 'big')
+        pos += size
+    if major == 0:
+        return arg, pos
+    if major in (2, 3):
+        value = data[pos:pos + arg]
+        return (value.decode() if major == 3 else value), pos + arg
+    if major == 4:
+        items = []
+        for _ in range(arg):
+            item, pos = cbor_decode(data, pos)
+            items.append(item)
+        return items, pos
+    if major == 5:
+        items = {}
+        for _ in range(arg):
+            key, pos = cbor_decode(data, pos)
+            items[key], pos = cbor_decode(data, pos)
+        return items, pos
+    raise ValueError(f"Unexpected CBOR major type {major}")
+
+
+class LossyLink:
+    """TCP proxy that sends the server's answers through the link model, requests pass unchanged."""
+    def __init__(self, upstream_port, flow_rate, link_rate, loss, rto, corrupt, seed):
+        self.upstream_port = upstream_port
+        self.flow_rate = flow_rate
+        self.link = update_server.TokenBucket(link_rate)
+        self.loss = loss
+        self.rto = rto
+        self.corrupt = corrupt
+        self.rng = random.Random(seed)
+        self.rng_lock = threading.Lock()
+        self.listener = socket.create_server(('127.0.0.1', 0))
+        self.port = self.listener.getsockname()[1]
+        threading.Thread(target=self.accept, daemon=True).start()
+
+    def accept(self):
+        while True:
+            try:
+                client, _ = self.listener.accept()
+            except OSError:
+                return
+            upstream = socket.create_connection(('127.0.0.1', self.upstream_port))
+            for sock in (client, upstream):
+                sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            threading.Thread(target=self.pipe, args=(client, upstream, False), daemon=True).start()
+            threading.Thread(target=self.pipe, args=(upstream, client, True), daemon=True).start()
+
+    def pipe(self, src, dst, shaped):
+        try:
+            while True:
+                data = src.recv(SEGMENT)
+                if not data:
+                    break
+                if shaped:
+                    data = self.transmit(data)
+                dst.sendall(data)
+        except OSError:
+            pass
+        finally:
+            for sock in (src, dst):
+                try:
+                    sock.shutdown(socket.SHUT_RDWR)
+                except OSError:
+                    pass
+
+    def transmit(self, data):
+        with self.rng_lock:
+            lost = self.rng.random() < self.loss
+            corrupt_at = self.rng.randrange(len(data)) if self.rng.random() < self.corrupt else None
+        wait = max(len(data) / self.flow_rate, self.link.reserve(len(data)))
+        time.sleep(wait + (self.rto if lost else 0))
+        if corrupt_at is not None:
+            data = bytearray(data)
+            data[corrupt_at] ^= 0xff
+        return bytes(data)
+
+    def close(self):
+        self.listener.close()
+
+
+def percentiles(values):
+    values = sorted(values)
+
+    def pick(p):
+        return round(values[min(len(values) - 1, int(p / 100 * len(values)))] * 1000, 1)
+
+    return {"p50_ms": pick(50), "p90_ms": pick(90), "p99_ms": pick(99), "max_ms": round(values[-1] * 1000, 1)}
+
+
+def fetch_manifest(port, board):
+    conn = http.client.HTTPConnection('127.0.0.1', port, timeout=30)
+    conn.request('GET', f'/api/version?board={board}', headers={'Accept': update_server.MANIFEST_CONTENT_TYPE})
+    response = conn.getresponse()
+    body = response.read()
+    conn.close()
+    if response.status != 200:
+        raise RuntimeError(f"Version check failed: {response.status}")
+    manifest, _ = cbor_decode(body)
+    return manifest
+
+
+def download_single(port, board, manifest):
+    """One GET for the whole image, chunk latency is the time between chunk boundaries arriving."""
+    chunk_size = manifest[update_server.MANIFEST_KEY_CHUNK_SIZE]
+    conn = http.client.HTTPConnection('127.0.0.1', port, timeout=60)
+    start = time.monotonic()
+    conn.request('GET', f'/api/firmware?board={board}')
+    response = conn.getresponse()
+    image = bytearray()
+    latencies = []
+    last = start
+    while True:
+        data = response.read(chunk_size)
+        if not data:
+            break
+        image += data
+        now = time.monotonic()
+        latencies.append(now - last)
+        last = now
+    conn.close()
+    ok = hashlib.sha256(image).digest() == manifest[update_server.MANIFEST_KEY_SHA256]
+    return {"ok": ok, "seconds": time.monotonic() - start, "chunk_latency": percentiles(latencies),
+            "requests": 1, "refetched": 0}
+
+
+def download_parallel(port, board, manifest, connections):
+    size = manifest[update_server.MANIFEST_KEY_SIZE]
+    chunk_size = manifest[update_server.MANIFEST_KEY_CHUNK_SIZE]
+    hashes = manifest[update_server.MANIFEST_KEY_CHUNK_HASHES]
+    state = {"next": 0, "commit": 0, "error": None, "requests": 0, "refetched": 0}
+    ready = {}
+    latencies = []
+    changed = threading.Condition()
+    image = bytearray(size)
+
+    def fetch(conn, index):
+        start = index * chunk_size
+        end = min(start + chunk_size, size) - 1
+        for attempt in range(CHUNK_ATTEMPTS):
+            with changed:
+                state["requests"] += 1
+                state["refetched"] += attempt > 0
+            try:
+                conn.request('GET', f'/api/firmware?board={board}', headers={'Range': f'bytes={start}-{end}'})
+                response = conn.getresponse()
+                data = response.read()
+                if response.status == 206 and hashlib.sha256(data).digest()[:CHUNK_HASH_LEN] == \
+                        hashes[index][:CHUNK_HASH_LEN]:
+                    return conn, data
+            except (OSError, http.client.HTTPException):
+                pass
+            conn.close()
+            conn = http.client.HTTPConnection('127.0.0.1', port, timeout=60)
+        raise RuntimeError(f"Chunk {index} kept failing")
+
+    def worker():
+        conn = http.client.HTTPConnection('127.0.0.1', port, timeout=60)
+        while True:
+            with changed:
+                while state["error"] is None and state["next"] < len(hashes) and \
+                        state["next"] >= state["commit"] + connections:
+                    changed.wait()
+                if state["error"] is not None or state["next"] >= len(hashes):
+                    break
+                index = state["next"]
+                state["next"] += 1
+            started = time.monotonic()
+            try:
+                conn, data = fetch(conn, index)
+            except RuntimeError as e:
+                with changed:
+                    state["error"] = str(e)
+                    changed.notify_all()
+                break
+            with changed:
+                latencies.append(time.monotonic() - started)
+                ready[index] = data
+                changed.notify_all()
+                while index in ready and state["error"] is None:
+                    changed.wait()
+        conn.close()
+
+    start = time.monotonic()
+    threads = [threading.Thread(target=worker) for _ in range(connections)]
+    for thread in threads:
+        thread.start()
+    with changed:
+        while state["commit"] < len(hashes) and state["error"] is None:
+            if state["commit"] not in ready:
+                changed.wait()
+                continue
+            data = ready.pop(state["commit"])
+            image[state["commit"] * chunk_size:state["commit"] * chunk_size + len(data)] = data
+            state["commit"] += 1
+            changed.notify_all()
+    for thread in threads:
+        thread.join()
+
+    ok = state["error"] is None and hashlib.sha256(image).digest() == manifest[update_server.MANIFEST_KEY_SHA256]
+    return {"ok": ok, "seconds": time.monotonic() - start, "chunk_latency": percentiles(latencies),
+            "requests": state["requests"], "refetched": state["refetched"]}
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Single stream vs parallel chunked download over a lossy link')
+    parser.add_argument('--image-size', type=int, default=256 * 1024, help='Payload size of the served image')
+    parser.add_argument('--connections', type=int, nargs='+', default=[2, 3], help='Parallel connection counts')
+    parser.add_argument('--flow-rate', type=float, default=150e3, help='Bytes/s of one connection')
+    parser.add_argument('--link-rate', type=float, default=1e6, help='Bytes/s of all connections together')
+    parser.add_argument('--loss', type=float, default=0.01, help='Probability that a segment is lost')
+    parser.add_argument('--rto', type=float, default=0.3, help='Stall in seconds after a lost segment')
+    parser.add_argument('--corrupt', type=float, default=0.0, help='Probability that a segment arrives corrupted')
+    parser.add_argument('--runs', type=int, default=3, help='Runs per mode, the median run is reported')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    board = 'bench'
+    workdir = tempfile.mkdtemp(prefix='ota-parallel-')
+    image_path = os.path.join(workdir, 'builds', board, update_server.LATEST_IMAGE)
+    os.makedirs(os.path.dirname(image_path))
+    with open(image_path, 'wb') as f:
+        f.write(sim_flow.make_image('1.0.1', random.Random(args.seed).randbytes(args.image_size)))
+
+    logging_level = update_server.logger.level
+    update_server.logger.setLevel('WARNING')
+    server = update_server.make_server(os.path.join(workdir, 'builds'), 0, board)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    manifest = fetch_manifest(server.server_address[1], board)
+
+    modes = [('single', None)] + [(f'parallel_{n}', n) for n in args.connections]
+    result = {"image_size": manifest[update_server.MANIFEST_KEY_SIZE],
+              "chunk_size": manifest[update_server.MANIFEST_KEY_CHUNK_SIZE]}
+    try:
+        for name, connections in modes:
+            runs = []
+            for run in range(args.runs):
+                link = LossyLink(server.server_address[1], args.flow_rate, args.link_rate, args.loss, args.rto,
+                                 args.corrupt, args.seed + run)
+                try:
+                    if connections is None:
+                        runs.append(download_single(link.port, board, manifest))
+                    else:
+                        runs.append(download_parallel(link.port, board, manifest, connections))
+                finally:
+                    link.close()
+            runs.sort(key=lambda r: r["seconds"])
+            median = runs[len(runs) // 2]
+            result[name] = {
+                "ok": all(r["ok"] for r in runs),
+                "seconds": round(median["seconds"], 2),
+                "bytes_per_sec": int(result["image_size"] / median["seconds"]),
+                "chunk_latency": median["chunk_latency"],
+                "requests": median["requests"],
+                "refetched": median["refetched"],
+            }
+    finally:
+        server.shutdown()
+        server.server_close()
+        update_server.logger.setLevel(logging_level)
+        shutil.rmtree(workdir, ignore_errors=True)
+        shutil.rmtree(server.catalog.snapshot_dir, ignore_errors=True)
+
+    print(json.dumps(result, indent=2))
+    return 0 if all(result[name]["ok"] for name, _ in modes) else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
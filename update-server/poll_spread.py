@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+"""
+Simulates the version check load of a fleet that boots at the same moment,
+e.g. after a site-wide power restore, on a virtual clock.
+
+Devices follow the poll scheduling of ota_mgmt.c in three variants:
+  fixed   every check exactly OTA_CHECK_INTERVAL_SEC after the last one (the old behaviour)
+  jitter  startup jitter, then the interval +- OTA_POLL_JITTER_PCT
+  server  startup jitter, then the Retry-After hint of update_server.PollScheduler
+
+Prints the checks per minute (peak, mean, standard deviation) after the first
+interval, when the fleet should have settled, so the spikes of lockstep
+polling are easy to compare with the spread ones.
+"""
+
+import argparse
+import heapq
+import json
+import random
+import statistics
+import sys
+
+import update_server
+
+CHECK_INTERVAL = 3600         # OTA_CHECK_INTERVAL_SEC in app_config.h
+JITTER_PCT = 10               # OTA_POLL_JITTER_PCT
+STARTUP_JITTER = 30           # OTA_STARTUP_JITTER_SEC
+SERVER_POLL_MIN = 10          # OTA_SERVER_POLL_MIN_SEC
+
+
+def simulate(policy, devices, hours, rng):
+    scheduler = update_server.PollScheduler(CHECK_INTERVAL)
+    end = hours * 3600
+    per_minute = [0] * (end // 60)
+
+    if policy == 'fixed':
+        due = [(0.0, d) for d in range(devices)]
+    else:
+        due = [(rng.uniform(0, STARTUP_JITTER), d) for d in range(devices)]
+    heapq.heapify(due)
+
+    while due:
+        now, device = heapq.heappop(due)
+        if now >= end:
+            break
+        per_minute[int(now // 60)] += 1
+
+        if policy == 'fixed':
+            delay = CHECK_INTERVAL
+        elif policy == 'jitter':
+            jitter = CHECK_INTERVAL * JITTER_PCT // 100
+            delay = CHECK_INTERVAL - jitter + rng.randint(0, 2 * jitter)
+        else:
+            delay = max(scheduler.next_poll(now), SERVER_POLL_MIN)
+        heapq.heappush(due, (now + delay, device))
+
+    settled = per_minute[CHECK_INTERVAL // 60:]
+    return {
+        "peak_per_min": max(settled),
+        "mean_per_min": round(statistics.mean(settled), 1),
+        "stdev_per_min": round(statistics.pstdev(settled), 1),
+        "first_minute": per_minute[0],
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Version check load of a fleet booting at once')
+    parser.add_argument('--devices', type=int, default=5000, help='Fleet size')
+    parser.add_argument('--hours', type=int, default=6, help='Simulated time')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    if args.hours < 2:
+        parser.error('--hours must be at least 2, the first interval is not evaluated')
+
+    result = {}
+    for policy in ('fixed', 'jitter', 'server'):
+        result[policy] = simulate(policy, args.devices, args.hours, random.Random(args.seed))
+    print(json.dumps(result, indent=2))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""
+Measures the release-to-download-start latency of the /api/wait push channel.
+
+Starts update_server.py locally on a builds directory holding a copy of a
+signed image and simulates a device the way ota_notify.c and ota_mgmt.c
+behave: long-poll /api/wait, then /api/version, then /api/firmware. Each run publishes a new release by
+atomically replacing the served image with one carrying a bumped version, and
+records how long it takes until the simulated device requests the firmware.
+
+Exits with 1 if a run exceeds --max-latency.
+"""
+
+import argparse
+import http.client
+import json
+import os
+import shutil
+import statistics
+import struct
+import sys
+import tempfile
+import threading
+import time
+
+import update_server
+
+# offset of ih_ver.iv_revision in the MCUboot header
+REVISION_OFFSET = 22
+
+
+class SimulatedDevice(threading.Thread):
+    def __init__(self, port, board, version):
+        super().__init__(daemon=True)
+        self.port = port
+        self.board = board
+        self.version = version
+        self.download_started = threading.Event()
+        self.download_started_at = None
+
+    def run(self):
+        wait_conn = http.client.HTTPConnection('127.0.0.1', self.port)
+        ota_conn = http.client.HTTPConnection('127.0.0.1', self.port)
+        while True:
+            wait_conn.request('GET', f'/api/wait?version={self.version}&board={self.board}&timeout=30')
+            announced = json.loads(wait_conn.getresponse().read())['version']
+            if announced == self.version:
+                continue
+
+            ota_conn.request('GET', f'/api/version?version={self.version}&board={self.board}')
+            info = json.loads(ota_conn.getresponse().read())
+            if info['version'] == self.version:
+                continue
+
+            self.download_started_at = time.monotonic()
+            ota_conn.request('GET', f'/api/firmware?board={self.board}')
+            ota_conn.getresponse().read()
+            self.version = info['version']
+            self.download_started.set()
+
+
+def release(path, image, revision):
+    data = bytearray(image)
+    struct.pack_into('<H', data, REVISION_OFFSET, revision)
+    tmp_path = path + '.tmp'
+    with open(tmp_path, 'wb') as f:
+        f.write(data)
+    os.replace(tmp_path, path)
+    return time.monotonic()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Push notification latency measurement')
+    parser.add_argument('--firmware', required=True, help='Signed image to serve')
+    parser.add_argument('--board', default=update_server.BOARD, help='Board the image is released for')
+    parser.add_argument('--port', type=int, default=8089, help='Port for the local server')
+    parser.add_argument('--runs', type=int, default=5, help='Number of releases to publish')
+    parser.add_argument('--max-latency', type=float, default=2.0, help='Allowed latency per release in seconds')
+    args = parser.parse_args()
+
+    with open(args.firmware, 'rb') as f:
+        image = f.read()
+    info = update_server.read_image_info(image)
+
+    workdir = tempfile.mkdtemp(prefix='ota-push-')
+    firmware_path = os.path.join(workdir, args.board, update_server.LATEST_IMAGE)
+    os.makedirs(os.path.dirname(firmware_path))
+    shutil.copyfile(args.firmware, firmware_path)
+
+    server = update_server.make_server(workdir, args.port, args.board)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+
+    device = SimulatedDevice(args.port, args.board, info['version'])
+    device.start()
+
+    latencies = []
+    try:
+        for run in range(args.runs):
+            # let the device settle in its long-poll
+            time.sleep(1)
+            device.download_started.clear()
+            released_at = release(firmware_path, image, 1000 + run)
+            if not device.download_started.wait(args.max_latency + 10):
+                print(f"run {run}: device never started the download")
+                return 1
+            latency = device.download_started_at - released_at
+            latencies.append(latency)
+            print(f"run {run}: release -> download start {latency * 1000:.1f} ms")
+    finally:
+        server.shutdown()
+        shutil.rmtree(workdir, ignore_errors=True)
+        shutil.rmtree(server.catalog.snapshot_dir, ignore_errors=True)
+
+    print(f"min {min(latencies) * 1000:.1f} ms, median {statistics.median(latencies) * 1000:.1f} ms, "
+          f"max {max(latencies) * 1000:.1f} ms (hourly polling: up to {3600 * 1000} ms)")
+    return 0 if max(latencies) <= args.max_latency else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
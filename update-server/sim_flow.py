@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+"""
+Runs the full OTA flow against the native_sim build of the app, no hardware needed.
+
+The flash simulator's backing file gets an image with version 1.0.0 in
+slot0, a local update server serves 1.0.1 of the same size. The simulated
+device then checks, downloads into slot1 and requests the upgrade. Afterwards
+slot1 must hold the served image plus the MCUboot upgrade request.
+
+Download time, flash write count and the other per-phase timings come from
+the device log and the stats report it posts to /api/stats. They are written
+as JSON, and the run fails if --max-download-ms is exceeded, so CI catches
+performance regressions.
+
+Build the app first: west build -b native_sim app -d build-sim
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import random
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+
+import update_server
+
+SERVER_PORT = 8090            # OTA_SERVER_PORT of the native_sim build in app_config.h
+HEADER_SIZE = 0x200
+ERASED = 0xff
+
+# written to the end of slot1 by boot_request_upgrade(), see bootutil's boot_img_magic
+BOOT_MAGIC = bytes([0x77, 0xc2, 0x95, 0xf3, 0x60, 0xd2, 0xef, 0x7f,
+                    0x35, 0x52, 0x50, 0x0f, 0x2c, 0xb6, 0x79, 0x80])
+
+
+def make_image(version, payload):
+    """Builds an unsigned MCUboot image (header, payload, SHA-256 TLV), enough for the app and the server."""
+    major, minor, revision = (int(part) for part in version.split('.'))
+    header = struct.pack(update_server.IMAGE_HEADER_FORMAT, update_server.IMAGE_MAGIC, 0, HEADER_SIZE, 0,
+                         len(payload), 0, major, minor, revision, 0)
+    body = header.ljust(HEADER_SIZE, b'\0') + payload
+    digest = hashlib.sha256(body).digest()
+    tlv = struct.pack('<BBH', update_server.IMAGE_TLV_SHA256, 0, len(digest)) + digest
+    return body + struct.pack('<HH', update_server.IMAGE_TLV_INFO_MAGIC, 4 + len(tlv)) + tlv
+
+
+def read_partitions(build_dir):
+    """Offsets and sizes of the flash partitions from the generated devicetree."""
+    with open(os.path.join(build_dir, 'zephyr', 'zephyr.dts')) as f:
+        dts = f.read()
+
+    partitions = {}
+    for match in re.finditer(r'(\w+)_partition: partition@\w+ \{[^}]*?reg = < (0x[0-9a-f]+) (0x[0-9a-f]+) >', dts):
+        partitions[match.group(1)] = (int(match.group(2), 16), int(match.group(3), 16))
+    if 'slot0' not in partitions or 'slot1' not in partitions:
+        raise RuntimeError("No slot0/slot1 partitions in zephyr.dts")
+    return partitions
+
+
+def read_board(build_dir):
+    with open(os.path.join(build_dir, 'zephyr', '.config')) as f:
+        match = re.search(r'^CONFIG_BOARD_TARGET="(.+)"$', f.read(), re.MULTILINE)
+    return match.group(1).replace('/', '_')
+
+
+def run(build_dir, image_size=256 * 1024, from_version='1.0.0', to_version='1.0.1', timeout=120,
+        port=SERVER_PORT, verbose=False):
+    partitions = read_partitions(build_dir)
+    board = read_board(build_dir)
+    slot0_off, _ = partitions['slot0']
+    slot1_off, slot1_size = partitions['slot1']
+
+    rng = random.Random(1)
+    old_payload = rng.randbytes(image_size)
+    # a release changes parts of the image, the rest stays compressible like real firmware
+    new_payload = bytearray(old_payload)
+    for pos in range(0, image_size, 4096):
+        new_payload[pos:pos + 64] = bytes(64)
+    running = make_image(from_version, old_payload)
+    served = make_image(to_version, bytes(new_payload))
+
+    workdir = tempfile.mkdtemp(prefix='ota-sim-')
+    flash_file = os.path.join(workdir, 'flash.bin')
+    flash_size = max(off + size for off, size in partitions.values())
+    flash = bytearray([ERASED]) * flash_size
+    flash[slot0_off:slot0_off + len(running)] = running
+    with open(flash_file, 'wb') as f:
+        f.write(flash)
+
+    firmware_path = os.path.join(workdir, 'builds', board, update_server.LATEST_IMAGE)
+    os.makedirs(os.path.dirname(firmware_path))
+    with open(firmware_path, 'wb') as f:
+        f.write(served)
+
+    server = update_server.make_server(os.path.join(workdir, 'builds'), port, board)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+
+    exe = os.path.join(build_dir, 'zephyr', 'zephyr.exe')
+    device = subprocess.Popen([exe, f'--flash={flash_file}'], stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                              text=True, errors='replace')
+    log = []
+    result = {"board": board, "image_size": len(served), "ok": False}
+    # the device runs until killed, stop it once the upgrade is requested or the time is up
+    watchdog = threading.Timer(timeout, device.kill)
+    watchdog.start()
+    try:
+        for line in device.stdout:
+            log.append(line)
+            if verbose:
+                sys.stdout.write(line)
+            if "Update ready" in line:
+                break
+    finally:
+        watchdog.cancel()
+        device.kill()
+        device.wait()
+        server.shutdown()
+        server.server_close()
+
+    output = ''.join(log)
+    match = re.search(r'Download took (\d+) ms \(time to first byte (\d+) ms\), (\d+) sectors erased, (\d+) already',
+                      output)
+    if match:
+        result.update(download_ms=int(match.group(1)), first_byte_ms=int(match.group(2)),
+                      sectors_erased=int(match.group(3)), sectors_blank=int(match.group(4)))
+
+    reports = server.stats.snapshot()
+    if reports:
+        report = reports[-1]
+        names = list(report.get('phases_us', {}))
+        counts = dict(zip(names, report.get('phase_count', [])))
+        result.update(flash_writes=counts.get('flash_write'), bytes_written=report.get('bytes_written'),
+                      phases_us=report.get('phases_us'), write_max_us=report.get('write_max_us'))
+
+    with open(flash_file, 'rb') as f:
+        f.seek(slot1_off)
+        slot1 = f.read(slot1_size)
+    result['image_matches'] = slot1[:len(served)] == served
+    result['upgrade_requested'] = BOOT_MAGIC in slot1[-len(BOOT_MAGIC) * 2:]
+    result['ok'] = "Update ready" in output and result['image_matches'] and result['upgrade_requested']
+
+    shutil.rmtree(workdir, ignore_errors=True)
+    shutil.rmtree(server.catalog.snapshot_dir, ignore_errors=True)
+    if not result['ok'] and not verbose:
+        sys.stdout.write(output[-4000:])
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description='OTA flow on the native_sim build')
+    parser.add_argument('--build-dir', required=True, help='Zephyr build directory of the native_sim app')
+    parser.add_argument('--image-size', type=int, default=256 * 1024, help='Payload size of the served image')
+    parser.add_argument('--timeout', type=float, default=120, help='Seconds until the flow must be done')
+    parser.add_argument('--max-download-ms', type=int, help='Fail if the download takes longer')
+    parser.add_argument('--output', help='Write the JSON result to this file instead of stdout')
+    parser.add_argument('--verbose', action='store_true', help='Show the device log')
+    args = parser.parse_args()
+
+    result = run(args.build_dir, args.image_size, timeout=args.timeout, verbose=args.verbose)
+    if args.max_download_ms is not None and result.get('download_ms', args.max_download_ms + 1) > args.max_download_ms:
+        result['ok'] = False
+
+    output = json.dumps(result, indent=2)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(output + "\n")
+    else:
+        print(output)
+    return 0 if result['ok'] else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -3,11 +3,27 @@
 import json
 import os
 import argparse
+import collections
+import ctypes
+import ctypes.util
+import functools
+import glob
+import hashlib
 import logging
-import subprocess
+import random
+import select
 import shutil
-import os
-from http.server import HTTPServer, BaseHTTPRequestHandler
+import struct
+import tempfile
+import threading
+import time
+from http.server import ThreadingHTTPServer, BaseHTTPRequestHandler
+from urllib.parse import urlparse, parse_qs
+
+try:
+    import lz4.block
+except ImportError:
+    lz4 = None
 
 # Configure logging
 logging.basicConfig(
@@ -18,74 +34,974 @@ logger = logging.getLogger(__name__)
 
 # Default values
 DEFAULT_PORT = 8080
-BOARD = "esp32s3_devkitc_esp32s3_procpu"
-DEFAULT_FIRMWARE_PATH = os.path.join("..", "zephyr-project", "builds", BOARD, "latest", "zephyr.signed.bin")
+BOARD = "esp32s3_devkitc_esp32s3_procpu"     # for devices that don't send their board
+DEFAULT_BUILDS_DIR = os.path.join("..", "zephyr-project", "builds")
+LATEST_IMAGE = os.path.join("latest", "zephyr.signed.bin")
+
+# MCUboot image layout (see bootutil/image.h)
+IMAGE_MAGIC = 0x96f3b83d
+IMAGE_HEADER_FORMAT = '<IIHHII BBHI'
+IMAGE_TLV_INFO_MAGIC = 0x6907
+IMAGE_TLV_SHA256 = 0x10
+
+# Delta patch format, must match ota_delta.h on the device
+DELTA_MAGIC = b'ZDP1'
+DELTA_OP_COPY = 0x01
+DELTA_OP_INSERT = 0x02
+DELTA_BLOCK = 16              # minimum match length worth a COPY
+DELTA_MAX_RATIO = 0.8         # only offer patches noticeably smaller than the image
+
+# Compressed transport, must match ota_lz4.h on the device
+LZ4_ENCODING = 'x-lz4-blocks'
+LZ4_BLOCK_SIZE = 4096
+LZ4_FRAME_STORED = 0x80000000
+
+# Devices keep their connection open between the version check and the download
+KEEPALIVE_TIMEOUT = 30        # seconds an idle connection is kept before closing it
+
+# Firmware catalog, reloaded when builds/<board>/ changes
+CATALOG_SETTLE_TIME = 0.2     # seconds without file events before a change is picked up
+CATALOG_POLL_INTERVAL = 1.0   # rescan interval where inotify isn't available
+CATALOG_RESCAN_INTERVAL = 60  # rescan anyway with inotify, e.g. for changes it can't see on network shares
+
+# Push notification of new releases via long-poll on /api/wait
+WAIT_DEFAULT_TIMEOUT = 240    # long-poll duration if the device doesn't ask for one
+WAIT_MAX_TIMEOUT = 600
+RELEASE_ID_LEN = 16           # hex digits of the image SHA-256 that tell rebuilds of a version apart
+
+# Binary update manifest, sent instead of the JSON version info to devices that accept CBOR
+MANIFEST_CONTENT_TYPE = 'application/cbor'
+MANIFEST_FORMAT = 1           # OTA_MANIFEST_FORMAT in ota_manifest.h
+MANIFEST_CHUNK_SIZE = 4096    # bytes covered by each chunk hash
+MANIFEST_KEY_FORMAT = 0       # map keys, see enum ota_manifest_key
+MANIFEST_KEY_VERSION = 1
+MANIFEST_KEY_SIZE = 2
+MANIFEST_KEY_SHA256 = 3
+MANIFEST_KEY_CHUNK_SIZE = 4
+MANIFEST_KEY_CHUNK_HASHES = 5
+MANIFEST_KEY_ENCODINGS = 6
+MANIFEST_KEY_DELTA_SIZE = 7
+
+# Poll scheduling, /api/version answers carry a Retry-After that spreads the fleet's next checks
+DEFAULT_POLL_INTERVAL = 3600  # OTA_CHECK_INTERVAL_SEC in app_config.h, 0 disables the hint
+POLL_SLOT = 10                # seconds per slot the next checks are booked into
+POLL_SPREAD = 0.25            # the next check lands within +-25 % of the interval
+
+# Rollout control, devices over a limit are told to retry later (503 with Retry-After on /api/version)
+ROLLOUT_ADMISSION_TTL = 120   # seconds an admitted device's download slot is held until /api/firmware
+ROLLOUT_RETRY = 30            # Retry-After for devices waiting for a download slot, jittered by +-50 %
+ROLLOUT_QUEUE_TIMEOUT = 300   # a waiting device that didn't come back within this is dropped from the queue
+THROTTLE_CHUNK = 16 * 1024    # bytes sent per token bucket reservation
+CHUNK_LINGER = 10             # seconds a device keeps its download slot between the Range requests of a chunked download
+ROLLOUT_MAX_BODY = 1024
+
+# Update timings reported by the devices after each download
+STATS_HISTORY = 1000          # reports kept in memory for GET /api/stats
+STATS_MAX_BODY = 4096
+
+class FirmwareImage:
+    """A signed image of the catalog. path is a private, immutable copy of the build output."""
+    def __init__(self, board, source, path, info, sha256, stat_key):
+        self.board = board
+        self.source = source
+        self.path = path
+        self.version = info['version']
+        self.build_num = info['build_num']
+        self.size = os.path.getsize(path)
+        self.sha256 = sha256
+        self.stat_key = stat_key
+
+    @property
+    def sort_key(self):
+        return tuple(int(part) for part in self.version.split('.')), self.build_num
+
+class Inotify:
+    """Just enough of inotify(7) through ctypes to learn that a directory changed."""
+    EVENTS = 0x2 | 0x8 | 0x40 | 0x80 | 0x100 | 0x200   # MODIFY, CLOSE_WRITE, MOVED_FROM/TO, CREATE, DELETE
+
+    def __init__(self):
+        self.libc = ctypes.CDLL(ctypes.util.find_library('c') or 'libc.so.6', use_errno=True)
+        self.fd = self.libc.inotify_init1(os.O_CLOEXEC)
+        if self.fd < 0:
+            raise OSError(ctypes.get_errno(), "inotify_init1 failed")
+
+    def add_watch(self, path):
+        # watching a directory twice just returns the existing watch
+        return self.libc.inotify_add_watch(self.fd, os.fsencode(path), self.EVENTS) >= 0
+
+    def wait(self, timeout=None):
+        """Returns True if there were events, consuming them."""
+        readable, _, _ = select.select([self.fd], [], [], timeout)
+        if not readable:
+            return False
+        os.read(self.fd, 64 * 1024)
+        return True
+
+class FirmwareCatalog:
+    """
+    In-memory index of the signed images in builds/<board>/, by board and version.
+    builds/<board>/latest/zephyr.signed.bin is the released image of a board,
+    <board>_<version>_<tweak>.bin files (as written by build.ps1) are older
+    builds kept as delta bases.
+
+    Versions are read from the MCUboot headers. Each image is served from a
+    private copy, so a build overwriting a file never affects downloads in
+    flight, and the index is swapped atomically when the directory changes.
+    Devices waiting in /api/wait are woken when the latest image of their
+    board changes.
+    """
+    def __init__(self, builds_dir):
+        self.builds_dir = os.path.abspath(builds_dir)
+        self.snapshot_dir = tempfile.mkdtemp(prefix='ota-catalog-')
+        self.images = {}          # source path -> FirmwareImage
+        self.boards = {}          # board -> {'latest': FirmwareImage, 'versions': {version: FirmwareImage}}
+        self.released_at = {}     # board -> time.monotonic() when its latest image changed
+        self.changed = threading.Condition()
+        self.listeners = []       # called on the watcher thread after each rescan
+        self.rescan()
+        threading.Thread(target=self.watch, name="catalog-watcher", daemon=True).start()
+
+    def latest(self, board):
+        entry = self.boards.get(board)
+        return entry['latest'] if entry else None
+
+    def find(self, board, version):
+        entry = self.boards.get(board)
+        return entry['versions'].get(version) if entry else None
+
+    def wait(self, board, known_version, known_release, timeout):
+        """
+        Blocks until the latest image of board differs from known_release (a
+        release ID, so a rebuild of the same version counts too), or from
+        known_version for waiters that don't name a release, or the timeout
+        passed. Returns the latest image.
+        """
+        def released():
+            image = self.latest(board)
+            if image is None:
+                return False
+            if known_release:
+                return image.sha256[:RELEASE_ID_LEN] != known_release
+            return image.version != known_version
+
+        with self.changed:
+            self.changed.wait_for(released, timeout)
+            return self.latest(board)
+
+    def sources(self):
+        if not os.path.isdir(self.builds_dir):
+            return
+        for board in sorted(os.listdir(self.builds_dir)):
+            board_dir = os.path.join(self.builds_dir, board)
+            if not os.path.isdir(board_dir):
+                continue
+            latest = os.path.join(board_dir, LATEST_IMAGE)
+            if os.path.isfile(latest):
+                yield board, latest, True
+            for path in sorted(glob.glob(os.path.join(board_dir, '*.bin'))):
+                yield board, path, False
+
+    def watched_dirs(self):
+        yield self.builds_dir
+        for board in os.listdir(self.builds_dir):
+            board_dir = os.path.join(self.builds_dir, board)
+            if os.path.isdir(board_dir):
+                yield board_dir
+                yield os.path.join(board_dir, 'latest')
+
+    def rescan(self):
+        images = {}
+        boards = {}
+        for board, path, is_latest in self.sources():
+            image = self.load(board, path)
+            if image is None:
+                continue
+            images[path] = image
+            entry = boards.setdefault(board, {'latest': None, 'versions': {}})
+            known = entry['versions'].get(image.version)
+            if known is None or image.sort_key > known.sort_key:
+                entry['versions'][image.version] = image
+            if is_latest:
+                entry['latest'] = image
+        for entry in boards.values():
+            if entry['latest'] is None:
+                entry['latest'] = max(entry['versions'].values(), key=lambda image: image.sort_key)
+
+        with self.changed:
+            for board, entry in boards.items():
+                old = self.latest(board)
+                if old is None or old.sha256 != entry['latest'].sha256:
+                    logger.info(f"{board}: serving {entry['latest'].version} ({entry['latest'].source}), "
+                                f"{len(entry['versions'])} versions known")
+                    if old is not None:
+                        self.released_at[board] = time.monotonic()
+            old_images = self.images
+            self.images = images
+            self.boards = boards
+            self.changed.notify_all()
+        for listener in self.listeners:
+            listener()
+
+        # downloads still reading a removed copy keep their open file
+        in_use = {image.path for image in images.values()}
+        for image in old_images.values():
+            if image.path not in in_use and os.path.exists(image.path):
+                os.unlink(image.path)
+
+    def load(self, board, path):
+        try:
+            st = os.stat(path)
+        except OSError:
+            return None
+        stat_key = (st.st_mtime_ns, st.st_size)
+        cached = self.images.get(path)
+        if cached is not None and cached.stat_key == stat_key:
+            return cached
+
+        try:
+            with open(path, 'rb') as f:
+                data = f.read()
+            info = read_image_info(data)
+        except (OSError, ValueError, struct.error) as e:
+            # most likely still being written, keep the previous content until it is complete
+            logger.debug(f"Skipping {path}: {e}")
+            return cached
+
+        sha256 = hashlib.sha256(data).hexdigest()
+        snapshot = os.path.join(self.snapshot_dir, f"{board}-{sha256[:16]}.bin")
+        if not os.path.exists(snapshot):
+            with open(snapshot + '.tmp', 'wb') as f:
+                f.write(data)
+            os.replace(snapshot + '.tmp', snapshot)
+        return FirmwareImage(board, path, snapshot, info, sha256, stat_key)
+
+    def watch(self):
+        try:
+            inotify = Inotify()
+        except (OSError, AttributeError) as e:
+            logger.info(f"inotify unavailable ({e}), rescanning {self.builds_dir} every {CATALOG_POLL_INTERVAL} s")
+            inotify = None
+
+        while True:
+            if inotify is None:
+                time.sleep(CATALOG_POLL_INTERVAL)
+            else:
+                try:
+                    for path in self.watched_dirs():
+                        inotify.add_watch(path)
+                except OSError as e:
+                    # e.g. the builds directory doesn't exist yet, nothing to wait for until it does
+                    logger.debug(f"Can't watch {self.builds_dir}: {e}")
+                    time.sleep(CATALOG_POLL_INTERVAL)
+                else:
+                    if inotify.wait(CATALOG_RESCAN_INTERVAL):
+                        # let copies finish before looking at the files
+                        while inotify.wait(CATALOG_SETTLE_TIME):
+                            pass
+            try:
+                self.rescan()
+            except OSError as e:
+                logger.warning(f"Catalog rescan failed: {e}")
+
+
+class DeltaCache:
+    """
+    Builds patches from older images of a board to its latest image and
+    keeps them in memory. Building takes seconds for a MB sized image, so a
+    background thread does it whenever the catalog changes and get_patch()
+    never waits; devices get the full image until their patch is ready.
+    """
+    def __init__(self, catalog):
+        self.catalog = catalog
+        self.patches = {}                       # (base sha256, target sha256) -> patch, None if not worth it
+        self.queue = collections.deque()        # (key, base, target) waiting to be built
+        self.lock = threading.Lock()
+        self.queued = threading.Condition(self.lock)
+        threading.Thread(target=self.build_loop, name="delta-builder", daemon=True).start()
+        catalog.listeners.append(self.prebuild)
+        self.prebuild()
+
+    def get_patch(self, board, from_version):
+        """Returns the patch if it is built, otherwise queues it and returns None."""
+        target = self.catalog.latest(board)
+        base = self.catalog.find(board, from_version) if from_version else None
+        if target is None or base is None or base.sha256 == target.sha256:
+            return None
+
+        key = (base.sha256, target.sha256)
+        with self.lock:
+            if key in self.patches:
+                return self.patches[key]
+            self.enqueue(key, base, target)
+            return None
+
+    def prebuild(self):
+        """Queues the patches from every known version of each board to its latest image."""
+        boards = dict(self.catalog.boards)
+        targets = {entry['latest'].sha256 for entry in boards.values()}
+        with self.lock:
+            # patches against an older release are no use anymore
+            self.patches = {k: v for k, v in self.patches.items() if k[1] in targets}
+            self.queue = collections.deque(item for item in self.queue if item[0][1] in targets)
+            for entry in boards.values():
+                target = entry['latest']
+                for base in entry['versions'].values():
+                    key = (base.sha256, target.sha256)
+                    if base.sha256 != target.sha256 and key not in self.patches:
+                        self.enqueue(key, base, target)
+
+    def enqueue(self, key, base, target):
+        # called with self.lock held
+        if all(item[0] != key for item in self.queue):
+            self.queue.append((key, base, target))
+            self.queued.notify()
+
+    def build_loop(self):
+        while True:
+            with self.lock:
+                self.queued.wait_for(lambda: self.queue)
+                key, base, target = self.queue[0]
+            try:
+                patch = self.build(base, target)
+                built = True
+            except OSError as e:
+                # an image replaced meanwhile, the next request or rescan queues it again
+                logger.warning(f"Building patch {base.version} -> {target.version} failed: {e}")
+                built = False
+            with self.lock:
+                # prebuild() drops it from the queue if a release made it useless meanwhile
+                if self.queue and self.queue[0][0] == key:
+                    self.queue.popleft()
+                    if built:
+                        self.patches[key] = patch
+
+    def build(self, base, target):
+        with open(base.path, 'rb') as f:
+            old = f.read()
+        with open(target.path, 'rb') as f:
+            new = f.read()
+        patch = make_delta(old, new)
+        if len(patch) > DELTA_MAX_RATIO * len(new):
+            logger.info(f"Patch from {base.version} is {len(patch)} bytes, not worth it")
+            return None
+        logger.info(f"Built patch {os.path.basename(base.source)} -> {target.version}: "
+                    f"{len(patch)} bytes ({len(new)} bytes full image)")
+        return patch
+
+class DeviceStats:
+    """The last STATS_HISTORY update timing reports posted by devices."""
+    def __init__(self):
+        self.reports = collections.deque(maxlen=STATS_HISTORY)
+        self.lock = threading.Lock()
+
+    def add(self, report):
+        with self.lock:
+            self.reports.append(report)
+
+    def snapshot(self):
+        with self.lock:
+            return list(self.reports)
+
+class PollScheduler:
+    """
+    Books the next version check of every device into the least busy
+    POLL_SLOT within +-POLL_SPREAD of the poll interval. Devices that polled
+    in lockstep, e.g. after a power restore, are spread over the whole range
+    within one interval.
+    """
+    def __init__(self, interval, slot=POLL_SLOT, spread=POLL_SPREAD):
+        self.interval = interval
+        self.slot = slot
+        self.spread = spread
+        self.booked = collections.Counter()     # slot number (epoch seconds // slot) -> checks due
+        self.lock = threading.Lock()
+
+    def next_poll(self, now=None):
+        """Seconds until the device should check again."""
+        now = time.time() if now is None else now
+        first = int((now + self.interval * (1 - self.spread)) // self.slot)
+        last = int((now + self.interval * (1 + self.spread)) // self.slot)
+        with self.lock:
+            current = int(now // self.slot)
+            for past in [s for s in self.booked if s < current]:
+                del self.booked[past]
+            chosen = min(range(first, last + 1), key=lambda s: (self.booked[s], random.random()))
+            self.booked[chosen] += 1
+        return max(1, int(chosen * self.slot + random.uniform(0, self.slot) - now))
+
+class TokenBucket:
+    """Rate limit in bytes per second with bursts of up to one second of traffic."""
+    def __init__(self, rate):
+        self.rate = rate
+        self.tokens = rate
+        self.updated = time.monotonic()
+        self.lock = threading.Lock()
+
+    def reserve(self, n):
+        """Takes n bytes worth of tokens and returns the seconds to wait before sending them."""
+        with self.lock:
+            now = time.monotonic()
+            self.tokens = min(self.rate, self.tokens + (now - self.updated) * self.rate)
+            self.updated = now
+            # going negative queues the senders in the order they asked
+            self.tokens -= n
+            return max(0.0, -self.tokens / self.rate)
+
+class RolloutController:
+    """
+    Decides which devices may download the latest image:
+    - a staged rollout lets a stable share of the devices (by hash of device
+      and version) update, raised with POST /api/rollout as confidence grows
+    - at most max_concurrent devices hold a download slot, taken when
+      /api/version admits them and released when their download ends
+    - downloads are throttled by a global and a per-download token bucket
+    Devices are identified by their 'device' query parameter, or their address.
+    """
+    def __init__(self, max_concurrent=0, percent=100, global_rate=0, client_rate=0):
+        self.max_concurrent = max_concurrent
+        self.percent = percent
+        self.client_rate = client_rate
+        self.global_bucket = TokenBucket(global_rate) if global_rate > 0 else None
+        self.reserved = {}                      # device -> monotonic time its admission expires
+        self.active = collections.Counter()     # device -> running downloads
+        self.buckets = {}                       # device -> per-client token bucket, shared by its connections
+        self.waiting = {}                       # device -> monotonic time it was last deferred
+        self.sessions = set()                   # devices in a download, across the chunk requests of a parallel one
+        self.counters = collections.Counter()
+        self.lock = threading.Lock()
+
+    def in_stage(self, device, version):
+        digest = hashlib.sha256(f"{version}:{device}".encode()).digest()
+        return int.from_bytes(digest[:4], 'big') % 100 < self.percent
+
+    def admit(self, device, version):
+        """Returns None if the device may download version, otherwise why it has to wait ('stage' or 'capacity')."""
+        with self.lock:
+            now = time.monotonic()
+            self.expire(now)
+            if device in self.reserved or device in self.active:
+                return None
+            if not self.in_stage(device, version):
+                self.counters['deferred_stage'] += 1
+                return 'stage'
+            if self.max_concurrent > 0 and len(self.reserved.keys() | self.active.keys()) >= self.max_concurrent:
+                self.waiting[device] = now
+                self.counters['deferred_capacity'] += 1
+                return 'capacity'
+            self.waiting.pop(device, None)
+            self.reserved[device] = now + ROLLOUT_ADMISSION_TTL
+            self.counters['admitted'] += 1
+            return None
+
+    def start_download(self, device):
+        """Takes the download slot of an admitted device, or a free one for a device resuming without a check."""
+        with self.lock:
+            now = time.monotonic()
+            self.expire(now)
+            holder = device in self.reserved or device in self.active
+            if not holder and self.max_concurrent > 0 and \
+                    len(self.reserved.keys() | self.active.keys()) >= self.max_concurrent:
+                self.counters['rejected_downloads'] += 1
+                return False
+            self.reserved.pop(device, None)
+            self.active[device] += 1
+            if device not in self.sessions:
+                self.sessions.add(device)
+                self.counters['downloads_started'] += 1
+            return True
+
+    def end_download(self, device, sent, partial=False):
+        """partial: the request fetched one chunk, more are likely to follow, so the slot is held a little longer."""
+        with self.lock:
+            self.active[device] -= 1
+            if self.active[device] <= 0:
+                del self.active[device]
+                self.buckets.pop(device, None)
+                if partial:
+                    self.reserved[device] = time.monotonic() + CHUNK_LINGER
+                else:
+                    self.sessions.discard(device)
+            self.counters['bytes_sent'] += sent
+
+    def expire(self, now):
+        for device in [d for d, until in self.reserved.items() if until < now]:
+            del self.reserved[device]
+            if device in self.sessions:
+                # no further chunk within CHUNK_LINGER, the chunked download is over
+                self.sessions.discard(device)
+            else:
+                self.counters['admissions_expired'] += 1
+        for device in [d for d, at in self.waiting.items() if at + ROLLOUT_QUEUE_TIMEOUT < now]:
+            del self.waiting[device]
+
+    def configure(self, percent=None, max_concurrent=None):
+        with self.lock:
+            if percent is not None:
+                self.percent = percent
+            if max_concurrent is not None:
+                self.max_concurrent = max_concurrent
+
+    def client_bucket(self, device):
+        """The per-client rate limit of a device, parallel connections of a device share it."""
+        if self.client_rate <= 0:
+            return None
+        with self.lock:
+            return self.buckets.setdefault(device, TokenBucket(self.client_rate))
+
+    def throttle(self, n, client_bucket):
+        """Blocks until n more bytes of a download may be sent."""
+        wait = 0.0
+        if self.global_bucket:
+            wait = self.global_bucket.reserve(n)
+        if client_bucket:
+            wait = max(wait, client_bucket.reserve(n))
+        if wait > 0:
+            time.sleep(wait)
+
+    @property
+    def throttled(self):
+        return self.global_bucket is not None or self.client_rate > 0
+
+    def metrics(self):
+        with self.lock:
+            self.expire(time.monotonic())
+            return {
+                "rollout_percent": self.percent,
+                "max_concurrent": self.max_concurrent,
+                "global_rate": self.global_bucket.rate if self.global_bucket else 0,
+                "client_rate": self.client_rate,
+                "active_downloads": sum(self.active.values()),
+                "reserved_slots": len(self.reserved),
+                "queue_depth": len(self.waiting),
+                **{name: self.counters[name] for name in ('admitted', 'deferred_capacity', 'deferred_stage',
+                                                          'rejected_downloads', 'admissions_expired',
+                                                          'downloads_started', 'bytes_sent')},
+            }
+
+class OTAServer(ThreadingHTTPServer):
+    """
+    One thread per connection, so a slow device or an idle keep-alive
+    connection doesn't block the others. Bodies are either streamed from the
+    file or shared cached buffers, memory doesn't grow with the downloads.
+    """
+    daemon_threads = True
+    request_queue_size = 512    # listen backlog for a fleet connecting at once
 
 class OTAHandler(BaseHTTPRequestHandler):
-    def __init__(self, *args, version, firmware_path=DEFAULT_FIRMWARE_PATH, **kwargs):
-        self.version = version
-        self.firmware_path = firmware_path
+    # HTTP/1.1 keeps connections alive unless the client asks otherwise,
+    # every response therefore needs a Content-Length
+    protocol_version = 'HTTP/1.1'
+    timeout = KEEPALIVE_TIMEOUT
+    # the headers go out in their own small write, with Nagle the body would wait for the
+    # device's delayed ACK of them, on every request of a chunked download
+    disable_nagle_algorithm = True
+
+    def __init__(self, *args, catalog, deltas=None, stats=None, polls=None, rollout=None, default_board=BOARD,
+                 **kwargs):
+        self.catalog = catalog
+        self.deltas = deltas
+        self.stats = stats
+        self.polls = polls
+        self.rollout = rollout
+        self.default_board = default_board
         super().__init__(*args, **kwargs)
-    
+
     def log_message(self, format, *args):
         logger.info("%s - %s", self.address_string(), format % args)
     
     def do_GET(self):
-        if self.path == '/api/version':
-            firmware_size = 0
-            if os.path.exists(self.firmware_path):
-                firmware_size = os.path.getsize(self.firmware_path)
-            else:
-                logger.warning(f"Firmware file not found: {self.firmware_path}")
+        url = urlparse(self.path)
+        query = parse_qs(url.query)
+        # devices send their board target (esp32_devkitc/esp32/procpu), build directories use underscores
+        board = query.get('board', [self.default_board])[0].replace('/', '_')
+        device = query.get('device', [self.client_address[0]])[0]
+
+        if url.path == '/api/metrics' and self.rollout is not None:
+            body = json.dumps(self.rollout.metrics()).encode()
+            self.send_response(200)
+            self.send_header('Content-type', 'application/json')
+            self.send_header('Content-Length', str(len(body)))
+            self.send_header('Cache-Control', 'no-store')
+            self.end_headers()
+            self.wfile.write(body)
+            return
+
+        if url.path == '/api/stats' and self.stats is not None:
+            body = json.dumps(self.stats.snapshot()).encode()
+            self.send_response(200)
+            self.send_header('Content-type', 'application/json')
+            self.send_header('Content-Length', str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+            return
+
+        if url.path not in ('/api/version', '/api/wait', '/api/firmware'):
+            logger.warning(f"Unknown path requested: {self.path}")
+            self.send_text(404, "Not found")
+            return
+
+        image = self.catalog.latest(board)
+        if image is None:
+            logger.warning(f"No firmware for board {board}")
+            self.send_text(404, "Unknown board")
+            return
+
+        if url.path == '/api/version':
+            device_version = query.get('version', [None])[0]
+            device_build = query.get('build', [None])[0]
+            # the device also takes a rebuild of its version, see process_manifest() in ota_mgmt.c
+            is_update = device_version != image.version or \
+                (device_build is not None and device_build != str(image.build_num))
+            if self.rollout is not None and is_update:
+                reason = self.rollout.admit(device, image.version)
+                if reason is not None:
+                    self.send_deferred(device, reason)
+                    return
+            patch = None
+            if self.deltas and device_version and device_version != image.version:
+                patch = self.deltas.get_patch(board, device_version)
             
-            version_info = {
-                "version": self.version,
-                "size": firmware_size
-            }
-            logger.info(f"Sending version info: {version_info}")
-            response_body = json.dumps(version_info).encode()
+            encodings = [LZ4_ENCODING] if compressed_firmware(image.path) else []
+            delta_size = len(patch) if patch else 0
+            if self.accepts(MANIFEST_CONTENT_TYPE):
+                version_info = {"version": image.version, "build": image.build_num, "size": image.size,
+                                "delta_size": delta_size, "encodings": encodings}
+                content_type = MANIFEST_CONTENT_TYPE
+                response_body = encode_manifest(image, encodings, delta_size)
+            else:
+                version_info = {
+                    "version": image.version,
+                    "size": image.size,
+                    "delta_size": delta_size,
+                    "encodings": ",".join(encodings),
+                    "sha256": image.sha256
+                }
+                content_type = 'application/json'
+                response_body = json.dumps(version_info).encode()
+            etag = '"' + hashlib.sha256(response_body).hexdigest()[:32] + '"'
+
+            if self.etag_matches(etag):
+                logger.info(f"Version info not modified for {device_version}")
+                self.send_response(304)
+                self.send_header('ETag', etag)
+                self.send_retry_after()
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+                return
+
+            logger.info(f"Sending version info for {board} ({content_type}, {len(response_body)} bytes): "
+                        f"{version_info}")
+            self.send_response(200)
+            self.send_header('Content-type', content_type)
+            self.send_header('Content-Length', str(len(response_body)))
+            self.send_header('ETag', etag)
+            self.send_header('Cache-Control', 'no-cache')
+            self.send_retry_after()
+            self.end_headers()
             
+            self.wfile.write(response_body)
+
+        elif url.path == '/api/wait':
+            try:
+                timeout = min(float(query.get('timeout', [WAIT_DEFAULT_TIMEOUT])[0]), WAIT_MAX_TIMEOUT)
+            except ValueError:
+                timeout = WAIT_DEFAULT_TIMEOUT
+            image = self.catalog.wait(board, query.get('version', [None])[0], query.get('release', [None])[0],
+                                      timeout)
+
+            response_body = json.dumps({"version": image.version if image else None,
+                                        "release": image.sha256[:RELEASE_ID_LEN] if image else None}).encode()
             self.send_response(200)
             self.send_header('Content-type', 'application/json')
             self.send_header('Content-Length', str(len(response_body)))
-            self.send_header('Connection', 'close')
+            self.send_header('Cache-Control', 'no-store')
             self.end_headers()
-            
             self.wfile.write(response_body)
 
-        elif self.path == '/api/firmware':
-            if os.path.exists(self.firmware_path):
-                firmware_size = os.path.getsize(self.firmware_path)
-                self.send_response(200)
-                self.send_header('Content-type', 'application/octet-stream')
-                self.send_header('Content-Length', str(firmware_size))
-                self.send_header('Connection', 'close') 
-                self.end_headers()
-                
-                logger.info(f"Sending firmware file: {self.firmware_path} ({firmware_size} bytes)")
-                with open(self.firmware_path, "rb") as f:
-                    self.wfile.write(f.read())
-                logger.info("Firmware sent successfully")
-            else:
-                logger.error(f"Firmware file not found: {self.firmware_path}")
-                self.send_response(404)
-                self.end_headers()
-                self.wfile.write(b"Firmware file not found")
         else:
-            logger.warning(f"Unknown path requested: {self.path}")
-            self.send_response(404)
-            self.send_header('Connection', 'close')
+            if self.rollout is not None and not self.rollout.start_download(device):
+                logger.info(f"Download of {device} deferred, all {self.rollout.max_concurrent} slots busy")
+                self.send_deferred(device, 'capacity')
+                return
+            self.sent = 0
+            self.device = device
+            try:
+                self.serve_firmware(board, image, query)
+            finally:
+                if self.rollout is not None:
+                    self.rollout.end_download(device, self.sent, partial=self.chunk_request())
+
+    def serve_firmware(self, board, image, query):
+        """Sends the latest image, a patch or the compressed image, whichever the device asked for."""
+        released_at = self.catalog.released_at.get(board)
+        first_request = self.headers.get('Range', 'bytes=0-').replace(' ', '').startswith('bytes=0-')
+        if released_at is not None and first_request:
+            latency = time.monotonic() - released_at
+            logger.info(f"Download of {board} {image.version} starting {latency:.3f} s after release")
+        from_version = query.get('from', [None])[0]
+        if from_version:
+            patch = self.deltas.get_patch(board, from_version) if self.deltas else None
+            if patch is None:
+                logger.warning(f"No patch available from version {from_version}")
+                self.send_text(404, "No patch available")
+                return
+            logger.info(f"Sending patch from {from_version} to {image.version}")
+            self.send_payload(patch)
+        elif LZ4_ENCODING in self.headers.get('Accept-Encoding', '') and compressed_firmware(image.path):
+            compressed = compressed_firmware(image.path)
+            logger.info(f"Sending compressed firmware: {image.source} ({len(compressed)} bytes)")
+            self.send_payload(compressed, content_encoding=LZ4_ENCODING)
+        else:
+            try:
+                f = open(image.path, "rb")
+            except FileNotFoundError:
+                # replaced by a release right now, the device retries
+                logger.error(f"Firmware file vanished: {image.source}")
+                self.send_text(404, "Firmware file not found")
+                return
+            # a chunked download sends one request per chunk, only log whole or resumed downloads
+            log = logger.debug if self.chunk_request() else logger.info
+            with f:
+                log(f"Sending firmware file: {image.source}")
+                self.send_file(f)
+            log("Firmware sent successfully")
+
+    def send_deferred(self, device, reason):
+        """Tells a device over a rollout limit to come back later."""
+        if reason == 'capacity':
+            retry = max(1, round(ROLLOUT_RETRY * random.uniform(0.5, 1.5)))
+        else:
+            # not part of the current stage, check again at the regular interval
+            retry = self.polls.next_poll() if self.polls else DEFAULT_POLL_INTERVAL
+        logger.info(f"Update of {device} deferred ({reason}), retry in {retry} s")
+        body = f"Update deferred ({reason})".encode()
+        self.send_response(503)
+        self.send_header('Content-type', 'text/plain')
+        self.send_header('Content-Length', str(len(body)))
+        self.send_header('Retry-After', str(retry))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def send_retry_after(self):
+        """Tells the device when to check next, see PollScheduler."""
+        if self.polls is not None:
+            self.send_header('Retry-After', str(self.polls.next_poll()))
+
+    def accepts(self, content_type):
+        """Whether the Accept request header lists content_type, parameters like q= are ignored."""
+        accept = self.headers.get('Accept', '')
+        return any(part.split(';')[0].strip() == content_type for part in accept.split(','))
+
+    def etag_matches(self, etag):
+        """Compares an If-None-Match request header against the current ETag (weak comparison, RFC 7232)."""
+        header = self.headers.get('If-None-Match')
+        if not header:
+            return False
+        candidates = [tag.strip().removeprefix('W/') for tag in header.split(',')]
+        return '*' in candidates or etag in candidates
+
+    def do_POST(self):
+        url = urlparse(self.path)
+        query = parse_qs(url.query)
+        length = int(self.headers.get('Content-Length', 0))
+
+        if url.path == '/api/rollout' and self.rollout is not None:
+            self.update_rollout(length)
+            return
+        if url.path != '/api/stats' or self.stats is None:
+            logger.warning(f"Unknown path posted to: {self.path}")
+            self.close_connection = True
+            self.send_text(404, "Not found")
+            return
+        if length > STATS_MAX_BODY:
+            self.close_connection = True
+            self.send_text(413, "Report too large")
+            return
+
+        try:
+            report = json.loads(self.rfile.read(length))
+        except ValueError:
+            report = None
+        if not isinstance(report, dict):
+            self.send_text(400, "Invalid report")
+            return
+
+        report['board'] = query.get('board', [self.default_board])[0].replace('/', '_')
+        report['version'] = query.get('version', [None])[0]
+        report['target'] = query.get('target', [None])[0]
+        report['device'] = query.get('device', [self.client_address[0]])[0]
+        report['received_at'] = time.time()
+        self.stats.add(report)
+
+        phases = report.get('phases_us', {})
+        logger.info(f"Update stats from {report['device']} ({report['version']} -> {report['target']}): "
+                    f"result {report.get('result')}, {report.get('bytes_received', 0)} bytes, "
+                    + ", ".join(f"{name} {us / 1000:.1f} ms" for name, us in phases.items() if us))
+        self.send_response(204)
+        self.send_header('Content-Length', '0')
+        self.end_headers()
+
+    def update_rollout(self, length):
+        """POST /api/rollout {"percent": 25, "max_concurrent": 10}, either field may be left out."""
+        if length > ROLLOUT_MAX_BODY:
+            self.close_connection = True
+            self.send_text(413, "Request too large")
+            return
+        try:
+            change = json.loads(self.rfile.read(length))
+        except ValueError:
+            change = None
+        if not isinstance(change, dict) or \
+                any(not isinstance(change.get(key, 0), int) or change.get(key, 0) < 0
+                    for key in ('percent', 'max_concurrent')) or change.get('percent', 0) > 100:
+            self.send_text(400, "Expected percent (0..100) and/or max_concurrent (0 = unlimited)")
+            return
+
+        self.rollout.configure(change.get('percent'), change.get('max_concurrent'))
+        metrics = self.rollout.metrics()
+        logger.info(f"Rollout now at {metrics['rollout_percent']} %, "
+                    f"at most {metrics['max_concurrent'] or 'unlimited'} concurrent downloads")
+        body = json.dumps(metrics).encode()
+        self.send_response(200)
+        self.send_header('Content-type', 'application/json')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def send_text(self, status, text):
+        body = text.encode()
+        self.send_response(status)
+        self.send_header('Content-type', 'text/plain')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def send_payload(self, payload, content_encoding=None):
+        """Sends a binary body held in memory (shared between requests), honoring a Range request header."""
+        byte_range = self.send_binary_headers(len(payload), content_encoding)
+        if byte_range is not None:
+            start, end = byte_range
+            self.send_throttled(start, end, lambda offset, n: self.wfile.write(memoryview(payload)[offset:offset + n]))
+
+    def send_file(self, f):
+        """
+        Streams an open file, honoring a Range request header. socket.sendfile()
+        uses os.sendfile() where available, so the image is never copied into
+        the process, whatever the number of concurrent downloads.
+        """
+        size = os.fstat(f.fileno()).st_size
+        byte_range = self.send_binary_headers(size)
+        if byte_range is not None:
+            start, end = byte_range
+            self.send_throttled(start, end, lambda offset, n: self.connection.sendfile(f, offset, n))
+
+    def send_throttled(self, start, end, send):
+        """Sends the inclusive range with send(offset, count), in token bucket sized pieces if downloads are rate limited."""
+        if self.rollout is None or not self.rollout.throttled:
+            send(start, end - start + 1)
+            self.sent = end - start + 1
+            return
+
+        bucket = self.rollout.client_bucket(self.device)
+        offset = start
+        while offset <= end:
+            n = min(THROTTLE_CHUNK, end - offset + 1)
+            self.rollout.throttle(n, bucket)
+            send(offset, n)
+            offset += n
+            self.sent = offset - start
+
+    def send_binary_headers(self, size, content_encoding=None):
+        """
+        Sends the status line and headers for a binary body of the given size.
+        Returns the inclusive (start, end) range to send, or None if there is no body to send.
+        """
+        byte_range = self.parse_range(size)
+        if byte_range is False:
+            logger.warning(f"Unsatisfiable range requested: {self.headers.get('Range')}")
+            self.send_response(416)
+            self.send_header('Content-Range', f'bytes */{size}')
+            self.send_header('Content-Length', '0')
             self.end_headers()
-            self.wfile.write(b"Not found")
+            return None
+
+        start, end = byte_range if byte_range else (0, size - 1)
+        if byte_range:
+            self.send_response(206)
+            self.send_header('Content-Range', f'bytes {start}-{end}/{size}')
+            if not self.chunk_request():
+                logger.info(f"Resuming at byte {start} of {size}")
+        else:
+            self.send_response(200)
+        self.send_header('Content-type', 'application/octet-stream')
+        if content_encoding:
+            self.send_header('Content-Encoding', content_encoding)
+        self.send_header('Accept-Ranges', 'bytes')
+        self.send_header('Content-Length', str(end - start + 1))
+        self.end_headers()
+        return start, end
+
+    def chunk_request(self):
+        """Whether the request asks for a bounded range ('bytes=start-end'), as the chunks of a parallel download do."""
+        unit, _, spec = self.headers.get('Range', '').partition('=')
+        start, _, end = spec.strip().partition('-')
+        return unit.strip() == 'bytes' and start.strip().isdigit() and end.strip().isdigit()
+
+    def parse_range(self, size):
+        """
+        Parses a single 'Range: bytes=start-[end]' header.
+        Returns None if no range was requested, False if it can't be satisfied
+        and a (start, end) tuple with inclusive offsets otherwise.
+        """
+        header = self.headers.get('Range')
+        if not header:
+            return None
+
+        unit, _, spec = header.partition('=')
+        if unit.strip() != 'bytes' or ',' in spec:
+            return False
+
+        start_str, _, end_str = spec.strip().partition('-')
+        try:
+            if start_str:
+                start = int(start_str)
+                end = int(end_str) if end_str else size - 1
+            else:
+                # suffix range: the last N bytes
+                start = max(size - int(end_str), 0)
+                end = size - 1
+        except ValueError:
+            return False
+
+        end = min(end, size - 1)
+        if start > end or start >= size:
+            return False
+        return start, end
+
+def make_server(builds_dir=DEFAULT_BUILDS_DIR, port=DEFAULT_PORT, default_board=BOARD,
+                poll_interval=DEFAULT_POLL_INTERVAL, rollout=None):
+    catalog = FirmwareCatalog(builds_dir)
+    deltas = DeltaCache(catalog)
+    stats = DeviceStats()
+    polls = PollScheduler(poll_interval) if poll_interval > 0 else None
+    rollout = rollout or RolloutController()
 
-def run_server(version, port=DEFAULT_PORT, firmware_path=DEFAULT_FIRMWARE_PATH):
     def handler(*args, **kwargs):
-        return OTAHandler(*args, version=version, firmware_path=firmware_path, **kwargs)
-    
-    server = HTTPServer(('0.0.0.0', port), handler)
+        return OTAHandler(*args, catalog=catalog, deltas=deltas, stats=stats, polls=polls, rollout=rollout,
+                          default_board=default_board, **kwargs)
+
+    server = OTAServer(('0.0.0.0', port), handler)
+    server.catalog = catalog
+    server.stats = stats
+    server.rollout = rollout
+    return server
+
+def run_server(builds_dir=DEFAULT_BUILDS_DIR, port=DEFAULT_PORT, default_board=BOARD,
+               poll_interval=DEFAULT_POLL_INTERVAL, rollout=None):
+    server = make_server(builds_dir, port, default_board, poll_interval, rollout)
     logger.info(f"OTA Server running on port {port}")
-    logger.info(f"Serving version: {version}")
-    logger.info(f"Firmware path: {firmware_path}")
+    logger.info(f"Builds directory: {os.path.abspath(builds_dir)}")
+    logger.info(f"Default board: {default_board}")
     
     try:
         server.serve_forever()
@@ -93,58 +1009,188 @@ def run_server(version, port=DEFAULT_PORT, firmware_path=DEFAULT_FIRMWARE_PATH):
         logger.info("Server stopped by user")
     finally:
         server.server_close()
+        shutil.rmtree(server.catalog.snapshot_dir, ignore_errors=True)
         logger.info("Server closed")
 
 
-def get_image_version(image_path: str) -> str:
-    if not shutil.which("imgtool"):
-        raise RuntimeError(
-            "imgtool not found. Please install it (e.g., 'pip install imgtool') "
-            "and ensure it is in your system's PATH."
-        )
-    
-    if not os.path.isfile(image_path):
-        raise FileNotFoundError(f"Image file not found at: {image_path}")
-    
-    command = ["imgtool", "verify", image_path]
+def read_image_info(data: bytes) -> dict:
+    """Parses the MCUboot header and the SHA-256 TLV of a signed image."""
+    (magic, _load_addr, hdr_size, protect_tlv_size, img_size, _flags,
+     major, minor, revision, build_num) = struct.unpack_from(IMAGE_HEADER_FORMAT, data, 0)
+    if magic != IMAGE_MAGIC:
+        raise ValueError("Not an MCUboot image")
 
-    try:
-        output = subprocess.run(
-            command,
-            capture_output=True,  # Capture stdout and stderr
-            text=True,            # Decode output as text
-            check=True            # Raise CalledProcessError for non-zero exit codes
-        )
+    off = hdr_size + img_size + protect_tlv_size
+    tlv_magic, tlv_tot = struct.unpack_from('<HH', data, off)
+    if tlv_magic != IMAGE_TLV_INFO_MAGIC:
+        raise ValueError("Image has no TLV area")
+    if len(data) < off + tlv_tot:
+        raise ValueError("Image is truncated")
+
+    sha256 = None
+    end = off + tlv_tot
+    off += 4
+    while off + 4 <= end:
+        tlv_type, _, tlv_len = struct.unpack_from('<BBH', data, off)
+        off += 4
+        if tlv_type == IMAGE_TLV_SHA256:
+            sha256 = data[off:off + tlv_len]
+        off += tlv_len
+
+    return {
+        "version": f"{major}.{minor}.{revision}",
+        "build_num": build_num,
+        "hdr_size": hdr_size,
+        "img_size": img_size,
+        "sha256": sha256,
+    }
+
+
+def cbor_encode(value) -> bytes:
+    """Encodes the subset of CBOR the manifest uses: unsigned ints, bytes, text, lists and int-keyed dicts."""
+    def head(major, arg):
+        if arg < 24:
+            return bytes([major << 5 | arg])
+        for info, fmt in ((24, '>B'), (25, '>H'), (26, '>I'), (27, '>Q')):
+            if arg < 1 << (8 * struct.calcsize(fmt)):
+                return bytes([major << 5 | info]) + struct.pack(fmt, arg)
+        raise ValueError(f"{arg} doesn't fit into 64 bits")
+
+    if isinstance(value, bool) or (isinstance(value, int) and value < 0):
+        raise TypeError(f"Unsupported manifest value {value!r}")
+    if isinstance(value, int):
+        return head(0, value)
+    if isinstance(value, (bytes, bytearray)):
+        return head(2, len(value)) + bytes(value)
+    if isinstance(value, str):
+        data = value.encode()
+        return head(3, len(data)) + data
+    if isinstance(value, (list, tuple)):
+        return head(4, len(value)) + b''.join(cbor_encode(item) for item in value)
+    if isinstance(value, dict):
+        return head(5, len(value)) + b''.join(cbor_encode(k) + cbor_encode(v) for k, v in value.items())
+    raise TypeError(f"Unsupported manifest value {value!r}")
 
-        for line in output.stdout.splitlines():
-            if line.strip().startswith("Image version:"):
-                raw_version_str = line.split(":", 1)[1].strip()
-                clean_version = raw_version_str.split("+", 1)[0]
 
-                return clean_version
+@functools.lru_cache(maxsize=8)
+def chunk_hashes(path: str, chunk_size=MANIFEST_CHUNK_SIZE):
+    """SHA-256 of each chunk_size piece of an image, the last one may be shorter."""
+    with open(path, 'rb') as f:
+        return tuple(hashlib.sha256(chunk).digest() for chunk in iter(lambda: f.read(chunk_size), b''))
 
-    except subprocess.CalledProcessError as e:
-        error_message = e.stderr.strip()
-        raise RuntimeError(
-            f"imgtool failed to get version for '{image_path}'.\n"
-            f"Exit Code: {e.returncode}\n"
-            f"Error: {error_message}"
-        )
+
+def encode_manifest(image, encodings, delta_size):
+    """The CBOR manifest of an image, see ota_manifest.h for the layout."""
+    major, minor, revision = (int(part) for part in image.version.split('.'))
+    return cbor_encode({
+        MANIFEST_KEY_FORMAT: MANIFEST_FORMAT,
+        MANIFEST_KEY_VERSION: [major, minor, revision, image.build_num],
+        MANIFEST_KEY_SIZE: image.size,
+        MANIFEST_KEY_SHA256: bytes.fromhex(image.sha256),
+        MANIFEST_KEY_CHUNK_SIZE: MANIFEST_CHUNK_SIZE,
+        MANIFEST_KEY_CHUNK_HASHES: list(chunk_hashes(image.path)),
+        MANIFEST_KEY_ENCODINGS: encodings,
+        MANIFEST_KEY_DELTA_SIZE: delta_size,
+    })
+
+
+def compressed_firmware(path):
+    """The LZ4 framed image, or None if compression is unavailable or doesn't pay off."""
+    if lz4 is None:
+        return None
+    return compress_lz4_blocks(path)
+
+
+@functools.lru_cache(maxsize=8)
+def compress_lz4_blocks(path: str):
+    """
+    Compresses an image into independent LZ4 blocks framed as expected by
+    ota_lz4.c. Returns None if the result isn't smaller than the image.
+    Catalog images never change, so the path is enough as cache key.
+    """
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    out = bytearray()
+    for off in range(0, len(data), LZ4_BLOCK_SIZE):
+        block = data[off:off + LZ4_BLOCK_SIZE]
+        compressed = lz4.block.compress(block, mode='high_compression', store_size=False)
+        if len(compressed) < len(block):
+            out.extend(struct.pack('<I', len(compressed)) + compressed)
+        else:
+            out.extend(struct.pack('<I', LZ4_FRAME_STORED | len(block)) + block)
+
+    if len(out) >= len(data):
+        logger.info(f"{path} doesn't compress, serving it uncompressed only")
+        return None
+
+    logger.info(f"Compressed {path}: {len(data)} -> {len(out)} bytes")
+    return bytes(out)
+
+
+def make_delta(old: bytes, new: bytes) -> bytes:
+    """
+    Builds a patch in the format applied by ota_delta.c: COPY ranges of the
+    old image plus INSERTed literals. Greedy matching on an index of the
+    old image at 4-byte aligned offsets (instruction alignment).
+    """
+    source_hash = read_image_info(old)['sha256']
+    if source_hash is None or len(source_hash) != 32:
+        raise ValueError("Base image has no SHA-256 TLV")
+
+    index = {}
+    for i in range(0, len(old) - DELTA_BLOCK + 1, 4):
+        index.setdefault(old[i:i + DELTA_BLOCK], i)
+
+    out = bytearray(DELTA_MAGIC + struct.pack('<II', len(old), len(new)) + source_hash)
+
+    def insert(start, end):
+        if end > start:
+            out.extend(struct.pack('<BI', DELTA_OP_INSERT, end - start))
+            out.extend(new[start:end])
+
+    literal_start = 0
+    i = 0
+    while i <= len(new) - DELTA_BLOCK:
+        j = index.get(new[i:i + DELTA_BLOCK])
+        if j is None:
+            i += 1
+            continue
+
+        length = DELTA_BLOCK
+        while i + length < len(new) and j + length < len(old) and new[i + length] == old[j + length]:
+            length += 1
+        while i > literal_start and j > 0 and new[i - 1] == old[j - 1]:
+            i -= 1
+            j -= 1
+            length += 1
+
+        insert(literal_start, i)
+        out.extend(struct.pack('<BII', DELTA_OP_COPY, j, length))
+        i += length
+        literal_start = i
+
+    insert(literal_start, len(new))
+    return bytes(out)
 
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='OTA Update Server')
     parser.add_argument('--port', type=int, default=DEFAULT_PORT, help='Server port')
-    parser.add_argument('--firmware', default=DEFAULT_FIRMWARE_PATH, help='Path to firmware binary')
+    parser.add_argument('--builds', default=DEFAULT_BUILDS_DIR, help='Directory with a subdirectory of images per board')
+    parser.add_argument('--board', default=BOARD, help='Board for devices that do not send one')
+    parser.add_argument('--poll-interval', type=int, default=DEFAULT_POLL_INTERVAL,
+                        help='Seconds between version checks the devices are told via Retry-After, 0 to not send it')
+    parser.add_argument('--max-concurrent', type=int, default=0, help='Concurrent downloads, 0 for unlimited')
+    parser.add_argument('--rollout-percent', type=int, default=100, choices=range(0, 101), metavar='0..100',
+                        help='Share of the devices offered the latest image, raise it with POST /api/rollout')
+    parser.add_argument('--global-rate', type=int, default=0, help='Bytes/s for all downloads together, 0 for unlimited')
+    parser.add_argument('--client-rate', type=int, default=0, help='Bytes/s per download, 0 for unlimited')
     parser.add_argument('--verbose', action='store_true', help='Enable verbose logging')
     
     args = parser.parse_args()
     
     if args.verbose:
         logger.setLevel(logging.DEBUG)
-    try:
-        version_number = get_image_version(args.firmware)
-        run_server(version_number, args.port, args.firmware)
-    except Exception as e:
-        print(e)
-        pass
+    rollout = RolloutController(args.max_concurrent, args.rollout_percent, args.global_rate, args.client_rate)
+    run_server(args.builds, args.port, args.board, args.poll_interval, rollout)
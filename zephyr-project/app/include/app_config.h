@@ -10,16 +10,88 @@
 /* WiFi Configuration */
 #define WIFI_SSID " :)"
 #define WIFI_PSK "Schaezler17"
+#define WIFI_PROBE_MAX_INTERVAL_SEC 30      // Longest pause between reachability probes of the OTA server
+#define WIFI_FAST_CONNECT_TIMEOUT_SEC 5     // Wait for the cached AP before falling back to a scan
+#define WIFI_LEASE_REUSE_MARGIN_SEC 60      // Lease time that must be left to reuse the address after a reboot
+#define WIFI_PROBE_STACK_SIZE 2048          // Own queue for the probe, its DNS lookup and connect block
+#define WIFI_PROBE_PRIORITY 10              // Preemptible, below the system work queue
 
 /* OTA Server Configuration */
+#ifdef CONFIG_BOARD_NATIVE_SIM
+#define OTA_SERVER_HOST "127.0.0.1"         // Host build talks to a local update server
+#define OTA_SERVER_PORT 8090                // update-server/sim_flow.py
+#else
 #define OTA_SERVER_HOST "172.27.48.159" //"192.168.2.86"  // Replace with your server IP
 #define OTA_SERVER_PORT 8080
+#endif
 #define OTA_VERSION_URL "/api/version"
 #define OTA_FIRMWARE_URL "/api/firmware"
+#define OTA_STATS_URL "/api/stats"
+#define OTA_BOARD_ID CONFIG_BOARD_TARGET   // Sent along so the server picks this board's images
+#define OTA_DEVICE_ID_MAX_LEN 8             // Bytes of the hardware ID sent as device=, hex encoded
 
 /* OTA Update Configuration */
 #define OTA_CHECK_INTERVAL_SEC 3600  // Check for updates every hour
 #define OTA_MAX_DOWNLOAD_RETRIES 3
+
+/* Image Confirmation (a test image is confirmed as soon as all health checks pass, see health.h) */
+#define HEALTH_MAX_CHECKS 8
+#define HEALTH_POLL_MS 200                  // Interval the checks are evaluated in until they all pass
+#define HEALTH_CONFIRM_TIMEOUT_SEC 180      // Reboot into the previous image if they don't pass by then
+
+/* OTA Poll Scheduling (keeps a fleet that booted together from polling in lockstep) */
+#define OTA_POLL_JITTER_PCT 10              // Regular checks are OTA_CHECK_INTERVAL_SEC +- this many percent
+#define OTA_RETRY_MIN_SEC 10                // First download retry after 5..10 s, doubling per retry
+#define OTA_ERROR_BACKOFF_MIN_SEC 60        // First check after a failed cycle after 30..60 s, doubling per failure
+#define OTA_ERROR_BACKOFF_MAX_SEC OTA_CHECK_INTERVAL_SEC
+#define OTA_SERVER_POLL_MIN_SEC 10          // Bounds for the Retry-After hint of the server
+#define OTA_SERVER_POLL_MAX_SEC (24 * 3600)
+#ifdef CONFIG_BOARD_NATIVE_SIM
+#define OTA_STARTUP_JITTER_SEC 0
+#else
+#define OTA_STARTUP_JITTER_SEC 30           // First check of a boot within 0..30 s after the network is ready
+#endif
 #define OTA_DOWNLOAD_TIMEOUT_MS 30000
+#define OTA_DNS_CACHE_TTL_SEC 600          // Re-resolve the server name after 10 minutes
+#define OTA_HTTP_RECV_TIMEOUT_SEC 30
+#define OTA_PROGRESS_SAVE_INTERVAL (32 * 1024)  // Persist download progress every 32 KiB written
+#define OTA_MANIFEST_MAX_CHUNKS 512         // Chunk hashes kept from the manifest, covers 2 MiB in 4 KiB chunks
+#define OTA_MANIFEST_CHUNK_HASH_LEN 8       // Bytes kept of each chunk hash (512 * 8 = 4 KiB of RAM)
+
+/* OTA Download Pipeline (network receive and flash writes overlap) */
+#define OTA_PIPELINE_DEPTH 4                // Number of buffers between receiver and flash writer
+#define OTA_PIPELINE_BUF_SIZE 1024          // Size of each pipeline buffer
+#define OTA_FLASH_WRITER_STACK_SIZE 2048
+#define OTA_FLASH_WRITER_PRIORITY 7
+
+/* OTA Image Validation (slot1 is checked like MCUboot would before the upgrade is requested) */
+#define OTA_VERIFY_READ_SIZE 1024           // Bytes of slot1 read back per hash update
+
+/* OTA Parallel Download (optional, raw images with chunk hashes in the manifest) */
+#define OTA_PARALLEL_ENABLE 0               // 1 fetches such images over several connections, 0 uses one stream
+#define OTA_PARALLEL_CONNECTIONS 3          // Concurrent Range requests, one worker thread and chunk buffer each
+#define OTA_PARALLEL_CHUNK_MAX 4096         // Largest manifest chunk size fetched in parallel
+#define OTA_PARALLEL_CHUNK_ATTEMPTS 4       // Requests per chunk before the download fails
+#define OTA_PARALLEL_RETRY_DELAY_MS 500     // Pause before fetching a failed chunk again
+#define OTA_PARALLEL_STACK_SIZE 3072
+#define OTA_PARALLEL_PRIORITY 10
+
+/* OTA Work Queue (checks, downloads and the apply step run here, not on the system work queue) */
+#define OTA_WORKQ_STACK_SIZE 4096
+#define OTA_WORKQ_PRIORITY 10               // Preemptible, below the system work queue
+#define OTA_YIELD_INTERVAL_BYTES (16 * 1024) // Download bytes between yields to threads of the same priority
+#define WORK_LATENCY_MAX_ITEMS 4            // Work items whose latency is tracked (see work_latency.h)
+#define WORK_LATENCY_PROBE_MS 50            // Probe period on the system work queue during an update
+
+/* OTA Push Notification (long-poll on /api/wait, hourly polling stays as fallback) */
+#define OTA_PUSH_ENABLED 1
+#define OTA_PUSH_WAIT_SEC 240               // Long-poll duration, below common NAT idle timeouts
+#define OTA_PUSH_RETRY_SEC 60               // Pause after a failed wait, e.g. server without push support
+#define OTA_NOTIFY_STACK_SIZE 3072
+#define OTA_NOTIFY_PRIORITY 10
+
+/* OTA Shell Benchmarks ('ota bench') */
+#define OTA_BENCH_MAX_SAMPLES 1024          // Latency samples kept per run, decimated beyond that
+#define OTA_BENCH_DEFAULT_SIZE (256 * 1024) // Bytes written by 'ota bench flash' without a size
 
 #endif /* APP_CONFIG_H */
\ No newline at end of file
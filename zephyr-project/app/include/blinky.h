@@ -1,6 +1,7 @@
 #ifndef BLINKY_H
 #define BLINKY_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -21,6 +22,13 @@ void blinky_set_interval(uint32_t interval_ms);
  */
 void blinky_set_state(int state);
 
+/**
+ * @brief Check if the LED is configured and blinking
+ *
+ * @return true once the blinky subsystem is initialized
+ */
+bool blinky_is_ready(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,50 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Confirmation of a test image by health checks. Subsystems register a check
+ * that tells whether they work, health_confirm_start() evaluates all of them
+ * every HEALTH_POLL_MS and confirms the image as soon as every one passes.
+ * If that doesn't happen within HEALTH_CONFIRM_TIMEOUT_SEC the device
+ * reboots without confirming, so MCUboot reverts to the previous image.
+ * A bootloader that can't revert (overwrite-only) keeps the image running
+ * instead, it is confirmed as soon as the checks pass after all.
+ */
+
+/**
+ * @brief A health check, called on the system work queue, must not block
+ *
+ * @return true if the checked subsystem works
+ */
+typedef bool (*health_check_t)(void);
+
+/**
+ * @brief Add a check that must pass before a test image is confirmed
+ *
+ * @param name  Name used in the log
+ * @param check Function returning the current state
+ *
+ * @return 0 on success, -ENOMEM if HEALTH_MAX_CHECKS are registered already
+ */
+int health_register(const char *name, health_check_t check);
+
+/**
+ * @brief Confirm the running test image once all checks pass
+ *
+ * Call once after boot if boot_is_img_confirmed() says the image runs in test mode.
+ *
+ * @param confirmed Called on the system work queue after the image was confirmed, may be NULL
+ */
+void health_confirm_start(void (*confirmed)(void));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HEALTH_H */
@@ -0,0 +1,56 @@
+#ifndef MCUBOOT_IMAGE_H
+#define MCUBOOT_IMAGE_H
+
+#include <stdint.h>
+#include <zephyr/toolchain.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Raw MCUboot image layout (see bootutil/image.h): header, payload, the
+ * protected TLV area (optional, covered by the image hash) and the
+ * unprotected TLV area with the hash, key hash and signature.
+ */
+#define IMAGE_MAGIC             0x96f3b83d
+#define IMAGE_TLV_INFO_MAGIC    0x6907
+#define IMAGE_TLV_PROT_INFO_MAGIC 0x6908
+
+#define IMAGE_TLV_KEYHASH       0x01    // SHA-256 of the public key the image was signed with
+#define IMAGE_TLV_SHA256        0x10    // SHA-256 of header, payload and protected TLVs
+#define IMAGE_TLV_ECDSA_SIG     0x22    // ECDSA signature (DER) of the SHA-256
+
+#define IMAGE_HASH_LEN          32
+#define IMAGE_ECDSA_SIG_MAX_LEN 72      // DER encoded P-256 signature, imgtool may pad it to this length
+
+struct raw_image_header {
+    uint32_t magic;
+    uint32_t load_addr;
+    uint16_t hdr_size;
+    uint16_t protect_tlv_size;
+    uint32_t img_size;
+    uint32_t flags;
+    uint8_t ver_major;
+    uint8_t ver_minor;
+    uint16_t ver_revision;
+    uint32_t ver_build_num;
+    uint32_t pad;
+} __packed;
+
+struct raw_tlv_info {
+    uint16_t magic;
+    uint16_t tlv_tot;
+} __packed;
+
+struct raw_tlv {
+    uint8_t type;
+    uint8_t pad;
+    uint16_t len;
+} __packed;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MCUBOOT_IMAGE_H */
@@ -0,0 +1,55 @@
+#ifndef OTA_BENCH_H
+#define OTA_BENCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum ota_bench_mode {
+    OTA_BENCH_NETWORK = 0,      // download the served image into a null sink
+    OTA_BENCH_FLASH,            // write a RAM pattern to slot1, erasing ahead like a download
+    OTA_BENCH_PIPELINE,         // download through the pipeline into slot1, like an update
+};
+
+struct ota_bench_result {
+    size_t bytes;
+    uint32_t elapsed_us;
+    uint32_t first_byte_us;     // network modes: request sent until the first body byte
+    uint32_t erase_us;          // flash modes: time spent erasing slot1 sectors
+    uint32_t samples;           // latency samples behind the percentiles
+    uint32_t p50_us;
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+};
+
+/**
+ * @brief Run a throughput benchmark
+ *
+ * Latencies are sampled per received chunk in the network modes (so flash
+ * backpressure shows up in the pipeline mode) and per write in the flash
+ * mode. The flash modes overwrite slot1, the OTA manager has to be paused
+ * with ota_pause() first.
+ *
+ * @param mode Part of the update path to measure
+ * @param size Bytes to write in OTA_BENCH_FLASH mode, 0 for
+ *             OTA_BENCH_DEFAULT_SIZE, ignored in the network modes
+ * @param[out] result Measured throughput and latencies
+ *
+ * @return 0 on success, negative error code otherwise
+ */
+int ota_bench_run(enum ota_bench_mode mode, size_t size, struct ota_bench_result *result);
+
+/**
+ * @brief Throughput of a benchmark in bytes per second
+ */
+uint32_t ota_bench_bytes_per_sec(const struct ota_bench_result *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OTA_BENCH_H */
@@ -0,0 +1,93 @@
+#ifndef OTA_DELTA_H
+#define OTA_DELTA_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Delta patch format (all integers little endian), as generated by update_server.py:
+ *
+ *   header:  "ZDP1" | source_size (u32) | target_size (u32) | source image SHA-256 (32 bytes)
+ *   ops:     0x01 COPY   | src_offset (u32) | length (u32)     -> copy bytes from the source image
+ *            0x02 INSERT | length (u32) | <length> bytes        -> literal bytes
+ *
+ * The source image is the one in slot0, identified by the SHA-256 from its MCUboot TLVs.
+ */
+#define OTA_DELTA_MAGIC "ZDP1"
+#define OTA_DELTA_HASH_SIZE 32
+#define OTA_DELTA_HEADER_SIZE (4 + 4 + 4 + OTA_DELTA_HASH_SIZE)
+#define OTA_DELTA_OP_COPY 0x01
+#define OTA_DELTA_OP_INSERT 0x02
+#define OTA_DELTA_COPY_BUF_SIZE 256
+
+/**
+ * @brief Callback receiving the reconstructed target image in order
+ *
+ * @return 0 on success, negative error code to abort patching
+ */
+typedef int (*ota_delta_write_cb)(const uint8_t *data, size_t len);
+
+enum ota_delta_state {
+    OTA_DELTA_STATE_HEADER = 0,
+    OTA_DELTA_STATE_OP,
+    OTA_DELTA_STATE_INSERT,
+};
+
+struct ota_delta_ctx {
+    enum ota_delta_state state;
+    uint8_t src_area_id;
+    ota_delta_write_cb write;
+    uint8_t source_hash[OTA_DELTA_HASH_SIZE];
+
+    /* header / op header bytes collected across fragments */
+    uint8_t hdr[OTA_DELTA_HEADER_SIZE];
+    size_t hdr_len;
+
+    uint32_t source_size;
+    uint32_t target_size;
+    uint32_t insert_remaining;
+    uint32_t written;
+
+    uint8_t copy_buf[OTA_DELTA_COPY_BUF_SIZE];
+};
+
+/**
+ * @brief Prepare a context for applying a patch against an image
+ *
+ * @param ctx          Context to initialize
+ * @param src_area_id  Flash area holding the source image (slot0)
+ * @param source_hash  SHA-256 of the source image, must match the patch header
+ * @param write        Sink for the reconstructed image
+ */
+void ota_delta_init(struct ota_delta_ctx *ctx, uint8_t src_area_id,
+                    const uint8_t source_hash[OTA_DELTA_HASH_SIZE], ota_delta_write_cb write);
+
+/**
+ * @brief Feed the next fragment of the patch stream
+ *
+ * Fragments may be split at arbitrary positions. COPY operations are
+ * executed through a fixed-size buffer, so RAM use does not depend on
+ * the patch or image size.
+ *
+ * @return 0 on success
+ * @return -EINVAL if the patch is malformed or was built for another source image
+ * @return A negative error code from the flash read or the write callback
+ */
+int ota_delta_process(struct ota_delta_ctx *ctx, const uint8_t *data, size_t len);
+
+/**
+ * @brief Check that the patch stream ended cleanly
+ *
+ * @return 0 if the complete target image was produced, -EINVAL otherwise
+ */
+int ota_delta_finish(const struct ota_delta_ctx *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OTA_DELTA_H */
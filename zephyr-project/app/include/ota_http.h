@@ -0,0 +1,73 @@
+#ifndef OTA_HTTP_H
+#define OTA_HTTP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/net/http/client.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Keep-alive HTTP connection to the update server
+ *
+ * The resolved server address is cached for OTA_DNS_CACHE_TTL_SEC and the
+ * TCP connection is kept open between requests, so the version check,
+ * the download and its retries share a single connection.
+ */
+struct ota_http_session {
+    const char *host;
+    int port;
+    int sock;
+    int recv_timeout_sec;   // socket receive timeout, defaults to OTA_HTTP_RECV_TIMEOUT_SEC
+    bool record_stats;      // account DNS and connect times in ota_stats
+
+    /* cached name resolution */
+    struct sockaddr addr;
+    socklen_t addrlen;
+    int64_t resolved_at;    // uptime in ms, 0 = nothing cached
+
+    uint32_t connects;      // number of TCP handshakes done
+    uint32_t requests;      // number of requests sent
+};
+
+/**
+ * @brief Initialize a session, does not touch the network yet
+ */
+void ota_http_session_init(struct ota_http_session *session, const char *host, int port);
+
+/**
+ * @brief Send a request over the session and receive the response
+ *
+ * Connects (resolving the host name if the cached address expired) when
+ * there is no open connection, or the open one was closed by the server
+ * while idle. The connection stays open afterwards unless the request
+ * failed or the server asked to close it.
+ *
+ * @param session    Session to use
+ * @param req        Request, see http_client_req()
+ * @param timeout_ms Timeout for the request
+ *
+ * @return Result of http_client_req()
+ * @return -EHOSTUNREACH if the host could not be resolved
+ * @return -ECONNREFUSED if no connection could be established
+ */
+int ota_http_request(struct ota_http_session *session, struct http_request *req, int32_t timeout_ms);
+
+/**
+ * @brief Close the connection, the cached address is kept
+ */
+void ota_http_close(struct ota_http_session *session);
+
+/**
+ * @brief Drop the cached address so the next connect resolves again
+ */
+void ota_http_invalidate_dns(struct ota_http_session *session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OTA_HTTP_H */
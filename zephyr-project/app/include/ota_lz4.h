@@ -0,0 +1,85 @@
+#ifndef OTA_LZ4_H
+#define OTA_LZ4_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Compressed firmware transport ("x-lz4-blocks"), as generated by update_server.py:
+ * the image is cut into OTA_LZ4_BLOCK_SIZE blocks (the last one may be shorter),
+ * each sent as a frame:
+ *
+ *   length (u32, little endian) | payload
+ *
+ * The payload is an LZ4 block that decompresses to one image block, or the raw
+ * block if OTA_LZ4_FRAME_STORED is set in the length (incompressible data).
+ * Blocks are independent, so decompression needs one block of window only.
+ */
+#define OTA_LZ4_ENCODING "x-lz4-blocks"
+#define OTA_LZ4_BLOCK_SIZE 4096
+#define OTA_LZ4_FRAME_STORED 0x80000000u
+#define OTA_LZ4_FRAME_MAX (OTA_LZ4_BLOCK_SIZE + OTA_LZ4_BLOCK_SIZE / 255 + 16) // LZ4_COMPRESSBOUND
+
+/**
+ * @brief Callback receiving each decompressed image block in order
+ *
+ * @return 0 on success, negative error code to abort decompression
+ */
+typedef int (*ota_lz4_write_cb)(const uint8_t *data, size_t len);
+
+struct ota_lz4_ctx {
+    ota_lz4_write_cb write;
+
+    uint8_t hdr[4];
+    size_t hdr_len;
+    uint32_t frame_len;
+    bool stored;
+
+    uint8_t in[OTA_LZ4_FRAME_MAX];
+    size_t in_len;
+    uint8_t out[OTA_LZ4_BLOCK_SIZE];
+
+    size_t consumed;    // compressed bytes of all completely processed frames
+};
+
+/**
+ * @brief Prepare a context for decompressing a new stream
+ */
+void ota_lz4_init(struct ota_lz4_ctx *ctx, ota_lz4_write_cb write);
+
+/**
+ * @brief Feed the next fragment of the compressed stream
+ *
+ * Fragments may be split at arbitrary positions, the output is only
+ * written in whole blocks.
+ *
+ * @return 0 on success
+ * @return -EINVAL if the stream is malformed
+ * @return A negative error code from the write callback
+ */
+int ota_lz4_process(struct ota_lz4_ctx *ctx, const uint8_t *data, size_t len);
+
+/**
+ * @brief Drop a partially received frame after an interrupted transfer
+ *
+ * @return Offset in the compressed stream to continue the transfer at
+ */
+size_t ota_lz4_resume_offset(struct ota_lz4_ctx *ctx);
+
+/**
+ * @brief Check that the stream ended on a frame boundary
+ *
+ * @return 0 on success, -EINVAL if the last frame is incomplete
+ */
+int ota_lz4_finish(const struct ota_lz4_ctx *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OTA_LZ4_H */
@@ -0,0 +1,154 @@
+#ifndef OTA_MANIFEST_H
+#define OTA_MANIFEST_H
+
+#include "app_config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <mbedtls/sha256.h>
+#include <zephyr/sys/util.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Update manifest ("application/cbor" answer of /api/version), as generated by
+ * update_server.py: one CBOR map with small integer keys, definite lengths only.
+ *
+ *   0: format (uint, OTA_MANIFEST_FORMAT)
+ *   1: version [major, minor, revision, build] (array of uint)
+ *   2: image size in bytes (uint)
+ *   3: SHA-256 of the whole image (bstr, 32 bytes)
+ *   4: chunk size in bytes (uint)
+ *   5: SHA-256 of each chunk of the image (array of bstr, 32 bytes each)
+ *   6: encodings the image can be downloaded in (array of tstr)
+ *   7: size of the patch against the version the device reported, 0 = none (uint)
+ *
+ * Unknown keys are skipped, so the server can add fields without a new format.
+ * The parser takes the answer in fragments of any size and keeps only the first
+ * OTA_MANIFEST_CHUNK_HASH_LEN bytes of up to OTA_MANIFEST_MAX_CHUNKS chunk hashes.
+ */
+#define OTA_MANIFEST_FORMAT 1
+#define OTA_MANIFEST_CONTENT_TYPE "application/cbor"
+
+enum ota_manifest_key {
+    OTA_MANIFEST_KEY_FORMAT = 0,
+    OTA_MANIFEST_KEY_VERSION,
+    OTA_MANIFEST_KEY_SIZE,
+    OTA_MANIFEST_KEY_SHA256,
+    OTA_MANIFEST_KEY_CHUNK_SIZE,
+    OTA_MANIFEST_KEY_CHUNK_HASHES,
+    OTA_MANIFEST_KEY_ENCODINGS,
+    OTA_MANIFEST_KEY_DELTA_SIZE,
+};
+
+#define OTA_MANIFEST_ENCODING_LZ4 BIT(0)
+
+#define OTA_MANIFEST_MAX_DEPTH 3    // map > array > item
+#define OTA_MANIFEST_TEXT_MAX 24    // longest encoding name that is recognized
+
+struct ota_manifest {
+    uint32_t format;
+    uint8_t major;
+    uint8_t minor;
+    uint16_t revision;
+    uint32_t build;
+    bool version_valid;
+    uint32_t size;
+    uint8_t sha256[32];
+    bool sha256_valid;
+    uint32_t chunk_size;
+    uint32_t chunk_count;           // chunk hashes kept, 0 if the server sent none or too many
+    uint8_t chunk_hash[OTA_MANIFEST_MAX_CHUNKS][OTA_MANIFEST_CHUNK_HASH_LEN];
+    uint32_t encodings;             // OTA_MANIFEST_ENCODING_* bits
+    uint32_t delta_size;
+};
+
+struct ota_manifest_parser {
+    struct ota_manifest *manifest;
+    int error;
+    bool done;
+
+    /* head of the current data item */
+    bool in_head;
+    uint8_t major_type;
+    uint8_t arg_len;
+    uint8_t arg_have;
+    uint64_t arg;
+
+    /* payload of the current byte or text string */
+    bool in_string;
+    uint32_t str_len;
+    uint32_t str_off;
+    char text[OTA_MANIFEST_TEXT_MAX];
+
+    /* open containers, items left and index of the next one */
+    struct {
+        bool is_map;
+        uint32_t left;
+        uint32_t index;
+    } stack[OTA_MANIFEST_MAX_DEPTH];
+    uint8_t depth;
+    int64_t key;                    // key of the top level value being parsed, -1 for none
+    uint32_t chunk_hashes_seen;
+};
+
+/* Checks each chunk of the image against the manifest while it is written */
+struct ota_chunk_verifier {
+    const struct ota_manifest *manifest;
+    mbedtls_sha256_context sha;
+    size_t offset;                  // image bytes seen so far
+};
+
+/**
+ * @brief Prepare a parser for a new answer, clears the manifest
+ */
+void ota_manifest_parser_init(struct ota_manifest_parser *parser, struct ota_manifest *manifest);
+
+/**
+ * @brief Feed the next fragment of the answer
+ *
+ * @return 0 on success
+ * @return -EBADMSG if the answer is not a manifest
+ * @return -ENOTSUP if the manifest has an unknown format
+ */
+int ota_manifest_parse(struct ota_manifest_parser *parser, const uint8_t *data, size_t len);
+
+/**
+ * @brief Check that the answer was a complete manifest
+ *
+ * Drops the chunk hashes if they don't cover the image exactly.
+ *
+ * @return 0 on success, -EBADMSG if it is incomplete or lacks the version or size
+ */
+int ota_manifest_finish(struct ota_manifest_parser *parser);
+
+/**
+ * @brief Check one complete chunk of the image against the manifest
+ *
+ * @return true if the manifest has a hash for chunk index and data matches it
+ */
+bool ota_manifest_chunk_matches(const struct ota_manifest *manifest, uint32_t index, const uint8_t *data,
+                                size_t len);
+
+/**
+ * @brief Start checking a new image against a parsed manifest
+ */
+void ota_chunk_verifier_start(struct ota_chunk_verifier *verifier, const struct ota_manifest *manifest);
+
+/**
+ * @brief Add the next bytes of the image
+ *
+ * Does nothing if the manifest has no chunk hashes.
+ *
+ * @return 0 on success, -EBADMSG if a completed chunk doesn't match its hash
+ */
+int ota_chunk_verifier_update(struct ota_chunk_verifier *verifier, const uint8_t *data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OTA_MANIFEST_H */
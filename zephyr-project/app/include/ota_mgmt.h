@@ -1,6 +1,8 @@
 #ifndef OTA_MGMT_H
 #define OTA_MGMT_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -30,11 +32,55 @@ typedef enum {
 
 /**
  * @brief Manually trigger an OTA update check
+ *
+ * The check runs asynchronously on the OTA work queue, so this may be
+ * called from any thread. The request is ignored there if an update is
+ * already in progress or slot1 is paused.
  * 
- * @return 0 if check was started, negative error code on failure
+ * @return 0 if the check was requested
+ * @return A negative error code if the request couldn't be queued
  */
 int ota_check_for_update(void);
 
+/**
+ * @brief Abort the running update cycle
+ *
+ * A running download stops at its next received chunk, a pending download
+ * or apply step is dropped. A partial full-image download stays persisted
+ * and is resumed by the next cycle, which starts after the usual check
+ * interval.
+ *
+ * @return 0 if the abort was requested
+ * @return -EALREADY if no update cycle is running
+ * @return -EBUSY if the update is already being applied
+ */
+int ota_abort_update(void);
+
+/**
+ * @brief Stop the OTA manager to use slot1 for something else (e.g. benchmarks)
+ *
+ * Only possible between update cycles. Pending checks are cancelled and a
+ * persisted partial download is discarded, as slot1 gets overwritten.
+ *
+ * @return 0 on success, -EBUSY if an update cycle is running
+ */
+int ota_pause(void);
+
+/**
+ * @brief Hand slot1 back to the OTA manager after ota_pause()
+ *
+ * Schedules an update check like after boot.
+ */
+void ota_resume(void);
+
+/**
+ * @brief Get the progress of the current download
+ *
+ * @param[out] written Bytes of the image written to slot1
+ * @param[out] total   Size of the image, 0 if no update is known
+ */
+void ota_get_download_progress(size_t *written, size_t *total);
+
 /**
  * @brief Get current OTA status
  * 
@@ -0,0 +1,77 @@
+#ifndef OTA_PARALLEL_H
+#define OTA_PARALLEL_H
+
+#include "ota_manifest.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/sys/atomic.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Parallel download of a raw image in the chunks listed by the manifest.
+ *
+ * OTA_PARALLEL_CONNECTIONS worker threads fetch chunks with Range requests,
+ * each over its own keep-alive connection, and check them against the
+ * manifest's chunk hash. A chunk that fails or doesn't match is fetched again
+ * on its own. Verified chunks are handed to the sink in image order on the
+ * caller's thread, so the sequential flash_img writer stays as it is. Workers
+ * stay at most OTA_PARALLEL_CONNECTIONS chunks ahead of the sink, one chunk
+ * buffer each, which bounds the RAM regardless of the image size.
+ */
+
+/**
+ * @brief Consumer of verified image data, called in image order
+ *
+ * @return 0 on success, negative error code to stop the download
+ */
+typedef int (*ota_parallel_sink_t)(const uint8_t *data, size_t len);
+
+struct ota_parallel_stats {
+    size_t bytes_received;      // body bytes received, including refetched chunks
+    uint32_t chunks;            // chunks handed to the sink
+    uint32_t refetched;         // chunk requests repeated after an error or a hash mismatch
+    uint32_t requests;          // chunk requests sent
+    uint32_t first_byte_us;     // until the first chunk reached the sink
+    uint32_t max_chunk_us;      // slowest chunk, from its first request until verified
+};
+
+/**
+ * @brief Whether an image with this manifest can be downloaded in parallel
+ *
+ * Needs chunk hashes in the manifest and chunks that fit the worker buffers.
+ * Always false unless OTA_PARALLEL_ENABLE is set and OTA_PARALLEL_CONNECTIONS is at least 2.
+ */
+bool ota_parallel_supported(const struct ota_manifest *manifest);
+
+/**
+ * @brief Download the image from offset on, blocks until done
+ *
+ * The chunk holding offset is fetched whole to verify it, the sink only
+ * gets the bytes from offset on.
+ *
+ * @param manifest Manifest of the image, must stay unchanged until this returns
+ * @param url      URL of the raw image, requested with Range headers
+ * @param offset   First image byte the sink needs
+ * @param sink     Consumer of the verified data
+ * @param abort    Download stops with -ECANCELED once this is set
+ * @param stats    Receives the counters of this download
+ *
+ * @return 0 on success
+ * @return -EBADMSG if a chunk kept failing its hash
+ * @return -EAGAIN if the server deferred the download (503)
+ * @return -ECANCELED if aborted
+ * @return The error of the sink, or of the last attempt of a chunk that kept failing
+ */
+int ota_parallel_download(const struct ota_manifest *manifest, const char *url, size_t offset,
+                          ota_parallel_sink_t sink, const atomic_t *abort, struct ota_parallel_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OTA_PARALLEL_H */
@@ -0,0 +1,52 @@
+#ifndef OTA_PIPELINE_H
+#define OTA_PIPELINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Consumer of the downloaded data, runs on the flash writer thread
+ *
+ * @return 0 on success, negative error code to stop consuming
+ */
+typedef int (*ota_pipeline_sink_t)(const uint8_t *data, size_t len);
+
+/**
+ * @brief Reset the pipeline for a new download
+ *
+ * Must only be called while the pipeline is idle (before the first
+ * submit or after ota_pipeline_sync()).
+ *
+ * @param sink Function the flash writer thread hands the data to
+ */
+void ota_pipeline_start(ota_pipeline_sink_t sink);
+
+/**
+ * @brief Queue received data for the flash writer thread
+ *
+ * The data is copied into the buffer ring, so the caller can reuse its
+ * receive buffer right away. Blocks while all ring buffers are in use
+ * (backpressure) instead of dropping data.
+ *
+ * @return 0 on success
+ * @return The first error returned by the sink
+ * @return -ETIMEDOUT if the writer did not free a buffer in time
+ */
+int ota_pipeline_submit(const uint8_t *data, size_t len);
+
+/**
+ * @brief Wait until all submitted data has been consumed
+ *
+ * @return 0 on success, the first error returned by the sink otherwise
+ */
+int ota_pipeline_sync(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OTA_PIPELINE_H */
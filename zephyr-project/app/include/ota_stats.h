@@ -0,0 +1,105 @@
+#ifndef OTA_STATS_H
+#define OTA_STATS_H
+
+#include "ota_mgmt.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Phases of an update cycle, times are summed over all attempts of the cycle */
+enum ota_phase {
+    OTA_PHASE_DNS = 0,          // name resolution
+    OTA_PHASE_CONNECT,          // TCP handshake
+    OTA_PHASE_VERSION_CHECK,    // version request until the response is processed
+    OTA_PHASE_PREPARE,          // flash image init, trailer erase, re-hash of a resumed prefix
+    OTA_PHASE_FIRST_BYTE,       // firmware request sent until the first body byte
+    OTA_PHASE_RECEIVE,          // first body byte until the response is complete
+    OTA_PHASE_ERASE,            // slot1 sector erases
+    OTA_PHASE_FLASH_WRITE,      // flash_img_buffered_write() calls
+    OTA_PHASE_VERIFY,           // final flush and image hash check
+    OTA_PHASE_VALIDATE,         // slot1 read back: header, TLVs, hash and signature as MCUboot checks them
+    OTA_PHASE_APPLY,            // boot_request_upgrade(), the swap itself runs in MCUboot after the reboot
+    OTA_PHASE_COUNT,
+};
+
+#define OTA_STATS_STATUS_COUNT (OTA_STATUS_SLEEPING + 1)
+#define OTA_STATS_CHUNK_BUCKETS 12      // bucket n counts received chunks of 2^n..2^(n+1)-1 bytes
+#define OTA_STATS_LATENCY_BUCKETS 16    // bucket n counts flash writes taking 2^n..2^(n+1)-1 us
+
+struct ota_stats {
+    uint32_t cycle;                                 // update cycles since boot, a cycle starts with a check
+    int32_t result;                                 // 0 or the error the cycle ended with
+    uint32_t status_at_us[OTA_STATS_STATUS_COUNT];  // last entry into each status, relative to the cycle start
+    uint32_t phase_us[OTA_PHASE_COUNT];
+    uint32_t phase_count[OTA_PHASE_COUNT];
+    uint32_t bytes_received;
+    uint32_t bytes_written;
+    uint32_t chunk_hist[OTA_STATS_CHUNK_BUCKETS];
+    uint32_t write_hist[OTA_STATS_LATENCY_BUCKETS];
+    uint32_t write_max_us;
+};
+
+/**
+ * @brief Timestamp in hardware cycles for the ota_stats_*() functions
+ */
+uint64_t ota_stats_now(void);
+
+/**
+ * @brief Record an OTA status transition, entering CHECKING starts a new cycle
+ */
+void ota_stats_status(ota_status_t status);
+
+/**
+ * @brief Add the time since start to a phase
+ *
+ * @param phase Phase to account the time to
+ * @param start Timestamp from ota_stats_now() taken when the phase began
+ */
+void ota_stats_phase(enum ota_phase phase, uint64_t start);
+
+/**
+ * @brief Record a chunk of firmware data received from the network
+ */
+void ota_stats_chunk(size_t len);
+
+/**
+ * @brief Record a write to slot1 that began at start
+ */
+void ota_stats_flash_write(size_t len, uint64_t start);
+
+/**
+ * @brief Finish the current cycle, a cycle that downloaded data becomes the last update
+ *
+ * @param result 0 or the error the cycle ended with
+ */
+void ota_stats_end_cycle(int result);
+
+/**
+ * @brief Copy the statistics
+ *
+ * @param[out] cur  Running cycle, may be NULL
+ * @param[out] last Last finished cycle that downloaded data, may be NULL
+ */
+void ota_stats_get(struct ota_stats *cur, struct ota_stats *last);
+
+/**
+ * @brief Name of a phase, as used in the JSON report
+ */
+const char *ota_stats_phase_name(enum ota_phase phase);
+
+/**
+ * @brief Serialize statistics as the JSON document posted to the update server
+ *
+ * @return Length of the document, -ENOMEM if buf is too small
+ */
+int ota_stats_to_json(const struct ota_stats *stats, char *buf, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OTA_STATS_H */
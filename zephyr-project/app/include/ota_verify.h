@@ -0,0 +1,45 @@
+#ifndef OTA_VERIFY_H
+#define OTA_VERIFY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Validation of a downloaded image the way MCUboot does it at boot: header,
+ * protected and unprotected TLV areas, the SHA-256 over header, payload and
+ * protected TLVs read back from flash, and the ECDSA-P256 signature of that
+ * hash. The public key is the one MCUboot was built with, sysbuild passes
+ * its key file on and CMakeLists.txt embeds it (OTA_VERIFY_SIGNATURE).
+ * Builds without MCUboot (native_sim) have no key and stop after the hash.
+ */
+
+struct ota_verify_result {
+    uint32_t hashed_bytes;      // header, payload and protected TLVs read back from flash
+    uint32_t hash_us;           // reading and hashing them
+    uint32_t signature_us;      // key check and ECDSA verification, 0 if not checked
+    uint32_t total_us;
+    bool signature_checked;
+};
+
+/**
+ * @brief Check that a slot holds an image MCUboot will accept
+ *
+ * @param area_id Flash area (slot) holding the image
+ * @param[out] result Timings of the check, also filled in on failure
+ *
+ * @return 0 if the image is valid
+ * @return -EBADMSG if the layout, hash or signature is invalid or the image is signed with another key
+ * @return -ENOMEM if the crypto library ran out of heap
+ * @return A negative error code from the flash functions on other failures
+ */
+int ota_verify_image(uint8_t area_id, struct ota_verify_result *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OTA_VERIFY_H */
@@ -2,6 +2,7 @@
 #define UTILS_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -33,6 +34,51 @@ void debug_image_headers(void);
  */
 int ota_get_running_firmware_version(char *buf, size_t buf_size);
 
+/**
+ * @brief Get the build number of the currently running firmware.
+ *
+ * Complements ota_get_running_firmware_version(), which only formats
+ * major, minor and revision.
+ *
+ * @param build_num Receives the build number from the image header.
+ *
+ * @return 0 on success.
+ * @return A negative error code if the image header could not be read.
+ */
+int ota_get_running_firmware_build(uint32_t *build_num);
+
+/**
+ * @brief Get the SHA-256 that MCUboot stored in an image's TLV area.
+ *
+ * The hash covers the image header and payload and uniquely identifies
+ * a build, without reading the whole image.
+ *
+ * @param area_id   Flash area (slot) holding the image.
+ * @param hash      Buffer receiving the hash.
+ * @param hash_len  Size of the buffer, at least 32 bytes.
+ *
+ * @return 0 on success.
+ * @return -EINVAL if the slot holds no valid image or no SHA-256 TLV.
+ * @return A negative error code from the flash functions on other failures.
+ */
+int ota_get_image_hash(uint8_t area_id, uint8_t *hash, size_t hash_len);
+
+/**
+ * @brief Get a stable ID of this device as a hex string.
+ *
+ * Formats the first OTA_DEVICE_ID_MAX_LEN bytes of the hardware ID
+ * (the factory MAC on ESP32), which the update server uses to tell
+ * devices apart behind the same address.
+ *
+ * @param buf       A character buffer to store the ID.
+ * @param buf_size  The size of the buffer, at least 2 * OTA_DEVICE_ID_MAX_LEN + 1.
+ *
+ * @return 0 on success.
+ * @return -ENOMEM if the buffer is too small.
+ * @return A negative error code from hwinfo if the ID can't be read.
+ */
+int ota_get_device_id(char *buf, size_t buf_size);
+
 #ifdef __cplusplus
 }
 #endif
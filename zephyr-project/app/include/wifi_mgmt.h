@@ -15,6 +15,26 @@ extern "C" {
  */
 bool wifi_is_connected(void);
 
+/**
+ * @brief Check if the network is usable
+ *
+ * Ready means an IPv4 address is bound and the OTA server accepted a
+ * connection.
+ *
+ * @return true if the network is ready, false otherwise
+ */
+bool wifi_is_network_ready(void);
+
+/**
+ * @brief Register callback for network readiness changes
+ *
+ * Called from the network management or system work queue context. If the
+ * network is ready already, the callback is called right away.
+ *
+ * @param callback Function to call when the network becomes ready or is lost
+ */
+void wifi_register_ready_callback(void (*callback)(bool ready));
+
 /**
  * @brief Get current WiFi IP address as string
  * @param[out] ip_str Buffer for IP address string (min. 16 bytes)
@@ -23,6 +43,16 @@ bool wifi_is_connected(void);
  */
 int wifi_get_ip_address_public(char *ip_str, size_t len);
 
+/**
+ * @brief Keep the DHCP lease for the next boot
+ *
+ * Call right before an intentional reboot, e.g. to apply an update. The next
+ * boot then starts with the same address while DHCP confirms it in the
+ * background. After a power cycle the lease may have expired, so that boot
+ * waits for DHCP as usual.
+ */
+void wifi_prepare_reboot(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,58 @@
+#ifndef WORK_LATENCY_H
+#define WORK_LATENCY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Lateness of a delayable work item, i.e. how long it waited after its timer expired */
+struct work_latency {
+    const char *name;
+    uint64_t due;               // cycle count the item should run at, 0 = not armed
+    uint32_t runs;
+    uint32_t max_us;            // since boot
+    uint32_t window_max_us;     // since work_latency_window_start()
+};
+
+/**
+ * @brief Add an item to the ones reported by work_latency_window_end() and 'ota latency'
+ */
+void work_latency_register(struct work_latency *wl, const char *name);
+
+/**
+ * @brief Note that the item was scheduled to run in delay_ms
+ */
+void work_latency_armed(struct work_latency *wl, uint32_t delay_ms);
+
+/**
+ * @brief Note that the item runs now, call first thing in its handler
+ */
+void work_latency_ran(struct work_latency *wl);
+
+/**
+ * @brief Start a measurement window, e.g. an update
+ *
+ * Resets the window maxima. While a window is open a probe item runs on the
+ * system work queue every WORK_LATENCY_PROBE_MS, so the queue is covered
+ * even when no registered item happens to be due.
+ */
+void work_latency_window_start(void);
+
+/**
+ * @brief Close the measurement window and log the worst latency of each item
+ */
+void work_latency_window_end(void);
+
+/**
+ * @brief Registered item by index, NULL past the last one
+ */
+const struct work_latency *work_latency_get(size_t idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WORK_LATENCY_H */
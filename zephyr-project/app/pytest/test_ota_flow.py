@@ -0,0 +1,24 @@
+"""Twister pytest harness for the native_sim OTA flow, see update-server/sim_flow.py."""
+
+import json
+import os
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..', '..', '..', 'update-server'))
+
+import sim_flow  # noqa: E402
+
+
+def test_ota_flow(request):
+    build_dir = request.config.getoption('--build-dir')
+    result = sim_flow.run(build_dir)
+
+    # twister keeps the build directory, so the numbers can be compared between runs
+    with open(os.path.join(build_dir, 'ota_flow.json'), 'w') as f:
+        json.dump(result, f, indent=2)
+    print(json.dumps(result, indent=2))
+
+    assert result['image_matches'], "slot1 doesn't hold the served image"
+    assert result['upgrade_requested'], "no upgrade request in the slot1 trailer"
+    assert result['ok']
+    assert result.get('flash_writes'), "device sent no stats report"
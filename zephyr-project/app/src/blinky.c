@@ -1,5 +1,6 @@
 #include "blinky.h"
 #include "app_config.h"
+#include "work_latency.h"
 
 #include <zephyr/kernel.h>
 #include <zephyr/drivers/gpio.h>
@@ -14,6 +15,8 @@ LOG_MODULE_REGISTER(blinky, LOG_LEVEL_INF);
 static struct k_work_delayable blink_work;
 static uint8_t led_state = 0;
 static uint32_t blink_interval_ms = LED_BLINK_INTERVAL_MS;
+static bool initialized = false;
+static struct work_latency blink_latency;
 static const struct gpio_dt_spec led = GPIO_DT_SPEC_GET(LED0_NODE, gpios);
 
 // Forward declarations
@@ -35,6 +38,7 @@ void blinky_set_interval(uint32_t interval_ms)
         /* Cancel current work and reschedule with new interval */
         k_work_cancel_delayable(&blink_work);
         k_work_schedule(&blink_work, K_MSEC(blink_interval_ms));
+        work_latency_armed(&blink_latency, blink_interval_ms);
     }
 }
 
@@ -46,6 +50,11 @@ void blinky_set_state(int state)
     }
 }
 
+bool blinky_is_ready(void)
+{
+    return initialized;
+}
+
 // private static functions
 static int blinky_init(void)
 {
@@ -61,8 +70,11 @@ static int blinky_init(void)
     }
 
     k_work_init_delayable(&blink_work, blink_work_handler);
+    work_latency_register(&blink_latency, "blink");
     k_work_schedule(&blink_work, K_MSEC(blink_interval_ms));
+    work_latency_armed(&blink_latency, blink_interval_ms);
 
+    initialized = true;
     LOG_INF("Blinky subsystem initialized - blinking every %d ms", blink_interval_ms);
     return 0;
 }
@@ -71,9 +83,11 @@ static void blink_work_handler(struct k_work *work)
 {
     ARG_UNUSED(work);
 
+    work_latency_ran(&blink_latency);
     gpio_pin_set_dt(&led, led_state);
     led_state ^= 1; // switch LED state
     k_work_schedule(&blink_work, K_MSEC(blink_interval_ms));
+    work_latency_armed(&blink_latency, blink_interval_ms);
 }
 
 SYS_INIT(blinky_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
\ No newline at end of file
@@ -0,0 +1,141 @@
+#include "health.h"
+#include "app_config.h"
+#include "wifi_mgmt.h"
+
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/dfu/mcuboot.h>
+#include <zephyr/sys/reboot.h>
+#include <zephyr/sys/util.h>
+
+
+LOG_MODULE_REGISTER(health, LOG_LEVEL_INF);
+
+/*
+ * Only the swap modes (and direct-XIP with revert) boot the previous image
+ * again if the new one isn't confirmed, overwrite-only erased it already.
+ * The bootloader's own config must agree, see sysbuild/mcuboot.conf.
+ */
+#if defined(CONFIG_MCUBOOT_BOOTLOADER_MODE_SWAP_USING_MOVE) || \
+    defined(CONFIG_MCUBOOT_BOOTLOADER_MODE_SWAP_WITHOUT_SCRATCH) || \
+    defined(CONFIG_MCUBOOT_BOOTLOADER_MODE_SWAP_USING_OFFSET) || \
+    defined(CONFIG_MCUBOOT_BOOTLOADER_MODE_SWAP_SCRATCH) || \
+    defined(CONFIG_MCUBOOT_BOOTLOADER_MODE_DIRECT_XIP_WITH_REVERT)
+#define HEALTH_CAN_REVERT 1
+#else
+#define HEALTH_CAN_REVERT 0
+#endif
+
+struct health_entry {
+    const char *name;
+    health_check_t check;
+    bool passed;                // passed at the last evaluation
+};
+
+static struct health_entry checks[HEALTH_MAX_CHECKS];
+static size_t check_count = 0;
+static void (*confirmed_callback)(void) = NULL;
+static int64_t deadline_ms = 0;
+static bool timed_out = false;          // the deadline passed without a revert, keep checking
+
+// Forward declarations
+static void health_work_handler(struct k_work *work);
+static bool evaluate(void);
+static void timeout_reached(void);
+
+static K_WORK_DELAYABLE_DEFINE(health_work, health_work_handler);
+
+// public functions
+int health_register(const char *name, health_check_t check)
+{
+    if (check_count >= ARRAY_SIZE(checks)) {
+        LOG_ERR("No room for health check %s", name);
+        return -ENOMEM;
+    }
+
+    checks[check_count].name = name;
+    checks[check_count].check = check;
+    checks[check_count].passed = false;
+    check_count++;
+    return 0;
+}
+
+void health_confirm_start(void (*confirmed)(void))
+{
+    confirmed_callback = confirmed;
+    deadline_ms = k_uptime_get() + HEALTH_CONFIRM_TIMEOUT_SEC * MSEC_PER_SEC;
+
+    LOG_WRN("Running new firmware in TEST mode, confirming it once %zu health checks pass (revert after %d s)",
+            check_count, HEALTH_CONFIRM_TIMEOUT_SEC);
+    k_work_schedule(&health_work, K_NO_WAIT);
+}
+
+// private static functions
+static void health_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    if (!evaluate()) {
+        if (!timed_out && k_uptime_get() >= deadline_ms) {
+            timed_out = true;
+            timeout_reached();
+        }
+        k_work_schedule(&health_work, K_MSEC(HEALTH_POLL_MS));
+        return;
+    }
+
+    LOG_INF("All health checks passed %lld ms after boot, confirming the running firmware", k_uptime_get());
+    if (boot_write_img_confirmed() != 0) {
+        LOG_ERR("Failed to confirm image! This may cause a revert on next boot.");
+        return;
+    }
+    LOG_INF("Image confirmed successfully. The update is now permanent.");
+
+    if (confirmed_callback != NULL) {
+        confirmed_callback();
+    }
+}
+
+/* Runs every check, logs the first pass of each and returns whether all pass now */
+static bool evaluate(void)
+{
+    bool all_passed = true;
+
+    for (size_t i = 0; i < check_count; i++) {
+        bool passed = checks[i].check();
+
+        if (passed && !checks[i].passed) {
+            LOG_INF("Health check %s passed %lld ms after boot", checks[i].name, k_uptime_get());
+        } else if (!passed && checks[i].passed) {
+            LOG_WRN("Health check %s fails again", checks[i].name);
+        }
+        checks[i].passed = passed;
+        all_passed = all_passed && passed;
+    }
+    return all_passed;
+}
+
+/*
+ * Reboots without confirming, MCUboot then swaps the previous image back. Without
+ * a revert a reboot would only start this image again, so it keeps running unconfirmed
+ * and is confirmed if the checks pass later (e.g. once the update server is back).
+ */
+static void timeout_reached(void)
+{
+    for (size_t i = 0; i < check_count; i++) {
+        if (!checks[i].passed) {
+            LOG_ERR("Health check %s still fails", checks[i].name);
+        }
+    }
+
+#if HEALTH_CAN_REVERT
+    LOG_ERR("Image not healthy after %d s, rebooting to revert to the previous firmware",
+            HEALTH_CONFIRM_TIMEOUT_SEC);
+    wifi_prepare_reboot();
+    sys_reboot(SYS_REBOOT_WARM);
+#else
+    LOG_ERR("Image not healthy after %d s, the bootloader can't revert it, keeping it running",
+            HEALTH_CONFIRM_TIMEOUT_SEC);
+#endif
+}
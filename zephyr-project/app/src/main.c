@@ -2,6 +2,7 @@
 #include "blinky.h"
 #include "wifi_mgmt.h"
 #include "ota_mgmt.h"
+#include "health.h"
 #include "utils.h"
 
 #include <zephyr/kernel.h>
@@ -12,19 +13,26 @@
 
 LOG_MODULE_REGISTER(main, LOG_LEVEL_INF);
 
-// Define a work item for the delayed confirmation
-static void confirm_work_handler(struct k_work *work);
-static K_WORK_DELAYABLE_DEFINE(confirm_work, confirm_work_handler);
+/* Health checks a new image must pass before it is confirmed */
+static bool ip_address_bound(void)
+{
+    char ip_str[16];
+
+    return wifi_get_ip_address_public(ip_str, sizeof(ip_str)) == 0;
+}
 
-static void confirm_work_handler(struct k_work *work)
+static void register_health_checks(void)
 {
-    LOG_INF("Confirming running firmware as valid.");
-    if (boot_write_img_confirmed() != 0) {
-        LOG_ERR("Failed to confirm image! This may cause a revert on next boot.");
-    } else {
-        LOG_INF("Image confirmed successfully. The update is now permanent.");
-        ota_check_for_update();
-    }
+    health_register("wifi", wifi_is_connected);
+    health_register("ip_address", ip_address_bound);
+    health_register("ota_server", wifi_is_network_ready);
+    health_register("blinky", blinky_is_ready);
+}
+
+/* The OTA manager skips checks while a test image runs, see ota_mgmt_init() */
+static void image_confirmed(void)
+{
+    ota_check_for_update();
 }
 
 /* OTA status callback */
@@ -68,9 +76,8 @@ int main(void)
     LOG_INF("====================================");
 
     if (boot_is_img_confirmed() == 0) {
-        LOG_WRN("Running new firmware in TEST mode.");
-        LOG_WRN("Scheduling confirmation in 30 seconds.");
-        k_work_schedule(&confirm_work, K_SECONDS(30));
+        register_health_checks();
+        health_confirm_start(image_confirmed);
     } else {
         LOG_INF("Running a confirmed image.");
     }
@@ -0,0 +1,343 @@
+#include "ota_bench.h"
+#include "app_config.h"
+#include "ota_http.h"
+#include "ota_pipeline.h"
+#include "ota_stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/dfu/flash_img.h>
+#include <zephyr/dfu/mcuboot.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/net/http/client.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/util.h>
+
+
+LOG_MODULE_REGISTER(ota_bench, LOG_LEVEL_INF);
+
+#define SLOT1_PARTITION_ID DT_FIXED_PARTITION_ID(DT_NODELABEL(slot1_partition))
+
+static struct ota_bench_result *res;
+
+/* Latency samples, decimated when full so a long run still covers its whole duration */
+static uint32_t samples[OTA_BENCH_MAX_SAMPLES];
+static size_t sample_count = 0;
+static uint32_t sample_stride = 1;
+static uint32_t sample_skip = 0;
+
+/* Network modes */
+static struct ota_http_session bench_session;
+static struct http_request bench_req;
+static uint8_t bench_recv_buf[1024];
+static char bench_url[96];
+static int bench_status = 0;
+static int64_t bench_content_length = 0;
+static bool bench_to_flash = false;
+static uint64_t request_start = 0;
+static uint64_t last_chunk = 0;
+
+/* Flash modes */
+static struct flash_img_context bench_ctx;
+static const struct flash_area *slot1;
+static size_t slot1_limit = 0;
+static size_t erased_up_to = 0;
+static size_t written = 0;
+static uint8_t pattern[OTA_PIPELINE_BUF_SIZE];
+
+// Forward declarations
+static uint32_t elapsed_us(uint64_t start);
+static void record_sample(uint32_t us);
+static int compare_u32(const void *a, const void *b);
+static void compute_percentiles(void);
+static int run_network(void);
+static int run_flash(size_t size);
+static int bench_response_cb(struct http_response *rsp, enum http_final_call final_data, void *user_data);
+static int open_slot1(void);
+static void close_slot1(void);
+static int write_slot1(const uint8_t *data, size_t len);
+static int erase_ahead(size_t end);
+
+// Public functions
+int ota_bench_run(enum ota_bench_mode mode, size_t size, struct ota_bench_result *result)
+{
+    int ret;
+
+    memset(result, 0, sizeof(*result));
+    res = result;
+    sample_count = 0;
+    sample_stride = 1;
+    sample_skip = 0;
+
+    switch (mode) {
+        case OTA_BENCH_NETWORK:
+            bench_to_flash = false;
+            ret = run_network();
+            break;
+
+        case OTA_BENCH_FLASH:
+            ret = open_slot1();
+            if (ret == 0) {
+                ret = run_flash(size);
+                close_slot1();
+            }
+            break;
+
+        case OTA_BENCH_PIPELINE:
+            bench_to_flash = true;
+            ret = open_slot1();
+            if (ret == 0) {
+                ret = run_network();
+                close_slot1();
+            }
+            break;
+
+        default:
+            return -EINVAL;
+    }
+
+    compute_percentiles();
+    return ret;
+}
+
+uint32_t ota_bench_bytes_per_sec(const struct ota_bench_result *result)
+{
+    if (result->elapsed_us == 0) {
+        return 0;
+    }
+    return (uint32_t)((uint64_t)result->bytes * USEC_PER_SEC / result->elapsed_us);
+}
+
+// private static functions
+static uint32_t elapsed_us(uint64_t start)
+{
+    return (uint32_t)MIN(k_cyc_to_us_floor64(ota_stats_now() - start), UINT32_MAX);
+}
+
+static void record_sample(uint32_t us)
+{
+    res->max_us = MAX(res->max_us, us);
+
+    if (++sample_skip < sample_stride) {
+        return;
+    }
+    sample_skip = 0;
+
+    if (sample_count == ARRAY_SIZE(samples)) {
+        /* keep every other sample and halve the sampling rate */
+        for (size_t i = 0; i < sample_count / 2; i++) {
+            samples[i] = samples[2 * i];
+        }
+        sample_count /= 2;
+        sample_stride *= 2;
+    }
+    samples[sample_count++] = us;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void compute_percentiles(void)
+{
+    res->samples = sample_count;
+    if (sample_count == 0) {
+        return;
+    }
+
+    qsort(samples, sample_count, sizeof(samples[0]), compare_u32);
+    res->p50_us = samples[MIN(sample_count - 1, sample_count * 50 / 100)];
+    res->p90_us = samples[MIN(sample_count - 1, sample_count * 90 / 100)];
+    res->p99_us = samples[MIN(sample_count - 1, sample_count * 99 / 100)];
+}
+
+/* Downloads the served image, into the pipeline and slot1 if bench_to_flash is set */
+static int run_network(void)
+{
+    ota_http_session_init(&bench_session, OTA_SERVER_HOST, OTA_SERVER_PORT);
+    snprintf(bench_url, sizeof(bench_url), "%s?board=%s", OTA_FIRMWARE_URL, OTA_BOARD_ID);
+
+    memset(&bench_req, 0, sizeof(bench_req));
+    bench_req.method = HTTP_GET;
+    bench_req.url = bench_url;
+    bench_req.host = OTA_SERVER_HOST;
+    bench_req.protocol = "HTTP/1.1";
+    bench_req.response = bench_response_cb;
+    bench_req.recv_buf = bench_recv_buf;
+    bench_req.recv_buf_len = sizeof(bench_recv_buf);
+
+    bench_status = 0;
+    bench_content_length = 0;
+    if (bench_to_flash) {
+        ota_pipeline_start(write_slot1);
+    }
+
+    request_start = ota_stats_now();
+    last_chunk = request_start;
+    int ret = ota_http_request(&bench_session, &bench_req, OTA_DOWNLOAD_TIMEOUT_MS);
+
+    if (bench_to_flash) {
+        int sink_ret = ota_pipeline_sync();
+        if (ret >= 0 && sink_ret < 0) {
+            ret = sink_ret;
+        }
+        if (ret >= 0) {
+            ret = flash_img_buffered_write(&bench_ctx, NULL, 0, true);
+        }
+    }
+    res->elapsed_us = elapsed_us(request_start);
+    ota_http_close(&bench_session);
+
+    if (ret < 0) {
+        LOG_ERR("Benchmark download failed: %d", ret);
+        return ret;
+    }
+    if (bench_status != 200) {
+        LOG_ERR("Server answered %d", bench_status);
+        return -EIO;
+    }
+    if (res->bytes != (size_t)bench_content_length) {
+        LOG_ERR("Download incomplete: got %zu of %lld bytes", res->bytes, bench_content_length);
+        return -EIO;
+    }
+    return 0;
+}
+
+static int bench_response_cb(struct http_response *rsp, enum http_final_call final_data, void *user_data)
+{
+    ARG_UNUSED(final_data);
+    ARG_UNUSED(user_data);
+
+    bench_status = rsp->http_status_code;
+    if (bench_status != 200 || rsp->body_frag_len == 0) {
+        return 0;
+    }
+
+    uint64_t now = ota_stats_now();
+    if (res->bytes == 0) {
+        res->first_byte_us = elapsed_us(request_start);
+        bench_content_length = rsp->content_length;
+    } else {
+        record_sample((uint32_t)MIN(k_cyc_to_us_floor64(now - last_chunk), UINT32_MAX));
+    }
+    last_chunk = now;
+    res->bytes += rsp->body_frag_len;
+
+    if (bench_to_flash) {
+        /* blocks while the flash writer is behind, the next sample includes that wait */
+        return ota_pipeline_submit(rsp->body_frag_start, rsp->body_frag_len);
+    }
+    return 0;
+}
+
+static int run_flash(size_t size)
+{
+    if (size == 0) {
+        size = OTA_BENCH_DEFAULT_SIZE;
+    }
+    size = MIN(size, slot1_limit);
+
+    for (size_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = (uint8_t)(i * 31 + 7);
+    }
+
+    uint64_t start = ota_stats_now();
+    int ret = 0;
+
+    while (written < size && ret == 0) {
+        size_t n = MIN(sizeof(pattern), size - written);
+        uint64_t write_start = ota_stats_now();
+
+        ret = write_slot1(pattern, n);
+        record_sample(elapsed_us(write_start));
+    }
+    if (ret == 0) {
+        ret = flash_img_buffered_write(&bench_ctx, NULL, 0, true);
+    }
+
+    res->elapsed_us = elapsed_us(start);
+    res->bytes = written;
+    if (ret < 0) {
+        LOG_ERR("Benchmark flash write failed at offset %zu: %d", written, ret);
+    }
+    return ret;
+}
+
+static int open_slot1(void)
+{
+    int ret = flash_area_open(SLOT1_PARTITION_ID, &slot1);
+    if (ret != 0) {
+        LOG_ERR("Failed to open slot1: %d", ret);
+        return ret;
+    }
+
+    ret = flash_img_init_id(&bench_ctx, SLOT1_PARTITION_ID);
+    if (ret != 0) {
+        LOG_ERR("Failed to initialize flash context: %d", ret);
+        flash_area_close(slot1);
+        return ret;
+    }
+
+    /* stay clear of the trailer, so MCUboot never mistakes the pattern for an upgrade request */
+    slot1_limit = boot_get_trailer_status_offset(slot1->fa_size);
+    erased_up_to = 0;
+    written = 0;
+    return 0;
+}
+
+static void close_slot1(void)
+{
+    flash_area_close(slot1);
+}
+
+/* Pipeline sink in the pipeline mode, direct writer in the flash mode */
+static int write_slot1(const uint8_t *data, size_t len)
+{
+    int ret = erase_ahead(written + len);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = flash_img_buffered_write(&bench_ctx, data, len, false);
+    if (ret != 0) {
+        return ret;
+    }
+    written += len;
+    return 0;
+}
+
+static int erase_ahead(size_t end)
+{
+    const struct device *dev = flash_area_get_device(slot1);
+    struct flash_pages_info page;
+
+    if (end > slot1_limit) {
+        return -EFBIG;
+    }
+
+    while (erased_up_to < end) {
+        int ret = flash_get_page_info_by_offs(dev, slot1->fa_off + erased_up_to, &page);
+        if (ret != 0) {
+            return ret;
+        }
+
+        uint64_t start = ota_stats_now();
+        ret = flash_area_erase(slot1, page.start_offset - slot1->fa_off, page.size);
+        res->erase_us += elapsed_us(start);
+        if (ret != 0) {
+            return ret;
+        }
+        erased_up_to = page.start_offset - slot1->fa_off + page.size;
+    }
+
+    return 0;
+}
@@ -0,0 +1,222 @@
+#include "ota_delta.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+
+LOG_MODULE_REGISTER(ota_delta, LOG_LEVEL_INF);
+
+#define COPY_OP_SIZE (1 + 4 + 4)
+#define INSERT_OP_SIZE (1 + 4)
+
+// Forward declarations
+static int parse_header(struct ota_delta_ctx *ctx);
+static int execute_op(struct ota_delta_ctx *ctx);
+static int copy_from_source(struct ota_delta_ctx *ctx, uint32_t offset, uint32_t length);
+static int emit(struct ota_delta_ctx *ctx, const uint8_t *data, size_t len);
+static size_t op_size(uint8_t opcode);
+
+// public functions
+void ota_delta_init(struct ota_delta_ctx *ctx, uint8_t src_area_id,
+                    const uint8_t source_hash[OTA_DELTA_HASH_SIZE], ota_delta_write_cb write)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->state = OTA_DELTA_STATE_HEADER;
+    ctx->src_area_id = src_area_id;
+    ctx->write = write;
+    memcpy(ctx->source_hash, source_hash, OTA_DELTA_HASH_SIZE);
+}
+
+int ota_delta_process(struct ota_delta_ctx *ctx, const uint8_t *data, size_t len)
+{
+    int ret;
+
+    while (len > 0) {
+        switch (ctx->state) {
+            case OTA_DELTA_STATE_HEADER: {
+                size_t n = MIN(len, OTA_DELTA_HEADER_SIZE - ctx->hdr_len);
+                memcpy(&ctx->hdr[ctx->hdr_len], data, n);
+                ctx->hdr_len += n;
+                data += n;
+                len -= n;
+
+                if (ctx->hdr_len == OTA_DELTA_HEADER_SIZE) {
+                    ret = parse_header(ctx);
+                    if (ret != 0) {
+                        return ret;
+                    }
+                    ctx->hdr_len = 0;
+                    ctx->state = OTA_DELTA_STATE_OP;
+                }
+                break;
+            }
+
+            case OTA_DELTA_STATE_OP: {
+                if (ctx->hdr_len == 0 && op_size(data[0]) == 0) {
+                    LOG_ERR("Unknown patch opcode 0x%02x", data[0]);
+                    return -EINVAL;
+                }
+
+                size_t needed = op_size(ctx->hdr_len > 0 ? ctx->hdr[0] : data[0]);
+                size_t n = MIN(len, needed - ctx->hdr_len);
+                memcpy(&ctx->hdr[ctx->hdr_len], data, n);
+                ctx->hdr_len += n;
+                data += n;
+                len -= n;
+
+                if (ctx->hdr_len == needed) {
+                    ctx->hdr_len = 0;
+                    ret = execute_op(ctx);
+                    if (ret != 0) {
+                        return ret;
+                    }
+                }
+                break;
+            }
+
+            case OTA_DELTA_STATE_INSERT: {
+                size_t n = MIN(len, ctx->insert_remaining);
+                ret = emit(ctx, data, n);
+                if (ret != 0) {
+                    return ret;
+                }
+                ctx->insert_remaining -= n;
+                data += n;
+                len -= n;
+
+                if (ctx->insert_remaining == 0) {
+                    ctx->state = OTA_DELTA_STATE_OP;
+                }
+                break;
+            }
+
+            default:
+                return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+int ota_delta_finish(const struct ota_delta_ctx *ctx)
+{
+    if (ctx->state != OTA_DELTA_STATE_OP || ctx->hdr_len != 0) {
+        LOG_ERR("Patch stream ended in the middle of an operation");
+        return -EINVAL;
+    }
+
+    if (ctx->written != ctx->target_size) {
+        LOG_ERR("Patch produced %u of %u bytes", ctx->written, ctx->target_size);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+// private static functions
+static size_t op_size(uint8_t opcode)
+{
+    switch (opcode) {
+        case OTA_DELTA_OP_COPY:
+            return COPY_OP_SIZE;
+        case OTA_DELTA_OP_INSERT:
+            return INSERT_OP_SIZE;
+        default:
+            return 0;
+    }
+}
+
+static int parse_header(struct ota_delta_ctx *ctx)
+{
+    if (memcmp(ctx->hdr, OTA_DELTA_MAGIC, 4) != 0) {
+        LOG_ERR("Invalid patch magic");
+        return -EINVAL;
+    }
+
+    ctx->source_size = sys_get_le32(&ctx->hdr[4]);
+    ctx->target_size = sys_get_le32(&ctx->hdr[8]);
+
+    if (memcmp(&ctx->hdr[12], ctx->source_hash, OTA_DELTA_HASH_SIZE) != 0) {
+        LOG_ERR("Patch was built for a different source image");
+        return -EINVAL;
+    }
+
+    LOG_INF("Applying patch: %u byte source -> %u byte target", ctx->source_size, ctx->target_size);
+    return 0;
+}
+
+static int execute_op(struct ota_delta_ctx *ctx)
+{
+    switch (ctx->hdr[0]) {
+        case OTA_DELTA_OP_COPY: {
+            uint32_t offset = sys_get_le32(&ctx->hdr[1]);
+            uint32_t length = sys_get_le32(&ctx->hdr[5]);
+
+            if (offset > ctx->source_size || length > ctx->source_size - offset) {
+                LOG_ERR("COPY out of source bounds: %u+%u", offset, length);
+                return -EINVAL;
+            }
+            return copy_from_source(ctx, offset, length);
+        }
+
+        case OTA_DELTA_OP_INSERT:
+            ctx->insert_remaining = sys_get_le32(&ctx->hdr[1]);
+            if (ctx->insert_remaining > 0) {
+                ctx->state = OTA_DELTA_STATE_INSERT;
+            }
+            return 0;
+
+        default:
+            return -EINVAL;
+    }
+}
+
+static int copy_from_source(struct ota_delta_ctx *ctx, uint32_t offset, uint32_t length)
+{
+    const struct flash_area *fa;
+    int ret = flash_area_open(ctx->src_area_id, &fa);
+    if (ret != 0) {
+        LOG_ERR("Failed to open source area: %d", ret);
+        return ret;
+    }
+
+    while (length > 0) {
+        size_t n = MIN(length, sizeof(ctx->copy_buf));
+
+        ret = flash_area_read(fa, offset, ctx->copy_buf, n);
+        if (ret != 0) {
+            LOG_ERR("Failed to read source image at 0x%x: %d", offset, ret);
+            break;
+        }
+
+        ret = emit(ctx, ctx->copy_buf, n);
+        if (ret != 0) {
+            break;
+        }
+        offset += n;
+        length -= n;
+    }
+
+    flash_area_close(fa);
+    return ret;
+}
+
+static int emit(struct ota_delta_ctx *ctx, const uint8_t *data, size_t len)
+{
+    if (len > ctx->target_size - ctx->written) {
+        LOG_ERR("Patch output exceeds target size %u", ctx->target_size);
+        return -EINVAL;
+    }
+
+    int ret = ctx->write(data, len);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ctx->written += len;
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include "ota_http.h"
+#include "app_config.h"
+#include "ota_stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/net/http/client.h>
+#include <zephyr/net/http/parser.h>
+
+
+LOG_MODULE_REGISTER(ota_http, LOG_LEVEL_INF);
+
+// Forward declarations
+static int resolve_host(struct ota_http_session *session);
+static int create_http_socket(struct ota_http_session *session);
+static bool connection_is_alive(struct ota_http_session *session);
+
+// Public functions
+void ota_http_session_init(struct ota_http_session *session, const char *host, int port)
+{
+    memset(session, 0, sizeof(*session));
+    session->host = host;
+    session->port = port;
+    session->sock = -1;
+    session->recv_timeout_sec = OTA_HTTP_RECV_TIMEOUT_SEC;
+}
+
+int ota_http_request(struct ota_http_session *session, struct http_request *req, int32_t timeout_ms)
+{
+    int ret;
+    bool reused;
+
+    if (session->sock >= 0 && !connection_is_alive(session)) {
+        LOG_DBG("Server closed the idle connection");
+        ota_http_close(session);
+    }
+
+    reused = session->sock >= 0;
+    if (!reused) {
+        ret = create_http_socket(session);
+        if (ret < 0) {
+            return ret;
+        }
+    } else {
+        LOG_DBG("Reusing connection to %s:%d", session->host, session->port);
+    }
+
+    session->requests++;
+    ret = http_client_req(session->sock, req, timeout_ms, NULL); // blocks until done
+
+    /*
+     * The server may close an idle connection right while we send on it. Nothing
+     * reached the response callback yet if no status line was parsed, so the
+     * request can safely be repeated once on a fresh connection.
+     */
+    if (ret < 0 && reused && req->internal.response.http_status_code == 0) {
+        LOG_DBG("Reused connection failed (%d), reconnecting", ret);
+        ota_http_close(session);
+        ret = create_http_socket(session);
+        if (ret < 0) {
+            return ret;
+        }
+        ret = http_client_req(session->sock, req, timeout_ms, NULL);
+    }
+
+    /* A failed request leaves the stream in an unknown state, and the server may want to close */
+    if (ret < 0 || !http_should_keep_alive(&req->internal.parser)) {
+        ota_http_close(session);
+    }
+
+    return ret;
+}
+
+void ota_http_close(struct ota_http_session *session)
+{
+    if (session->sock >= 0) {
+        zsock_close(session->sock);
+        session->sock = -1;
+    }
+}
+
+void ota_http_invalidate_dns(struct ota_http_session *session)
+{
+    session->resolved_at = 0;
+}
+
+// private static functions
+static int resolve_host(struct ota_http_session *session)
+{
+    struct zsock_addrinfo hints, *result;
+    char port_str[8];
+
+    if (session->resolved_at != 0 &&
+        k_uptime_get() - session->resolved_at < OTA_DNS_CACHE_TTL_SEC * MSEC_PER_SEC) {
+        return 0;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%d", session->port);
+
+    uint64_t start = ota_stats_now();
+    int ret = zsock_getaddrinfo(session->host, port_str, &hints, &result);
+    if (session->record_stats) {
+        ota_stats_phase(OTA_PHASE_DNS, start);
+    }
+    if (ret != 0) {
+        LOG_ERR("Failed to resolve hostname %s: %d", session->host, ret);
+        return -EHOSTUNREACH;
+    }
+
+    memcpy(&session->addr, result->ai_addr, MIN(result->ai_addrlen, sizeof(session->addr)));
+    session->addrlen = MIN(result->ai_addrlen, sizeof(session->addr));
+    session->resolved_at = k_uptime_get();
+    zsock_freeaddrinfo(result);
+
+    return 0;
+}
+
+static int create_http_socket(struct ota_http_session *session)
+{
+    int ret = resolve_host(session);
+    if (ret != 0) {
+        return ret;
+    }
+
+    int sock = zsock_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        LOG_ERR("Failed to create socket: %d", errno);
+        return -ECONNREFUSED;
+    }
+
+    /* Set socket timeout */
+    struct zsock_timeval timeout = {
+        .tv_sec = session->recv_timeout_sec,
+        .tv_usec = 0,
+    };
+
+    zsock_setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    timeout.tv_sec = OTA_HTTP_RECV_TIMEOUT_SEC;
+    zsock_setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    uint64_t start = ota_stats_now();
+    ret = zsock_connect(sock, &session->addr, session->addrlen);
+    if (session->record_stats) {
+        ota_stats_phase(OTA_PHASE_CONNECT, start);
+    }
+    if (ret < 0) {
+        LOG_ERR("Failed to connect to %s:%d: %d", session->host, session->port, errno);
+        zsock_close(sock);
+        /* the server may have moved, resolve again next time */
+        ota_http_invalidate_dns(session);
+        return -ECONNREFUSED;
+    }
+
+    session->sock = sock;
+    session->connects++;
+    LOG_INF("Connected to %s:%d", session->host, session->port);
+    return 0;
+}
+
+/* An idle keep-alive connection must not have anything to read, EOF or an error means it is gone */
+static bool connection_is_alive(struct ota_http_session *session)
+{
+    struct zsock_pollfd fds = {
+        .fd = session->sock,
+        .events = ZSOCK_POLLIN,
+    };
+
+    int ret = zsock_poll(&fds, 1, 0);
+    if (ret < 0) {
+        return false;
+    }
+
+    return ret == 0 || !(fds.revents & (ZSOCK_POLLIN | ZSOCK_POLLHUP | ZSOCK_POLLERR | ZSOCK_POLLNVAL));
+}
@@ -0,0 +1,109 @@
+#include "ota_lz4.h"
+
+#include <errno.h>
+#include <string.h>
+#include <lz4.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+
+LOG_MODULE_REGISTER(ota_lz4, LOG_LEVEL_INF);
+
+// Forward declarations
+static int process_frame(struct ota_lz4_ctx *ctx);
+
+// public functions
+void ota_lz4_init(struct ota_lz4_ctx *ctx, ota_lz4_write_cb write)
+{
+    ctx->write = write;
+    ctx->consumed = 0;
+    ota_lz4_resume_offset(ctx);
+}
+
+int ota_lz4_process(struct ota_lz4_ctx *ctx, const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        if (ctx->hdr_len < sizeof(ctx->hdr)) {
+            size_t n = MIN(len, sizeof(ctx->hdr) - ctx->hdr_len);
+            memcpy(&ctx->hdr[ctx->hdr_len], data, n);
+            ctx->hdr_len += n;
+            data += n;
+            len -= n;
+
+            if (ctx->hdr_len < sizeof(ctx->hdr)) {
+                break;
+            }
+
+            uint32_t raw = sys_get_le32(ctx->hdr);
+            ctx->stored = (raw & OTA_LZ4_FRAME_STORED) != 0;
+            ctx->frame_len = raw & ~OTA_LZ4_FRAME_STORED;
+
+            size_t max_len = ctx->stored ? OTA_LZ4_BLOCK_SIZE : OTA_LZ4_FRAME_MAX;
+            if (ctx->frame_len == 0 || ctx->frame_len > max_len) {
+                LOG_ERR("Invalid frame length %u", ctx->frame_len);
+                return -EINVAL;
+            }
+            continue;
+        }
+
+        size_t n = MIN(len, ctx->frame_len - ctx->in_len);
+        memcpy(&ctx->in[ctx->in_len], data, n);
+        ctx->in_len += n;
+        data += n;
+        len -= n;
+
+        if (ctx->in_len == ctx->frame_len) {
+            int ret = process_frame(ctx);
+            if (ret != 0) {
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
+size_t ota_lz4_resume_offset(struct ota_lz4_ctx *ctx)
+{
+    ctx->hdr_len = 0;
+    ctx->in_len = 0;
+    ctx->frame_len = 0;
+    return ctx->consumed;
+}
+
+int ota_lz4_finish(const struct ota_lz4_ctx *ctx)
+{
+    if (ctx->hdr_len != 0 || ctx->in_len != 0) {
+        LOG_ERR("Compressed stream ended in the middle of a frame");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+// private static functions
+static int process_frame(struct ota_lz4_ctx *ctx)
+{
+    const uint8_t *block = ctx->in;
+    int block_len = ctx->frame_len;
+
+    if (!ctx->stored) {
+        block_len = LZ4_decompress_safe((const char *)ctx->in, (char *)ctx->out, ctx->frame_len,
+                                        sizeof(ctx->out));
+        if (block_len <= 0) {
+            LOG_ERR("Corrupt LZ4 block at offset %zu", ctx->consumed);
+            return -EINVAL;
+        }
+        block = ctx->out;
+    }
+
+    int ret = ctx->write(block, block_len);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ctx->consumed += sizeof(ctx->hdr) + ctx->frame_len;
+    ctx->hdr_len = 0;
+    ctx->in_len = 0;
+    return 0;
+}
@@ -0,0 +1,367 @@
+#include "ota_manifest.h"
+#include "ota_lz4.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/util.h>
+
+
+LOG_MODULE_REGISTER(ota_manifest, LOG_LEVEL_INF);
+
+#define CBOR_UINT 0
+#define CBOR_BSTR 2
+#define CBOR_TSTR 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+
+#define SHA256_LEN 32
+
+// Forward declarations
+static int start_item(struct ota_manifest_parser *p);
+static int item_done(struct ota_manifest_parser *p);
+static bool at_top_level_key(const struct ota_manifest_parser *p);
+static bool at_value_of(const struct ota_manifest_parser *p, int key);
+static bool in_array_of(const struct ota_manifest_parser *p, int key);
+static int on_uint(struct ota_manifest_parser *p, uint64_t value);
+static void on_string_data(struct ota_manifest_parser *p, const uint8_t *data, size_t len);
+static int on_string_end(struct ota_manifest_parser *p);
+static bool digest_matches(const struct ota_manifest *m, size_t index, const uint8_t *digest);
+
+// public functions
+void ota_manifest_parser_init(struct ota_manifest_parser *parser, struct ota_manifest *manifest)
+{
+    memset(parser, 0, sizeof(*parser));
+    memset(manifest, 0, sizeof(*manifest));
+    parser->manifest = manifest;
+    parser->key = -1;
+}
+
+int ota_manifest_parse(struct ota_manifest_parser *parser, const uint8_t *data, size_t len)
+{
+    struct ota_manifest_parser *p = parser;
+
+    while (len > 0 && p->error == 0) {
+        if (p->done) {
+            LOG_ERR("Data after the end of the manifest");
+            p->error = -EBADMSG;
+            break;
+        }
+
+        if (p->in_string) {
+            size_t n = MIN(len, p->str_len - p->str_off);
+
+            on_string_data(p, data, n);
+            p->str_off += n;
+            data += n;
+            len -= n;
+            if (p->str_off == p->str_len) {
+                p->in_string = false;
+                p->error = on_string_end(p);
+                if (p->error == 0) {
+                    p->error = item_done(p);
+                }
+            }
+            continue;
+        }
+
+        uint8_t byte = *data++;
+        len--;
+
+        if (!p->in_head) {
+            uint8_t info = byte & 0x1f;
+
+            p->major_type = byte >> 5;
+            if (info < 24) {
+                p->arg = info;
+                p->arg_len = 0;
+            } else if (info <= 27) {
+                /* 1, 2, 4 or 8 argument bytes follow */
+                p->arg = 0;
+                p->arg_len = 1 << (info - 24);
+                p->arg_have = 0;
+                p->in_head = true;
+                continue;
+            } else {
+                /* indefinite lengths are never sent, the rest is reserved */
+                LOG_ERR("Unsupported CBOR item 0x%02x", byte);
+                p->error = -EBADMSG;
+                break;
+            }
+        } else {
+            p->arg = (p->arg << 8) | byte;
+            if (++p->arg_have < p->arg_len) {
+                continue;
+            }
+            p->in_head = false;
+        }
+
+        p->error = start_item(p);
+    }
+
+    return p->error;
+}
+
+int ota_manifest_finish(struct ota_manifest_parser *parser)
+{
+    struct ota_manifest *m = parser->manifest;
+
+    if (parser->error != 0) {
+        return parser->error;
+    }
+    if (!parser->done || m->format != OTA_MANIFEST_FORMAT || !m->version_valid || m->size == 0) {
+        LOG_ERR("Incomplete manifest");
+        return -EBADMSG;
+    }
+
+    uint32_t chunks = (m->chunk_size > 0) ? DIV_ROUND_UP(m->size, m->chunk_size) : 0;
+    if (chunks > 0 && parser->chunk_hashes_seen == chunks && chunks <= OTA_MANIFEST_MAX_CHUNKS) {
+        m->chunk_count = chunks;
+    } else if (parser->chunk_hashes_seen > 0) {
+        LOG_WRN("Ignoring %u chunk hashes (%u chunks of %u bytes, room for %d)", parser->chunk_hashes_seen,
+                chunks, m->chunk_size, OTA_MANIFEST_MAX_CHUNKS);
+    }
+    return 0;
+}
+
+bool ota_manifest_chunk_matches(const struct ota_manifest *manifest, uint32_t index, const uint8_t *data,
+                                size_t len)
+{
+    uint8_t digest[SHA256_LEN];
+
+    if (mbedtls_sha256(data, len, digest, 0) != 0) {
+        return false;
+    }
+    return digest_matches(manifest, index, digest);
+}
+
+void ota_chunk_verifier_start(struct ota_chunk_verifier *verifier, const struct ota_manifest *manifest)
+{
+    verifier->manifest = manifest;
+    verifier->offset = 0;
+    mbedtls_sha256_init(&verifier->sha);
+}
+
+int ota_chunk_verifier_update(struct ota_chunk_verifier *verifier, const uint8_t *data, size_t len)
+{
+    const struct ota_manifest *m = verifier->manifest;
+
+    if (m->chunk_count == 0) {
+        verifier->offset += len;
+        return 0;
+    }
+
+    while (len > 0) {
+        size_t in_chunk = verifier->offset % m->chunk_size;
+        size_t n = MIN(len, m->chunk_size - in_chunk);
+
+        if (in_chunk == 0) {
+            mbedtls_sha256_starts(&verifier->sha, 0);
+        }
+        mbedtls_sha256_update(&verifier->sha, data, n);
+        verifier->offset += n;
+        data += n;
+        len -= n;
+
+        if (verifier->offset % m->chunk_size == 0 || verifier->offset == m->size) {
+            uint8_t digest[SHA256_LEN];
+            size_t idx = (verifier->offset - 1) / m->chunk_size;
+
+            mbedtls_sha256_finish(&verifier->sha, digest);
+            if (!digest_matches(m, idx, digest)) {
+                LOG_ERR("Chunk %zu at offset %zu doesn't match the manifest", idx, idx * m->chunk_size);
+                return -EBADMSG;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// private static functions
+/* The head of an item is complete, arg holds its value, length or number of entries */
+static int start_item(struct ota_manifest_parser *p)
+{
+    int ret;
+
+    switch (p->major_type) {
+        case CBOR_UINT:
+            if (p->depth == 0) {
+                return -EBADMSG;
+            }
+            ret = on_uint(p, p->arg);
+            return (ret != 0) ? ret : item_done(p);
+
+        case CBOR_BSTR:
+        case CBOR_TSTR:
+            if (p->depth == 0 || p->arg > UINT32_MAX) {
+                return -EBADMSG;
+            }
+            p->str_len = (uint32_t)p->arg;
+            p->str_off = 0;
+            if (p->str_len > 0) {
+                p->in_string = true;
+                return 0;
+            }
+            ret = on_string_end(p);
+            return (ret != 0) ? ret : item_done(p);
+
+        case CBOR_ARRAY:
+        case CBOR_MAP: {
+            bool is_map = (p->major_type == CBOR_MAP);
+
+            if ((p->depth == 0 && !is_map) || p->depth == OTA_MANIFEST_MAX_DEPTH || p->arg > UINT32_MAX / 2) {
+                LOG_ERR("Unexpected container at depth %u", p->depth);
+                return -EBADMSG;
+            }
+            if (at_top_level_key(p)) {
+                p->key = -1;
+            }
+            if (p->arg == 0) {
+                return item_done(p);
+            }
+
+            p->stack[p->depth].is_map = is_map;
+            p->stack[p->depth].left = (uint32_t)p->arg * (is_map ? 2 : 1);
+            p->stack[p->depth].index = 0;
+            p->depth++;
+            return 0;
+        }
+
+        default:
+            LOG_ERR("Unexpected CBOR major type %u", p->major_type);
+            return -EBADMSG;
+    }
+}
+
+static bool digest_matches(const struct ota_manifest *m, size_t index, const uint8_t *digest)
+{
+    return index < m->chunk_count && memcmp(digest, m->chunk_hash[index], OTA_MANIFEST_CHUNK_HASH_LEN) == 0;
+}
+
+/* Counts a finished item in its container, closing the containers it completes */
+static int item_done(struct ota_manifest_parser *p)
+{
+    while (p->depth > 0) {
+        p->stack[p->depth - 1].index++;
+        if (--p->stack[p->depth - 1].left > 0) {
+            return 0;
+        }
+        p->depth--;
+    }
+
+    p->done = true;
+    return 0;
+}
+
+static bool at_top_level_key(const struct ota_manifest_parser *p)
+{
+    return p->depth == 1 && p->stack[0].index % 2 == 0;
+}
+
+static bool at_value_of(const struct ota_manifest_parser *p, int key)
+{
+    return p->depth == 1 && p->stack[0].index % 2 == 1 && p->key == key;
+}
+
+static bool in_array_of(const struct ota_manifest_parser *p, int key)
+{
+    return p->depth == 2 && !p->stack[1].is_map && p->key == key;
+}
+
+static int on_uint(struct ota_manifest_parser *p, uint64_t value)
+{
+    struct ota_manifest *m = p->manifest;
+
+    if (at_top_level_key(p)) {
+        p->key = (value <= INT32_MAX) ? (int64_t)value : -1;
+        return 0;
+    }
+
+    if (p->depth == 1) {
+        switch (p->key) {
+            case OTA_MANIFEST_KEY_FORMAT:
+                m->format = (uint32_t)MIN(value, UINT32_MAX);
+                if (m->format != OTA_MANIFEST_FORMAT) {
+                    LOG_ERR("Unknown manifest format %llu", (unsigned long long)value);
+                    return -ENOTSUP;
+                }
+                break;
+            case OTA_MANIFEST_KEY_SIZE:
+                m->size = (uint32_t)MIN(value, UINT32_MAX);
+                break;
+            case OTA_MANIFEST_KEY_CHUNK_SIZE:
+                m->chunk_size = (uint32_t)MIN(value, UINT32_MAX);
+                break;
+            case OTA_MANIFEST_KEY_DELTA_SIZE:
+                m->delta_size = (uint32_t)MIN(value, UINT32_MAX);
+                break;
+            default:
+                break;
+        }
+        return 0;
+    }
+
+    if (in_array_of(p, OTA_MANIFEST_KEY_VERSION)) {
+        switch (p->stack[1].index) {
+            case 0:
+                m->major = (uint8_t)MIN(value, UINT8_MAX);
+                break;
+            case 1:
+                m->minor = (uint8_t)MIN(value, UINT8_MAX);
+                break;
+            case 2:
+                m->revision = (uint16_t)MIN(value, UINT16_MAX);
+                m->version_valid = true;
+                break;
+            case 3:
+                m->build = (uint32_t)MIN(value, UINT32_MAX);
+                break;
+            default:
+                break;
+        }
+    }
+    return 0;
+}
+
+static void on_string_data(struct ota_manifest_parser *p, const uint8_t *data, size_t len)
+{
+    struct ota_manifest *m = p->manifest;
+
+    if (at_value_of(p, OTA_MANIFEST_KEY_SHA256) && p->str_len == SHA256_LEN) {
+        memcpy(&m->sha256[p->str_off], data, len);
+    } else if (in_array_of(p, OTA_MANIFEST_KEY_CHUNK_HASHES) && p->str_len == SHA256_LEN) {
+        uint32_t idx = p->stack[1].index;
+
+        /* only a prefix of each hash is kept, the image hash still covers every byte */
+        if (idx < OTA_MANIFEST_MAX_CHUNKS && p->str_off < OTA_MANIFEST_CHUNK_HASH_LEN) {
+            memcpy(&m->chunk_hash[idx][p->str_off], data, MIN(len, OTA_MANIFEST_CHUNK_HASH_LEN - p->str_off));
+        }
+    } else if (in_array_of(p, OTA_MANIFEST_KEY_ENCODINGS) && p->str_len < sizeof(p->text)) {
+        memcpy(&p->text[p->str_off], data, len);
+    }
+}
+
+static int on_string_end(struct ota_manifest_parser *p)
+{
+    struct ota_manifest *m = p->manifest;
+
+    if (at_top_level_key(p)) {
+        p->key = -1;
+    } else if (at_value_of(p, OTA_MANIFEST_KEY_SHA256)) {
+        m->sha256_valid = (p->major_type == CBOR_BSTR && p->str_len == SHA256_LEN);
+    } else if (in_array_of(p, OTA_MANIFEST_KEY_CHUNK_HASHES)) {
+        if (p->major_type != CBOR_BSTR || p->str_len != SHA256_LEN) {
+            LOG_ERR("Invalid chunk hash");
+            return -EBADMSG;
+        }
+        p->chunk_hashes_seen++;
+    } else if (in_array_of(p, OTA_MANIFEST_KEY_ENCODINGS) && p->major_type == CBOR_TSTR &&
+               p->str_len < sizeof(p->text)) {
+        p->text[p->str_len] = '\0';
+        if (strcmp(p->text, OTA_LZ4_ENCODING) == 0) {
+            m->encodings |= OTA_MANIFEST_ENCODING_LZ4;
+        }
+    }
+    return 0;
+}
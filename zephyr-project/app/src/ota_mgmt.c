@@ -3,6 +3,15 @@
 #include "ota_mgmt.h"
 #include "blinky.h"
 #include "utils.h"
+#include "ota_delta.h"
+#include "ota_lz4.h"
+#include "ota_manifest.h"
+#include "ota_parallel.h"
+#include "ota_pipeline.h"
+#include "ota_http.h"
+#include "ota_stats.h"
+#include "ota_verify.h"
+#include "work_latency.h"
 
 #include <zephyr/kernel.h>
 #include <zephyr/net/socket.h>
@@ -14,73 +23,260 @@
 #include <zephyr/init.h>
 #include <zephyr/net/http/client.h>
 #include <zephyr/net/net_ip.h>
-#include <zephyr/data/json.h>
 #include <string.h>
+#include <strings.h>
 #include <zephyr/devicetree.h>
 #include <zephyr/dfu/flash_img.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/random/random.h>
+#include <mbedtls/sha256.h>
 #include <stdio.h>
 
 
 LOG_MODULE_REGISTER(ota_mgmt, LOG_LEVEL_INF);
 
+#define SLOT0_PARTITION_ID DT_FIXED_PARTITION_ID(DT_NODELABEL(slot0_partition))
+#define SLOT1_PARTITION_ID DT_FIXED_PARTITION_ID(DT_NODELABEL(slot1_partition))
+
+/* Settings keys for persisting a partial download across reboots */
+#define OTA_SETTINGS_PROGRESS_KEY "ota/progress"
+#define OTA_SETTINGS_VERSION_KEY "ota/version"
+
 struct flash_img_context image_ctx;
 
 /* OTA state variables */
+K_THREAD_STACK_DEFINE(ota_workq_stack, OTA_WORKQ_STACK_SIZE);
+static struct k_work_q ota_workq;        // blocking HTTP requests and flash erases stay off the system work queue
 static struct k_work_delayable ota_check_work;
+static struct k_work ota_request_work;          // check asked for by another thread, see ota_check_for_update()
 static ota_status_t current_status = OTA_STATUS_IDLE;
 static ota_error_t last_error = OTA_ERR_NONE;
 static void (*status_callback)(ota_status_t) = NULL;
+static atomic_t abort_requested = ATOMIC_INIT(0);
+static bool paused = false;              // slot1 is lent out, see ota_pause()
+static bool check_on_ready = false;      // check as soon as the network is usable
 
 /* HTTP client context */
 static struct http_request http_req;
 static uint8_t http_recv_buf[1024];
 static int64_t content_length = 0;
-static size_t total_downloaded = 0;
+static size_t total_downloaded = 0;     // bytes of the target image written to slot1
+static size_t bytes_received = 0;       // body bytes received by the current request
+static size_t bytes_since_yield = 0;
+static ota_error_t download_error = OTA_ERR_DOWNLOAD_FAILED;   // reported if the current download fails
+
+/* Integrity check of the written image */
+static mbedtls_sha256_context image_sha;
+static uint8_t expected_sha[32];
+static bool expected_sha_valid = false;
+static struct ota_chunk_verifier chunk_verifier;    // checks each chunk against the manifest as it is written
 static bool headers_complete = false;
 static int retry_count = 0;
-static int http_sock = -1;
+static int failed_cycles = 0;            // update cycles in a row that ended with an error
+static uint32_t server_poll_sec = 0;     // Retry-After of the last version answer, 0 = none
+static bool check_ended = false;         // the version answer ends the cycle, back off once the request returns
+static bool download_deferred = false;   // the server had no download slot free, see handle_http_headers()
+static struct ota_http_session http_session;
 
-struct version_info {
-    const char *version;
-    int size;
-};
+/* Download resume state */
+static char target_version[16];          // version announced by the server
+static char download_version[16];        // version image_ctx currently holds (partially)
+static bool image_ctx_valid = false;     // image_ctx holds a resumable partial download
+static size_t range_offset = 0;          // offset requested via Range header, 0 = full download
+static size_t last_saved_progress = 0;
+static char range_header[40];
+static char running_version[16];
+static uint32_t running_build = 0;
+static char request_url[160];
+static char device_id[2 * OTA_DEVICE_ID_MAX_LEN + 1];    // sent as device= so the server tells devices apart
 
-static struct json_obj_descr version_descr[] = {
-    JSON_OBJ_DESCR_PRIM(struct version_info, version, JSON_TOK_STRING),
-    JSON_OBJ_DESCR_PRIM(struct version_info, size, JSON_TOK_NUMBER),
+/* Incremental erase state */
+static int firmware_size = 0;            // size of the target image announced by the server
+static size_t erased_up_to = 0;          // slot1 is erased (or verified blank) below this offset
+static size_t slot1_image_limit = 0;     // image must end before the MCUboot trailer
+static uint32_t sectors_erased = 0;
+static uint32_t sectors_skipped = 0;
+static uint8_t blank_check_buf[256];
+
+/* Download timing */
+static int64_t download_start_ms = 0;
+static int64_t first_byte_ms = 0;
+static uint64_t request_start_cycles = 0;
+static uint64_t first_byte_cycles = 0;
+static char stats_report[768];
+
+/* Transfer encoding of the firmware download */
+enum download_encoding {
+    ENCODING_RAW = 0,                    // the signed image as is
+    ENCODING_DELTA,                      // patch against the image in slot0
+    ENCODING_LZ4,                        // LZ4 compressed blocks
 };
 
+static enum download_encoding encoding = ENCODING_RAW;
+static struct ota_parallel_stats parallel_stats;
+static struct ota_delta_ctx delta_ctx;
+static struct ota_lz4_ctx lz4_ctx;
+static int delta_size = 0;               // size of the patch offered by the server, 0 = none
+static bool delta_disabled = false;      // a patch failed to apply, always fetch the full image
+static bool lz4_offered = false;         // server can send the image compressed
+static bool lz4_disabled = false;        // decompression failed, always fetch the raw image
+static bool response_lz4 = false;        // Content-Encoding of the response says LZ4
+static char accept_encoding_header[40];
+static const char *request_headers[] = { range_header, accept_encoding_header, NULL };
+
+/* Update manifest, received in fragments while the version check runs */
+static struct ota_manifest manifest;
+static struct ota_manifest_parser manifest_parser;
+static const char accept_manifest_header[] = "Accept: " OTA_MANIFEST_CONTENT_TYPE "\r\n";
+
+/* Conditional version check, the server answers 304 while the ETag still matches */
+static char version_etag[48];            // ETag of the last "already up to date" answer
+static char response_etag[48];           // ETag of the response being received
+static char if_none_match_header[64];
+static const char *version_request_headers[] = { accept_manifest_header, if_none_match_header, NULL };
+static char header_name[20];             // enough to recognize "ETag", "Retry-After" and "Content-Encoding"
+static size_t header_name_len = 0;
+static bool header_in_value = false;
+static bool header_is_etag = false;
+static bool header_is_retry_after = false;
+static bool header_is_content_encoding = false;
+static char content_encoding[16];        // value of the Content-Encoding header, truncated
+
 // Forward declarations
 static int ota_mgmt_init(void);
 static void ota_check_work_handler(struct k_work *work);
+static void ota_request_work_handler(struct k_work *work);
 static int check_for_update(void);
 static int download_update(void);
+static int download_stream(void);
+static int download_parallel(void);
+static int defer_download(void);
 static int apply_update(void);
 
 static void update_status(ota_status_t new_status);
 static void set_error(ota_error_t error);
 static void ota_enter_backoff_state(void);
+static uint32_t jittered(uint32_t base_sec, uint32_t jitter_sec);
+static uint32_t backoff_delay_sec(int failures, uint32_t min_sec, uint32_t max_sec);
+static uint32_t next_check_delay_sec(void);
+static void network_ready_changed(bool ready);
 
 static int handle_http_headers(struct http_response *rsp);
-static int handle_version_response(struct http_response *rsp);
+static int handle_encoding_mismatch(void);
+static int on_header_field(struct http_parser *parser, const char *at, size_t length);
+static int on_header_value(struct http_parser *parser, const char *at, size_t length);
+static int handle_version_response(struct http_response *rsp, enum http_final_call final_data);
 static int handle_firmware_download(struct http_response *rsp, enum http_final_call final_data);
-static int process_version_info(const char *json_data, size_t len);
+static int process_manifest(void);
 static int write_firmware_chunk(const char *data, size_t len, bool is_final);
-static int create_http_socket(const char *host, int port);
+static int write_decoded_output(const uint8_t *data, size_t len);
+static int write_parallel_chunk(const uint8_t *data, size_t len);
+static void select_encoding(void);
+static int consume_firmware_data(const uint8_t *data, size_t len);
+static int finish_download(void);
+static int prepare_download(void);
+static int hash_written_image(size_t len);
+static int verify_image_hash(void);
+static int validate_image(void);
+static int erase_ahead(size_t end);
+static int erase_range(const struct flash_area *fa, size_t start, size_t end, size_t *done);
+static int yield_point(void);
+static bool sector_is_blank(const struct flash_area *fa, size_t offset, size_t size);
+static int load_download_progress(void);
+static int version_load_cb(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg, void *param);
+static void save_download_progress(void);
+static void clear_download_progress(void);
+static void report_stats(int result);
+static int stats_response_cb(struct http_response *rsp, enum http_final_call final_data, void *user_data);
+
+/* only the header callbacks are needed, the body still goes through http_response_cb */
+static const struct http_parser_settings response_header_cb = {
+    .on_header_field = on_header_field,
+    .on_header_value = on_header_value,
+};
 
 // Public functions
 int ota_check_for_update(void)
 {
-    if (current_status == OTA_STATUS_SLEEPING) {
-        LOG_INF("Waking ota manager up..");
-        update_status(OTA_STATUS_IDLE);
+    /* the state is only looked at on the OTA work queue, which also runs the update cycle */
+    int ret = k_work_submit_to_queue(&ota_workq, &ota_request_work);
+    if (ret < 0) {
+        return ret;
+    }
+    return 0;
+}
+
+int ota_abort_update(void)
+{
+    switch (current_status) {
+        case OTA_STATUS_IDLE:
+        case OTA_STATUS_SLEEPING:
+            return -EALREADY;
+
+        case OTA_STATUS_APPLYING:
+            return -EBUSY;
+
+        case OTA_STATUS_CHECKING:
+        case OTA_STATUS_DOWNLOADING:
+            /* the running request sees the flag in its response callback */
+            atomic_set(&abort_requested, 1);
+            return 0;
+
+        default:
+            /* waiting for the next step or a retry, run it now so it sees the flag */
+            atomic_set(&abort_requested, 1);
+            k_work_reschedule_for_queue(&ota_workq, &ota_check_work, K_NO_WAIT);
+            return 0;
     }
-    if (current_status != OTA_STATUS_IDLE) {
-        LOG_WRN("OTA operation already in progress");
+}
+
+int ota_pause(void)
+{
+    struct k_work_sync sync;
+
+    if (current_status != OTA_STATUS_IDLE && current_status != OTA_STATUS_SLEEPING) {
         return -EBUSY;
     }
-    
-    return check_for_update();
+
+    paused = true;
+    k_work_cancel_delayable_sync(&ota_check_work, &sync);
+
+    /* a check may have started meanwhile and found an update */
+    if (current_status != OTA_STATUS_IDLE && current_status != OTA_STATUS_SLEEPING) {
+        paused = false;
+        k_work_reschedule_for_queue(&ota_workq, &ota_check_work, K_NO_WAIT);
+        return -EBUSY;
+    }
+
+    ota_http_close(&http_session);
+    clear_download_progress();
+    total_downloaded = 0;
+    LOG_INF("OTA manager paused, slot1 is free");
+    return 0;
+}
+
+void ota_resume(void)
+{
+    if (!paused) {
+        return;
+    }
+
+    paused = false;
+    LOG_INF("OTA manager resumed");
+    if (wifi_is_network_ready()) {
+        k_work_schedule_for_queue(&ota_workq, &ota_check_work, K_NO_WAIT);
+    } else {
+        check_on_ready = true;
+    }
+}
+
+void ota_get_download_progress(size_t *written, size_t *total)
+{
+    *written = total_downloaded;
+    *total = firmware_size > 0 ? (size_t)firmware_size : 0;
 }
 
 ota_status_t ota_get_status(void)
@@ -102,21 +298,33 @@ void ota_register_status_callback(void (*callback)(ota_status_t status))
 static int http_response_cb(struct http_response *rsp, enum http_final_call final_data, void *user_data)
 {
     int ret = 0;
-    if (!headers_complete && rsp->body_frag_len > 0) {
+
+    if (atomic_get(&abort_requested)) {
+        return -ECANCELED;
+    }
+    if (!headers_complete && (rsp->body_frag_len > 0 || final_data == HTTP_DATA_FINAL)) {
         ret = handle_http_headers(rsp);
         if (ret != 0) {
             return ret;
         }
     }
 
-    if (headers_complete && rsp->body_frag_len > 0) {
+    if (headers_complete && (rsp->body_frag_len > 0 || final_data == HTTP_DATA_FINAL)) {
         switch (current_status) {
             case OTA_STATUS_CHECKING:
-                return handle_version_response(rsp);
+                if (check_ended) {
+                    /* body of a 304 or a deferral, see handle_http_headers() */
+                    return 0;
+                }
+                /* the manifest is only complete with the final call, which may carry no data */
+                return handle_version_response(rsp, final_data);
                 
             case OTA_STATUS_DOWNLOADING:
+                if (rsp->body_frag_len == 0 || download_deferred) {
+                    return 0;
+                }
                 return handle_firmware_download(rsp, final_data);
-                
+
             default:
                 LOG_WRN("Unexpected status in HTTP callback: %d", current_status);
                 return 0;
@@ -128,55 +336,220 @@ static int http_response_cb(struct http_response *rsp, enum http_final_call fina
 
 static int handle_http_headers(struct http_response *rsp)
 {
-    if (rsp->http_status_code != 200) {
+    int ret;
+
+    if (current_status == OTA_STATUS_CHECKING && rsp->http_status_code == 304) {
+        /* nothing changed since the last answer, which said we are up to date */
+        LOG_INF("Version info not modified (%s). Checking again later.", version_etag);
+        failed_cycles = 0;
+        headers_complete = true;
+        content_length = 0;
+        check_ended = true;
+        return 0;
+    }
+
+    if (current_status == OTA_STATUS_CHECKING && rsp->http_status_code == 503) {
+        /* the server's rollout limits hold this device back for now, it says when to come back */
+        LOG_INF("Server deferred the update. Checking again later.");
+        headers_complete = true;
+        content_length = 0;
+        check_ended = true;
+        return 0;
+    }
+
+    if (current_status == OTA_STATUS_DOWNLOADING && rsp->http_status_code == 503) {
+        /* all download slots are busy, the partial image stays as it is until the server has room */
+        LOG_INF("Server deferred the download. Trying again later.");
+        headers_complete = true;
+        content_length = 0;
+        download_deferred = true;
+        return 0;
+    }
+
+    if (range_offset > 0 && rsp->http_status_code != 206) {
+        /* Server ignored or rejected the Range request, the partial image can't be continued */
+        LOG_WRN("Server did not resume download (status %d), restarting from scratch", rsp->http_status_code);
+        clear_download_progress();
+        set_error(OTA_ERR_DOWNLOAD_FAILED);
+        return -1;
+    }
+
+    if (range_offset == 0 && rsp->http_status_code != 200) {
         LOG_ERR("HTTP request failed with status: %d %s", rsp->http_status_code, rsp->http_status);
         set_error(OTA_ERR_DOWNLOAD_FAILED);
         return -1;
     }
     
+    if (current_status == OTA_STATUS_DOWNLOADING && response_lz4 != (encoding == ENCODING_LZ4)) {
+        ret = handle_encoding_mismatch();
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
     headers_complete = true;
     content_length = rsp->content_length;
     LOG_INF("HTTP headers complete, content length: %lld", content_length);
     return 0;
 }
 
-static int handle_version_response(struct http_response *rsp)
+/* The server decides whether it compresses, only decode what it says is LZ4 */
+static int handle_encoding_mismatch(void)
 {
-    return process_version_info(rsp->body_frag_start, rsp->body_frag_len);
+    if (encoding != ENCODING_LZ4) {
+        LOG_ERR("Unexpected Content-Encoding: %s", content_encoding);
+        set_error(OTA_ERR_DOWNLOAD_FAILED);
+        return -1;
+    }
+    if (range_offset > 0) {
+        /* the offset was one into the compressed stream, it means nothing in the raw image */
+        LOG_WRN("Server continued without compression, restarting from scratch");
+        clear_download_progress();
+        set_error(OTA_ERR_DOWNLOAD_FAILED);
+        return -1;
+    }
+
+    /* nothing was written yet, the body goes to flash as it is */
+    LOG_INF("Server sends the image uncompressed");
+    encoding = ENCODING_RAW;
+    return 0;
 }
 
-static int handle_firmware_download(struct http_response *rsp, enum http_final_call final_data)
+static int on_header_field(struct http_parser *parser, const char *at, size_t length)
 {
-    if (total_downloaded == 0) {
-        LOG_INF("Flash initialized for firmware download");
+    ARG_UNUSED(parser);
+
+    /* field names and values may arrive in several pieces */
+    if (header_in_value) {
+        header_in_value = false;
+        header_name_len = 0;
     }
-    
-    return write_firmware_chunk(rsp->body_frag_start, rsp->body_frag_len, (final_data == HTTP_DATA_FINAL));
+
+    for (size_t i = 0; i < length; i++) {
+        if (header_name_len < sizeof(header_name) - 1) {
+            header_name[header_name_len] = at[i];
+        }
+        header_name_len++;
+    }
+    return 0;
 }
 
-static int process_version_info(const char *json_data, size_t len)
+static int on_header_value(struct http_parser *parser, const char *at, size_t length)
 {
-    struct version_info version = {0};
-    int ret;
-    ret = json_obj_parse((char *)json_data, len, version_descr, ARRAY_SIZE(version_descr), &version);
-    if (ret <= 0 || !version.version) {
-        LOG_ERR("Failed to parse version info");
+    ARG_UNUSED(parser);
+
+    if (!header_in_value) {
+        header_in_value = true;
+        header_is_etag = (header_name_len == 4 && strncasecmp(header_name, "ETag", 4) == 0);
+        header_is_retry_after = (header_name_len == 11 && strncasecmp(header_name, "Retry-After", 11) == 0);
+        header_is_content_encoding = (header_name_len == 16 &&
+                                      strncasecmp(header_name, "Content-Encoding", 16) == 0);
+        if (header_is_etag) {
+            response_etag[0] = '\0';
+        }
+        if (header_is_retry_after) {
+            server_poll_sec = 0;
+        }
+        if (header_is_content_encoding) {
+            content_encoding[0] = '\0';
+        }
+    }
+
+    if (header_is_etag) {
+        size_t used = strlen(response_etag);
+        size_t n = MIN(length, sizeof(response_etag) - 1 - used);
+        memcpy(&response_etag[used], at, n);
+        response_etag[used + n] = '\0';
+    }
+    if (header_is_retry_after) {
+        /* only the delay-seconds form, the server never sends an HTTP date */
+        for (size_t i = 0; i < length && at[i] >= '0' && at[i] <= '9'; i++) {
+            server_poll_sec = MIN(server_poll_sec * 10 + (at[i] - '0'), OTA_SERVER_POLL_MAX_SEC);
+        }
+    }
+    if (header_is_content_encoding) {
+        size_t used = strlen(content_encoding);
+        size_t n = MIN(length, sizeof(content_encoding) - 1 - used);
+        memcpy(&content_encoding[used], at, n);
+        content_encoding[used + n] = '\0';
+        response_lz4 = (strcmp(content_encoding, OTA_LZ4_ENCODING) == 0);
+    }
+    return 0;
+}
+
+static int handle_version_response(struct http_response *rsp, enum http_final_call final_data)
+{
+    int ret = ota_manifest_parse(&manifest_parser, rsp->body_frag_start, rsp->body_frag_len);
+
+    if (ret == 0 && final_data == HTTP_DATA_FINAL) {
+        ret = ota_manifest_finish(&manifest_parser);
+        if (ret == 0) {
+            return process_manifest();
+        }
+    }
+    if (ret != 0) {
+        LOG_ERR("Failed to parse version info: %d", ret);
         set_error(OTA_ERR_SERVER_CONNECT);
         return -1;
     }
-    
-    LOG_INF("Server version: %s", version.version);
+    return 0;
+}
+
+static int handle_firmware_download(struct http_response *rsp, enum http_final_call final_data)
+{
+    ARG_UNUSED(final_data);
+
+    if (bytes_received == 0) {
+        first_byte_ms = k_uptime_get();
+        first_byte_cycles = ota_stats_now();
+        ota_stats_phase(OTA_PHASE_FIRST_BYTE, request_start_cycles);
+        LOG_INF("First firmware byte after %lld ms", first_byte_ms - download_start_ms);
+    }
+    bytes_received += rsp->body_frag_len;
+    ota_stats_chunk(rsp->body_frag_len);
 
-    char current_ver[16];
-    ota_get_running_firmware_version(current_ver, sizeof(current_ver));
+    bytes_since_yield += rsp->body_frag_len;
+    if (bytes_since_yield >= OTA_YIELD_INTERVAL_BYTES) {
+        bytes_since_yield = 0;
+        k_yield();
+    }
+
+    /* hand the data to the flash writer thread, this only blocks while all pipeline buffers are in use */
+    return ota_pipeline_submit(rsp->body_frag_start, rsp->body_frag_len);
+}
+
+static int process_manifest(void)
+{
+    char version[sizeof(target_version)];
+
+    snprintf(version, sizeof(version), "%u.%u.%u", manifest.major, manifest.minor, manifest.revision);
+    LOG_INF("Server version: %s+%u, %u bytes in %u hashed chunks", version, manifest.build, manifest.size,
+            manifest.chunk_count);
+    if (strcmp(target_version, version) != 0) {
+        delta_disabled = false;
+        lz4_disabled = false;
+    }
+    strcpy(target_version, version);
+    delta_size = manifest.delta_size;
+    lz4_offered = (manifest.encodings & OTA_MANIFEST_ENCODING_LZ4) != 0;
+    expected_sha_valid = manifest.sha256_valid;
+    memcpy(expected_sha, manifest.sha256, sizeof(expected_sha));
+    firmware_size = manifest.size;
     
-    if (strcmp(version.version, current_ver) != 0) {
-        LOG_INF("New version available: %s (current: %s)", version.version, current_ver);
+    /* a rebuild of the running version counts as an update too */
+    if (strcmp(version, running_version) != 0 || manifest.build != running_build) {
+        LOG_INF("New version available: %s+%u (current: %s+%u, patch: %d bytes)", version, manifest.build,
+                running_version, running_build, delta_size);
         update_status(OTA_STATUS_UPDATE_AVAILABLE);
-        k_work_schedule(&ota_check_work, K_SECONDS(5));
+        k_work_schedule_for_queue(&ota_workq, &ota_check_work, K_SECONDS(5));
+        /* a 304 must not hide this update if the download fails, so only remember up to date answers */
+        version_etag[0] = '\0';
     } else {
         LOG_INF("Already running latest version. Checking again later.");
-        ota_enter_backoff_state();
+        failed_cycles = 0;
+        strncpy(version_etag, response_etag, sizeof(version_etag) - 1);
+        version_etag[sizeof(version_etag) - 1] = '\0';
+        check_ended = true;
     }
     
     return 0;
@@ -185,16 +558,42 @@ static int process_version_info(const char *json_data, size_t len)
 static int write_firmware_chunk(const char *data, size_t len, bool is_final)
 {
     int ret;
+
+    ret = erase_ahead(total_downloaded + len);
+    if (ret < 0) {
+        LOG_ERR("Failed to prepare slot1 for writing: %d", ret);
+        download_error = OTA_ERR_FLASH_WRITE;
+        return ret;
+    }
     
+    uint64_t write_start = ota_stats_now();
     ret = flash_img_buffered_write(&image_ctx, data, len, is_final);
+    ota_stats_flash_write(len, write_start);
     if (ret < 0) {
         LOG_ERR("Flash write error: %d", ret);
-        set_error(OTA_ERR_FLASH_WRITE);
+        download_error = OTA_ERR_FLASH_WRITE;
         return ret;
     }
-    
+
+    /* hash what goes to flash while it passes by, no second read of slot1 needed */
+    if (len > 0) {
+        mbedtls_sha256_update(&image_sha, (const unsigned char *)data, len);
+
+        /* a corrupted chunk fails the download right away instead of after the whole image */
+        ret = ota_chunk_verifier_update(&chunk_verifier, (const uint8_t *)data, len);
+        if (ret != 0) {
+            download_error = OTA_ERR_INVALID_IMAGE;
+            clear_download_progress();
+            return ret;
+        }
+    }
     total_downloaded += len;
 
+    if (encoding == ENCODING_RAW &&
+        flash_img_bytes_written(&image_ctx) - last_saved_progress >= OTA_PROGRESS_SAVE_INTERVAL) {
+        save_download_progress();
+    }
+
     if (is_final) {
         LOG_INF("Firmware download complete: %zu bytes", total_downloaded);
     }
@@ -202,66 +601,505 @@ static int write_firmware_chunk(const char *data, size_t len, bool is_final)
     return 0;
 }
 
-static int create_http_socket(const char *host, int port)
+static int write_decoded_output(const uint8_t *data, size_t len)
+{
+    return write_firmware_chunk((const char *)data, len, false);
+}
+
+/* Sink of the parallel download, runs on the OTA work queue while the workers fetch the next chunks */
+static int write_parallel_chunk(const uint8_t *data, size_t len)
+{
+    int ret = write_firmware_chunk((const char *)data, len, false);
+
+    bytes_since_yield += len;
+    if (ret == 0 && bytes_since_yield >= OTA_YIELD_INTERVAL_BYTES) {
+        bytes_since_yield = 0;
+        ret = yield_point();
+    }
+    return ret;
+}
+
+/* Pipeline sink, runs on the flash writer thread */
+static int consume_firmware_data(const uint8_t *data, size_t len)
 {
-    struct zsock_addrinfo hints, *result;
-    int sock;
     int ret;
-    
-    sock = zsock_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sock < 0) {
-        LOG_ERR("Failed to create socket: %d", errno);
-        return -1;
+
+    switch (encoding) {
+        case ENCODING_DELTA:
+            ret = ota_delta_process(&delta_ctx, data, len);
+            if (ret != 0) {
+                LOG_ERR("Failed to apply delta patch: %d", ret);
+            }
+            return ret;
+
+        case ENCODING_LZ4:
+            ret = ota_lz4_process(&lz4_ctx, data, len);
+            if (ret != 0) {
+                LOG_ERR("Failed to decompress firmware: %d", ret);
+            }
+            /* errors of the flash writer already set download_error, anything else is a malformed stream */
+            if (ret == -EINVAL && download_error == OTA_ERR_DOWNLOAD_FAILED) {
+                download_error = OTA_ERR_INVALID_IMAGE;
+                lz4_disabled = true;
+            }
+            return ret;
+
+        default:
+            /* the final block is flushed by finish_download() once the response is complete */
+            return write_firmware_chunk((const char *)data, len, false);
+    }
+}
+
+static int finish_download(void)
+{
+    int ret = 0;
+
+    if (encoding == ENCODING_DELTA) {
+        ret = ota_delta_finish(&delta_ctx);
+    } else if (encoding == ENCODING_LZ4) {
+        ret = ota_lz4_finish(&lz4_ctx);
+        if (ret == -EINVAL) {
+            LOG_ERR("Compressed firmware ends in the middle of a block");
+            lz4_disabled = true;
+        }
     }
-    
-    /* Set socket timeout */
-    struct zsock_timeval timeout = {
-        .tv_sec = 30,
-        .tv_usec = 0,
-    };
-    
-    zsock_setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-    zsock_setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
-    
-    /* Setup address resolution */
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    
-    char port_str[8];
-    snprintf(port_str, sizeof(port_str), "%d", port);
-    
-    ret = zsock_getaddrinfo(host, port_str, &hints, &result);
     if (ret != 0) {
-        LOG_ERR("Failed to resolve hostname %s: %d", host, ret);
-        zsock_close(sock);
-        return -1;
+        return ret;
     }
-    
-    ret = zsock_connect(sock, result->ai_addr, result->ai_addrlen);
-    zsock_freeaddrinfo(result);
-    
-    if (ret < 0) {
-        LOG_ERR("Failed to connect to %s:%d: %d", host, port, errno);
-        zsock_close(sock);
-        return -1;
+
+    if (total_downloaded != (size_t)firmware_size) {
+        LOG_ERR("Image has %zu bytes, server announced %d", total_downloaded, firmware_size);
+        return -EIO;
     }
-    
-    LOG_INF("Connected to %s:%d", host, port);
-    return sock;
+
+    uint64_t verify_start = ota_stats_now();
+    ret = verify_image_hash();
+    if (ret == 0) {
+        /* flush whatever is left in the write buffer */
+        ret = write_firmware_chunk(NULL, 0, true);
+    }
+    ota_stats_phase(OTA_PHASE_VERIFY, verify_start);
+
+    if (ret == 0) {
+        ret = validate_image();
+    }
+    return ret;
+}
+
+
+static int version_load_cb(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg, void *param)
+{
+    ARG_UNUSED(key);
+    char *buf = param;
+
+    if (len == 0 || len >= sizeof(download_version)) {
+        return 0;
+    }
+
+    ssize_t rc = read_cb(cb_arg, buf, len);
+    if (rc >= 0) {
+        buf[rc] = '\0';
+    }
+    return 0;
+}
+
+static int load_download_progress(void)
+{
+    char saved_version[sizeof(download_version)] = {0};
+
+    settings_load_subtree_direct(OTA_SETTINGS_VERSION_KEY, version_load_cb, saved_version);
+    if (strcmp(saved_version, target_version) != 0) {
+        return -ENOENT;
+    }
+
+    int ret = stream_flash_progress_load(&image_ctx.stream, OTA_SETTINGS_PROGRESS_KEY);
+    if (ret != 0 || flash_img_bytes_written(&image_ctx) == 0) {
+        return -ENOENT;
+    }
+
+    return 0;
+}
+
+static void save_download_progress(void)
+{
+    int ret = stream_flash_progress_save(&image_ctx.stream, OTA_SETTINGS_PROGRESS_KEY);
+    if (ret != 0) {
+        LOG_WRN("Failed to persist download progress: %d", ret);
+        return;
+    }
+    last_saved_progress = flash_img_bytes_written(&image_ctx);
+}
+
+static void clear_download_progress(void)
+{
+    stream_flash_progress_clear(&image_ctx.stream, OTA_SETTINGS_PROGRESS_KEY);
+    settings_delete(OTA_SETTINGS_VERSION_KEY);
+    image_ctx_valid = false;
+    last_saved_progress = 0;
+}
+
+/* Picks how the image is transferred: patch, compressed or the full image */
+static void select_encoding(void)
+{
+    char saved_version[sizeof(download_version)] = {0};
+
+    if (image_ctx_valid && strcmp(download_version, target_version) == 0) {
+        /* continue in the encoding the partial download was started with */
+        return;
+    }
+
+    if (delta_size > 0 && !delta_disabled) {
+        uint8_t source_hash[OTA_DELTA_HASH_SIZE];
+
+        if (ota_get_image_hash(SLOT0_PARTITION_ID, source_hash, sizeof(source_hash)) == 0) {
+            encoding = ENCODING_DELTA;
+            clear_download_progress();
+            ota_delta_init(&delta_ctx, SLOT0_PARTITION_ID, source_hash, write_decoded_output);
+            return;
+        }
+        LOG_WRN("Can't identify the running image, not using the patch");
+    }
+
+    /* a full image download interrupted by a reboot is worth more than compression */
+    settings_load_subtree_direct(OTA_SETTINGS_VERSION_KEY, version_load_cb, saved_version);
+    if (lz4_offered && !lz4_disabled && strcmp(saved_version, target_version) != 0) {
+        encoding = ENCODING_LZ4;
+        clear_download_progress();
+        ota_lz4_init(&lz4_ctx, write_decoded_output);
+        return;
+    }
+
+    encoding = ENCODING_RAW;
+}
+
+/* Sets up image_ctx either to continue a partial download of target_version or to start over */
+static int prepare_download(void)
+{
+    const struct flash_area *fa;
+    int ret;
+
+    if (image_ctx_valid && strcmp(download_version, target_version) == 0) {
+        LOG_INF("Resuming download of %s at offset %zu", target_version, total_downloaded);
+        return 0;
+    }
+
+    ret = flash_img_init_id(&image_ctx, SLOT1_PARTITION_ID);
+    LOG_INF("area ID of slot1: %d", SLOT1_PARTITION_ID);
+    if (ret != 0) {
+        LOG_ERR("Failed to initialize flash context: %d", ret);
+        return ret;
+    }
+
+    ret = flash_area_open(SLOT1_PARTITION_ID, &fa);
+    if (ret != 0) {
+        LOG_ERR("Failed to open slot1: %d", ret);
+        return ret;
+    }
+
+    slot1_image_limit = boot_get_trailer_status_offset(fa->fa_size);
+    if (firmware_size <= 0 || (size_t)firmware_size > slot1_image_limit) {
+        LOG_ERR("Image of %d bytes does not fit into slot1 (%zu bytes usable)", firmware_size, slot1_image_limit);
+        flash_area_close(fa);
+        return -EFBIG;
+    }
+
+    sectors_erased = 0;
+    sectors_skipped = 0;
+
+    if (load_download_progress() == 0) {
+        /* bytes still sitting in the write buffer before the reboot are lost, continue after the flushed ones */
+        total_downloaded = flash_img_bytes_written(&image_ctx);
+        last_saved_progress = total_downloaded;
+        LOG_INF("Found persisted download of %s, resuming at offset %zu", target_version, total_downloaded);
+
+        ota_chunk_verifier_start(&chunk_verifier, &manifest);
+        ret = hash_written_image(total_downloaded);
+        if (ret != 0) {
+            LOG_ERR("Failed to hash the resumed image: %d", ret);
+            flash_area_close(fa);
+            return ret;
+        }
+    } else {
+        /*
+         * Slot1 is erased sector by sector while the image is written (see erase_ahead()),
+         * only the trailer is cleared up front so no stale upgrade request survives.
+         */
+        struct flash_pages_info page;
+
+        ret = flash_get_page_info_by_offs(flash_area_get_device(fa), fa->fa_off + slot1_image_limit, &page);
+        if (ret == 0) {
+            ret = erase_range(fa, page.start_offset - fa->fa_off, fa->fa_size, NULL);
+        }
+        if (ret != 0) {
+            LOG_ERR("Failed to erase slot1 trailer: %d", ret);
+            flash_area_close(fa);
+            return ret;
+        }
+
+        total_downloaded = 0;
+        last_saved_progress = 0;
+        mbedtls_sha256_starts(&image_sha, 0);
+        ota_chunk_verifier_start(&chunk_verifier, &manifest);
+        stream_flash_progress_clear(&image_ctx.stream, OTA_SETTINGS_PROGRESS_KEY);
+        if (encoding == ENCODING_RAW) {
+            /* only full images are resumed after a reboot */
+            settings_save_one(OTA_SETTINGS_VERSION_KEY, target_version, strlen(target_version));
+        }
+    }
+    flash_area_close(fa);
+
+    /* everything below the resume offset was erased before it got written */
+    erased_up_to = total_downloaded;
+
+    strcpy(download_version, target_version);
+    image_ctx_valid = true;
+    return 0;
+}
+
+/*
+ * Restarts the image hash and the chunk checks over the first len bytes already in slot1.
+ * Only needed when a download continues after a reboot, the hash state lives in RAM.
+ */
+static int hash_written_image(size_t len)
+{
+    const struct flash_area *fa;
+    int ret = flash_area_open(SLOT1_PARTITION_ID, &fa);
+    if (ret != 0) {
+        return ret;
+    }
+
+    mbedtls_sha256_starts(&image_sha, 0);
+    for (size_t pos = 0; pos < len; pos += sizeof(blank_check_buf)) {
+        size_t n = MIN(sizeof(blank_check_buf), len - pos);
+
+        if (pos % OTA_YIELD_INTERVAL_BYTES == 0) {
+            ret = yield_point();
+            if (ret != 0) {
+                break;
+            }
+        }
+        ret = flash_area_read(fa, pos, blank_check_buf, n);
+        if (ret != 0) {
+            break;
+        }
+        mbedtls_sha256_update(&image_sha, blank_check_buf, n);
+
+        ret = ota_chunk_verifier_update(&chunk_verifier, blank_check_buf, n);
+        if (ret != 0) {
+            /* written before the reboot but corrupted, start over instead of building on it */
+            clear_download_progress();
+            break;
+        }
+    }
+
+    flash_area_close(fa);
+    return ret;
+}
+
+/* Compares the hash of everything written to slot1 with the one published by the server */
+static int verify_image_hash(void)
+{
+    uint8_t digest[32];
+
+    mbedtls_sha256_finish(&image_sha, digest);
+
+    if (!expected_sha_valid) {
+        LOG_WRN("Server published no image hash, skipping integrity check");
+        return 0;
+    }
+
+    if (memcmp(digest, expected_sha, sizeof(digest)) != 0) {
+        LOG_ERR("Image hash mismatch, rejecting downloaded image");
+        download_error = OTA_ERR_INVALID_IMAGE;
+        clear_download_progress();
+        return -EBADMSG;
+    }
+
+    LOG_INF("Image hash verified");
+    return 0;
+}
+
+/*
+ * Reads slot1 back and checks it the way MCUboot will after the reboot. An image
+ * MCUboot would reject (bad layout, hash or signature, another key) costs it a
+ * reboot, the same check and an erase of the whole slot, here it costs one read.
+ */
+static int validate_image(void)
+{
+    struct ota_verify_result result;
+    uint64_t validate_start = ota_stats_now();
+    int ret = ota_verify_image(SLOT1_PARTITION_ID, &result);
+
+    ota_stats_phase(OTA_PHASE_VALIDATE, validate_start);
+    if (ret == -EBADMSG) {
+        LOG_ERR("MCUboot would reject the image in slot1, discarding it");
+        download_error = OTA_ERR_INVALID_IMAGE;
+        clear_download_progress();
+        return ret;
+    }
+    if (ret != 0) {
+        LOG_ERR("Failed to validate slot1: %d", ret);
+        return ret;
+    }
+
+    LOG_INF("Slot1 validated in %u ms (hash %u ms, signature %u ms)", result.total_us / USEC_PER_MSEC,
+            result.hash_us / USEC_PER_MSEC, result.signature_us / USEC_PER_MSEC);
+    return 0;
+}
+
+/* Makes sure slot1 is erased up to end before the write buffer reaches it */
+static int erase_ahead(size_t end)
+{
+    const struct flash_area *fa;
+    int ret;
+
+    if (end <= erased_up_to) {
+        return 0;
+    }
+
+    if (end > slot1_image_limit) {
+        LOG_ERR("Image exceeds slot1 at offset %zu", end);
+        return -EFBIG;
+    }
+
+    ret = flash_area_open(SLOT1_PARTITION_ID, &fa);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = erase_range(fa, erased_up_to, end, &erased_up_to);
+    flash_area_close(fa);
+    return ret;
+}
+
+/* Erases the sectors covering [start, end) unless they are blank already */
+static int erase_range(const struct flash_area *fa, size_t start, size_t end, size_t *done)
+{
+    const struct device *dev = flash_area_get_device(fa);
+    struct flash_pages_info page;
+    size_t offset = start;
+    int ret;
+
+    while (offset < end) {
+        ret = flash_get_page_info_by_offs(dev, fa->fa_off + offset, &page);
+        if (ret != 0) {
+            return ret;
+        }
+
+        size_t page_start = page.start_offset - fa->fa_off;
+
+        /* a sector we start in the middle of was prepared before the write got there */
+        if (page_start == offset) {
+            ret = yield_point();
+            if (ret != 0) {
+                return ret;
+            }
+
+            uint64_t erase_start = ota_stats_now();
+            if (sector_is_blank(fa, page_start, page.size)) {
+                sectors_skipped++;
+            } else {
+                ret = flash_area_erase(fa, page_start, page.size);
+                if (ret != 0) {
+                    return ret;
+                }
+                sectors_erased++;
+            }
+            ota_stats_phase(OTA_PHASE_ERASE, erase_start);
+        }
+
+        offset = page_start + page.size;
+        if (done) {
+            *done = offset;
+        }
+    }
+
+    return 0;
+}
+
+/* Between sectors: lets threads of the same priority run and ends the loop once an abort was requested */
+static int yield_point(void)
+{
+    k_yield();
+    return atomic_get(&abort_requested) ? -ECANCELED : 0;
+}
+
+static bool sector_is_blank(const struct flash_area *fa, size_t offset, size_t size)
+{
+    uint8_t erased_val = flash_area_erased_val(fa);
+
+    for (size_t pos = 0; pos < size; pos += sizeof(blank_check_buf)) {
+        size_t n = MIN(sizeof(blank_check_buf), size - pos);
+
+        if (flash_area_read(fa, offset + pos, blank_check_buf, n) != 0) {
+            return false;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (blank_check_buf[i] != erased_val) {
+                return false;
+            }
+        }
+    }
+
+    return true;
 }
 
 static void ota_enter_backoff_state(void) {
+    work_latency_window_end();
+    /* no point in holding the connection open until the next check */
+    ota_http_close(&http_session);
     set_error(OTA_ERR_NONE);
     update_status(OTA_STATUS_SLEEPING);
-    LOG_WRN("Entering sleeping state.");
-    k_work_schedule(&ota_check_work, K_SECONDS(OTA_CHECK_INTERVAL_SEC));
+
+    uint32_t delay_sec = next_check_delay_sec();
+    LOG_WRN("Entering sleeping state, next check in %u s.", delay_sec);
+    k_work_schedule_for_queue(&ota_workq, &ota_check_work, K_SECONDS(delay_sec));
+}
+
+/* Uniformly random in [base_sec - jitter_sec, base_sec + jitter_sec] */
+static uint32_t jittered(uint32_t base_sec, uint32_t jitter_sec)
+{
+    jitter_sec = MIN(jitter_sec, base_sec);
+    return base_sec - jitter_sec + sys_rand32_get() % (2 * jitter_sec + 1);
+}
+
+/* Exponential backoff with "equal jitter": half the delay is fixed, the other half random */
+static uint32_t backoff_delay_sec(int failures, uint32_t min_sec, uint32_t max_sec)
+{
+    uint32_t base = min_sec;
+
+    for (int i = 1; i < failures && base < max_sec; i++) {
+        base *= 2;
+    }
+    base = MIN(base, max_sec);
+    return jittered(base * 3 / 4, base / 4);
+}
+
+static uint32_t next_check_delay_sec(void)
+{
+    uint32_t delay_sec;
+    uint32_t hint_sec = CLAMP(server_poll_sec, OTA_SERVER_POLL_MIN_SEC, OTA_SERVER_POLL_MAX_SEC);
+
+    if (failed_cycles > 0) {
+        delay_sec = backoff_delay_sec(failed_cycles, OTA_ERROR_BACKOFF_MIN_SEC, OTA_ERROR_BACKOFF_MAX_SEC);
+        /* an overloaded server may ask for more patience than the backoff */
+        if (server_poll_sec > 0) {
+            delay_sec = MAX(delay_sec, hint_sec);
+        }
+    } else if (server_poll_sec > 0) {
+        /* the server spreads the fleet itself, more jitter would only undo that */
+        delay_sec = hint_sec;
+    } else {
+        delay_sec = jittered(OTA_CHECK_INTERVAL_SEC, OTA_CHECK_INTERVAL_SEC * OTA_POLL_JITTER_PCT / 100);
+    }
+    return delay_sec;
 }
 
 static void update_status(ota_status_t new_status)
 {
     if (current_status != new_status) {
         current_status = new_status;
+        ota_stats_status(new_status);
 
         if (status_callback != NULL) {
             status_callback(new_status);
@@ -277,43 +1115,69 @@ static void set_error(ota_error_t error)
 
 static int check_for_update(void)
 {
-    if (!wifi_is_connected()) {
-        LOG_WRN("WiFi not connected (yet), skipping update check");
+    if (!wifi_is_network_ready()) {
+        LOG_WRN("Network not ready (yet), checking once it is");
+        check_on_ready = true;
         return -ENOTCONN;
     }
+    check_on_ready = false;
     
     update_status(OTA_STATUS_CHECKING);
-    
-    /* try to create socket connection */
-    http_sock = create_http_socket(OTA_SERVER_HOST, OTA_SERVER_PORT);
-    if (http_sock < 0) {
-        LOG_ERR("Server connection failed");
-        return http_sock;
+
+    if (ota_get_running_firmware_version(running_version, sizeof(running_version)) != 0) {
+        running_version[0] = '\0';
+    }
+    if (ota_get_running_firmware_build(&running_build) != 0) {
+        running_build = 0;
     }
     
     /* Setup HTTP request for version check */
     memset(&http_req, 0, sizeof(http_req));
     
+    /* Report our version so the server can offer a patch against it, and the build so it sees rebuilds */
+    snprintf(request_url, sizeof(request_url), "%s?version=%s&build=%u&board=%s&device=%s", OTA_VERSION_URL,
+             running_version, running_build, OTA_BOARD_ID, device_id);
+
     http_req.method = HTTP_GET;
-    http_req.url = OTA_VERSION_URL;
+    http_req.url = request_url;
     http_req.host = OTA_SERVER_HOST;
     http_req.protocol = "HTTP/1.1";
     http_req.response = http_response_cb;
     http_req.recv_buf = http_recv_buf;
     http_req.recv_buf_len = sizeof(http_recv_buf);
+    http_req.http_cb = &response_header_cb;
+
+    if_none_match_header[0] = '\0';
+    if (version_etag[0] != '\0') {
+        snprintf(if_none_match_header, sizeof(if_none_match_header), "If-None-Match: %s\r\n", version_etag);
+    }
+    http_req.header_fields = version_request_headers;
+    ota_manifest_parser_init(&manifest_parser, &manifest);
     
     headers_complete = false;
+    range_offset = 0;
+    response_etag[0] = '\0';
+    server_poll_sec = 0;
+    check_ended = false;
+    header_name_len = 0;
+    header_in_value = false;
     
     LOG_INF("Checking for updates at http://%s:%d%s", OTA_SERVER_HOST, OTA_SERVER_PORT, OTA_VERSION_URL);
-    int ret = http_client_req(http_sock, &http_req, 5000, NULL); //blocks until done
-    
-    /* Close socket */
-    zsock_close(http_sock);
-    http_sock = -1;
+    uint64_t check_start = ota_stats_now();
+    int ret = ota_http_request(&http_session, &http_req, 5000); //blocks until done
+    ota_stats_phase(OTA_PHASE_VERSION_CHECK, check_start);
     
     /* in case something went wrong */
     if (ret < 0) {
         LOG_ERR("HTTP Request returned an error.");
+    } else if (check_ended) {
+        /* the callback only records this, http_client_req() still used the socket then */
+        ota_enter_backoff_state();
+    } else if (current_status == OTA_STATUS_CHECKING) {
+        /* the connection ended before the manifest was complete */
+        LOG_ERR("Incomplete version info");
+        set_error(OTA_ERR_SERVER_CONNECT);
+        ret = -EIO;
     }
     
     return ret;
@@ -322,36 +1186,24 @@ static int check_for_update(void)
 static int download_update(void)
 {
     LOG_INF("Trying to download firmware, preparing flash area");
+    download_start_ms = k_uptime_get();
 
-    if (!wifi_is_connected()) {
-        LOG_WRN("WiFi not connected, cannot download update.");
+    if (!wifi_is_network_ready()) {
+        LOG_WRN("Network not ready, cannot download update.");
         return -ENOTCONN;
     }
-
-    const struct flash_area *fa;
-    int ret;
-
-    LOG_INF("Explicitly erasing slot1 before download...");
-    ret = flash_area_open(DT_FIXED_PARTITION_ID(DT_NODELABEL(slot1_partition)), &fa);
-    if (ret != 0) {
-        LOG_ERR("Failed to open slot1 for erase: %d", ret);
-        set_error(OTA_ERR_FLASH_INIT);
-        return ret;
+    if (retry_count == 0) {
+        /* retries belong to the same update */
+        work_latency_window_start();
     }
-    ret = flash_area_erase(fa, 0, fa->fa_size); // TODO: maybe remove -> deleting the whole flash area
-    flash_area_close(fa);
 
-    if (ret != 0) {
-        LOG_ERR("Failed to erase slot1: %d", ret);
-        set_error(OTA_ERR_FLASH_INIT);
-        return ret;
-    }
-    LOG_INF("Slot1 cleared successfully.");
-    ret = flash_img_init_id(&image_ctx, DT_FIXED_PARTITION_ID(DT_NODELABEL(slot1_partition)));
-    LOG_INF("area ID of slot1: %d", DT_FIXED_PARTITION_ID(DT_NODELABEL(slot1_partition)));
+    /* Patches are small and always applied from the start, only full images survive a reboot */
+    select_encoding();
 
+    uint64_t prepare_start = ota_stats_now();
+    int ret = prepare_download();
+    ota_stats_phase(OTA_PHASE_PREPARE, prepare_start);
     if (ret != 0) {
-        LOG_ERR("Failed to initialize flash context: %d", ret);
         set_error(OTA_ERR_FLASH_INIT);
         return ret;
     }
@@ -360,55 +1212,197 @@ static int download_update(void)
     LOG_INF("Flash image using area ID: %d", area_id);
     
     update_status(OTA_STATUS_DOWNLOADING);
-    http_sock = create_http_socket(OTA_SERVER_HOST, OTA_SERVER_PORT);
-    if (http_sock < 0) {
-        set_error(OTA_ERR_SERVER_CONNECT);
-        LOG_ERR("Server connection failed.");
-        return -ECONNREFUSED;
-    }
-    /* Setup HTTP request for firmware download */
-    memset(&http_req, 0, sizeof(http_req));
 
-    http_req.method = HTTP_GET;
-    http_req.url = OTA_FIRMWARE_URL;
-    http_req.host = OTA_SERVER_HOST;
-    http_req.protocol = "HTTP/1.1";
-    http_req.response = http_response_cb;
-    http_req.recv_buf = http_recv_buf;
-    http_req.recv_buf_len = sizeof(http_recv_buf);
-    
     headers_complete = false;
-    total_downloaded = 0; 
+    bytes_received = 0;
+    bytes_since_yield = 0;
+    download_error = OTA_ERR_DOWNLOAD_FAILED;
+    download_deferred = false;
+    server_poll_sec = 0;
 
-    LOG_INF("Downloading firmware from http://%s:%d%s", OTA_SERVER_HOST, OTA_SERVER_PORT, OTA_FIRMWARE_URL);
+    /* if enabled, a raw image with chunk hashes in the manifest is fetched over several connections */
+    request_start_cycles = ota_stats_now();
+    if (OTA_PARALLEL_ENABLE && encoding == ENCODING_RAW && ota_parallel_supported(&manifest)) {
+        ret = download_parallel();
+    } else {
+        ret = download_stream();
+    }
 
-    ret = http_client_req(http_sock, &http_req, OTA_DOWNLOAD_TIMEOUT_MS, NULL); // blocks until done
-    zsock_close(http_sock);
-    http_sock = -1;
+    if (download_deferred) {
+        return defer_download();
+    }
+    if (ret >= 0) {
+        ret = finish_download();
+    }
     
     if (ret < 0) {
-        LOG_ERR("Failed to download firmware: %d", ret);
-        set_error(OTA_ERR_DOWNLOAD_FAILED);
+        LOG_ERR("Failed to download firmware: %d (%zu bytes so far)", ret, total_downloaded);
+        set_error(download_error);
+        if (encoding == ENCODING_DELTA) {
+            LOG_WRN("Patch download failed, falling back to the full image for %s", target_version);
+            delta_disabled = true;
+            clear_download_progress();
+        } else if (encoding == ENCODING_LZ4 && lz4_disabled) {
+            LOG_WRN("Decompression failed, falling back to the raw image for %s", target_version);
+            clear_download_progress();
+        } else if (image_ctx_valid && encoding == ENCODING_RAW) {
+            save_download_progress();
+        }
+
+        if (atomic_get(&abort_requested)) {
+            LOG_WRN("Download aborted after %zu bytes", total_downloaded);
+            retry_count = 0;
+            report_stats(-ECANCELED);
+            return -ECANCELED;
+        }
 
         if (++retry_count < OTA_MAX_DOWNLOAD_RETRIES) {
-            LOG_INF("Retrying download (%d/%d) in 5 seconds...", retry_count + 1, OTA_MAX_DOWNLOAD_RETRIES);
-            k_work_schedule(&ota_check_work, K_SECONDS(5));
+            uint32_t delay_sec = backoff_delay_sec(retry_count, OTA_RETRY_MIN_SEC, OTA_ERROR_BACKOFF_MAX_SEC);
+
+            LOG_INF("Retrying download (%d/%d) in %u seconds...", retry_count + 1, OTA_MAX_DOWNLOAD_RETRIES,
+                    delay_sec);
+            update_status(OTA_STATUS_UPDATE_AVAILABLE);
+            k_work_schedule_for_queue(&ota_workq, &ota_check_work, K_SECONDS(delay_sec));
+            return 0;
         } else {
             LOG_ERR("Max retry attempts reached, giving up");
             retry_count = 0;
+            report_stats(ret);
             update_status(OTA_STATUS_IDLE);
             return -1;
         }
     } else {
         LOG_INF("Firmware download successful.");
+        LOG_INF("Download took %lld ms (time to first byte %lld ms), %u sectors erased, %u already blank",
+                k_uptime_get() - download_start_ms, first_byte_ms - download_start_ms,
+                sectors_erased, sectors_skipped);
+        clear_download_progress();
+        failed_cycles = 0;
+        report_stats(0);
         update_status(OTA_STATUS_DOWNLOAD_COMPLETE);
-        k_work_schedule(&ota_check_work, K_MSEC(100));
+        k_work_schedule_for_queue(&ota_workq, &ota_check_work, K_MSEC(100));
         retry_count = 0;
     }
     
     return ret;
 }
 
+/* Receives the image, patch or compressed image over one connection, the flash writer thread consumes it */
+static int download_stream(void)
+{
+    /* Setup HTTP request for firmware download */
+    memset(&http_req, 0, sizeof(http_req));
+
+    if (encoding == ENCODING_DELTA) {
+        snprintf(request_url, sizeof(request_url), "%s?from=%s&board=%s&device=%s", OTA_FIRMWARE_URL,
+                 running_version, OTA_BOARD_ID, device_id);
+    } else {
+        snprintf(request_url, sizeof(request_url), "%s?board=%s&device=%s", OTA_FIRMWARE_URL, OTA_BOARD_ID,
+                 device_id);
+    }
+
+    http_req.method = HTTP_GET;
+    http_req.url = request_url;
+    http_req.host = OTA_SERVER_HOST;
+    http_req.protocol = "HTTP/1.1";
+    http_req.response = http_response_cb;
+    http_req.recv_buf = http_recv_buf;
+    http_req.recv_buf_len = sizeof(http_recv_buf);
+    http_req.http_cb = &response_header_cb;
+    header_name_len = 0;
+    header_in_value = false;
+    content_encoding[0] = '\0';
+    response_lz4 = false;
+
+    /* Continue a previously interrupted download where it stopped */
+    range_offset = (encoding == ENCODING_LZ4) ? ota_lz4_resume_offset(&lz4_ctx) : total_downloaded;
+    range_header[0] = '\0';
+    accept_encoding_header[0] = '\0';
+    if (range_offset > 0) {
+        snprintf(range_header, sizeof(range_header), "Range: bytes=%zu-\r\n", range_offset);
+    }
+    if (encoding == ENCODING_LZ4) {
+        snprintf(accept_encoding_header, sizeof(accept_encoding_header), "Accept-Encoding: %s\r\n",
+                 OTA_LZ4_ENCODING);
+    }
+    http_req.header_fields = request_headers;
+    
+    ota_pipeline_start(consume_firmware_data);
+
+    LOG_INF("Downloading firmware from http://%s:%d%s (offset %zu)", OTA_SERVER_HOST, OTA_SERVER_PORT,
+            request_url, range_offset);
+
+    int ret = ota_http_request(&http_session, &http_req, OTA_DOWNLOAD_TIMEOUT_MS); // blocks until done
+    if (bytes_received > 0) {
+        ota_stats_phase(OTA_PHASE_RECEIVE, first_byte_cycles);
+    }
+    if (ret == -EHOSTUNREACH || ret == -ECONNREFUSED) {
+        download_error = OTA_ERR_SERVER_CONNECT;
+    }
+
+    /* wait for the flash writer to catch up before looking at the result */
+    int sink_ret = ota_pipeline_sync();
+    if (ret >= 0 && sink_ret < 0) {
+        ret = sink_ret;
+    }
+
+    if (ret >= 0 && (!headers_complete || bytes_received != content_length)) {
+        LOG_ERR("Download incomplete: got %zu of %lld bytes", bytes_received, content_length);
+        ret = -EIO;
+    }
+
+    return ret;
+}
+
+/* The server is busy, not a failure: keep the partial image and come back when it says */
+static int defer_download(void)
+{
+    uint32_t delay_sec = OTA_RETRY_MIN_SEC;
+
+    if (server_poll_sec > 0) {
+        delay_sec = CLAMP(server_poll_sec, OTA_SERVER_POLL_MIN_SEC, OTA_SERVER_POLL_MAX_SEC);
+    }
+    if (image_ctx_valid && encoding == ENCODING_RAW) {
+        save_download_progress();
+    }
+
+    LOG_INF("Download of %s deferred by the server, trying again in %u s (%zu bytes so far)", target_version,
+            delay_sec, total_downloaded);
+    update_status(OTA_STATUS_UPDATE_AVAILABLE);
+    k_work_schedule_for_queue(&ota_workq, &ota_check_work, K_SECONDS(delay_sec));
+    return 0;
+}
+
+/* Fetches the rest of the raw image in verified chunks over several connections */
+static int download_parallel(void)
+{
+    snprintf(request_url, sizeof(request_url), "%s?board=%s&device=%s", OTA_FIRMWARE_URL, OTA_BOARD_ID,
+             device_id);
+    LOG_INF("Downloading firmware from http://%s:%d%s in %u byte chunks over %d connections (offset %zu)",
+            OTA_SERVER_HOST, OTA_SERVER_PORT, request_url, manifest.chunk_size, OTA_PARALLEL_CONNECTIONS,
+            total_downloaded);
+
+    int ret = ota_parallel_download(&manifest, request_url, total_downloaded, write_parallel_chunk,
+                                    &abort_requested, &parallel_stats);
+
+    bytes_received = parallel_stats.bytes_received;
+    if (parallel_stats.chunks > 0) {
+        first_byte_ms = download_start_ms + parallel_stats.first_byte_us / USEC_PER_MSEC;
+    }
+    ota_stats_phase(OTA_PHASE_RECEIVE, request_start_cycles);
+    if (ret == -EAGAIN) {
+        download_deferred = true;
+    } else if (ret == -EBADMSG) {
+        download_error = OTA_ERR_INVALID_IMAGE;
+    } else if (ret == -EHOSTUNREACH || ret == -ECONNREFUSED) {
+        download_error = OTA_ERR_SERVER_CONNECT;
+    }
+
+    LOG_INF("%u chunks in %u requests (%u repeated), slowest chunk %u ms", parallel_stats.chunks,
+            parallel_stats.requests, parallel_stats.refetched, parallel_stats.max_chunk_us / USEC_PER_MSEC);
+    return ret;
+}
+
 static int apply_update(void)
 {
     update_status(OTA_STATUS_APPLYING);
@@ -417,7 +1411,9 @@ static int apply_update(void)
 
     debug_image_headers(); // this should print an overview of the images in slot0 and slot1
 
+    uint64_t apply_start = ota_stats_now();
     int ret = boot_request_upgrade(BOOT_UPGRADE_TEST);
+    ota_stats_phase(OTA_PHASE_APPLY, apply_start);
     if (ret != 0) {
         LOG_ERR("Failed to request upgrade: %d", ret);
         set_error(OTA_ERR_APPLY_UPDATE);
@@ -426,50 +1422,167 @@ static int apply_update(void)
     
     LOG_INF("Update ready - rebooting in 3 seconds");
     k_sleep(K_SECONDS(3));
+    wifi_prepare_reboot();
     sys_reboot(SYS_REBOOT_WARM); //SYS_REBOOT_COLD -> no change because the signal bytes are stored anyways
     
     return 0;
 }
 
+static void ota_request_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    if (current_status == OTA_STATUS_SLEEPING && !paused) {
+        LOG_INF("Waking ota manager up..");
+        update_status(OTA_STATUS_IDLE);
+    }
+    if (current_status != OTA_STATUS_IDLE || paused) {
+        LOG_WRN("OTA operation already in progress, check request ignored");
+        return;
+    }
+
+    /* this replaces a pending timer (e.g. the hourly poll) */
+    k_work_reschedule_for_queue(&ota_workq, &ota_check_work, K_NO_WAIT);
+}
+
 static void ota_check_work_handler(struct k_work *work)
 {
     ARG_UNUSED(work);
     int ret = 0;
 
-    switch (current_status) {
-        case OTA_STATUS_IDLE:
-            ret = check_for_update();
-            break;
-            
-        case OTA_STATUS_UPDATE_AVAILABLE:
-            ret = download_update();
-            break;
-            
-        case OTA_STATUS_DOWNLOAD_COMPLETE:
-            ret = apply_update();
-            break;
-        case OTA_STATUS_SLEEPING:
-            update_status(OTA_STATUS_IDLE);
-            ret = check_for_update();
-            break;
-        default:
-            break;
+    if (paused) {
+        return;
+    }
+
+    if (atomic_get(&abort_requested)) {
+        LOG_WRN("OTA update aborted");
+        retry_count = 0;
+        ret = -ECANCELED;
+    } else {
+        switch (current_status) {
+            case OTA_STATUS_IDLE:
+                ret = check_for_update();
+                break;
+
+            case OTA_STATUS_UPDATE_AVAILABLE:
+                ret = download_update();
+                break;
+
+            case OTA_STATUS_DOWNLOAD_COMPLETE:
+                ret = apply_update();
+                break;
+            case OTA_STATUS_SLEEPING:
+                update_status(OTA_STATUS_IDLE);
+                ret = check_for_update();
+                break;
+            default:
+                break;
+        }
     }
 
     LOG_ERR("check for error in work handler: %d", ret);
     if(ret < 0) {
+        /* an abort is done once the cycle ended, whichever step noticed it */
+        atomic_clear(&abort_requested);
+        if (ret != -ECANCELED) {
+            failed_cycles++;
+        }
         ota_enter_backoff_state();
     }
 }
 
+/* Post the timings of the finished update cycle, a failure here doesn't affect the update */
+static void report_stats(int result)
+{
+    struct ota_stats stats;
+
+    ota_stats_end_cycle(result);
+    ota_stats_get(&stats, NULL);
+    work_latency_window_end();
+
+    int len = ota_stats_to_json(&stats, stats_report, sizeof(stats_report));
+    if (len < 0) {
+        LOG_WRN("Stats report doesn't fit into %zu bytes", sizeof(stats_report));
+        return;
+    }
+
+    snprintf(request_url, sizeof(request_url), "%s?board=%s&version=%s&target=%s&device=%s", OTA_STATS_URL,
+             OTA_BOARD_ID, running_version, target_version, device_id);
+
+    memset(&http_req, 0, sizeof(http_req));
+    http_req.method = HTTP_POST;
+    http_req.url = request_url;
+    http_req.host = OTA_SERVER_HOST;
+    http_req.protocol = "HTTP/1.1";
+    http_req.content_type_value = "application/json";
+    http_req.payload = stats_report;
+    http_req.payload_len = len;
+    http_req.response = stats_response_cb;
+    http_req.recv_buf = http_recv_buf;
+    http_req.recv_buf_len = sizeof(http_recv_buf);
+
+    int ret = ota_http_request(&http_session, &http_req, 5000);
+    if (ret < 0) {
+        LOG_WRN("Failed to report update stats: %d", ret);
+    }
+}
+
+static int stats_response_cb(struct http_response *rsp, enum http_final_call final_data, void *user_data)
+{
+    ARG_UNUSED(user_data);
+
+    if (final_data == HTTP_DATA_FINAL && rsp->http_status_code != 200 && rsp->http_status_code != 204) {
+        LOG_WRN("Server rejected update stats: %d", rsp->http_status_code);
+    }
+    return 0;
+}
+
+/* Runs the check that waited for the network, the hourly poll doesn't need to wait that long */
+static void network_ready_changed(bool ready)
+{
+    if (!ready || !check_on_ready || paused) {
+        return;
+    }
+    if (current_status == OTA_STATUS_IDLE || current_status == OTA_STATUS_SLEEPING) {
+        /* after a power restore the whole fleet gets here at once */
+        uint32_t delay_sec = sys_rand32_get() % (OTA_STARTUP_JITTER_SEC + 1);
+
+        LOG_INF("Network ready, checking for updates in %u s", delay_sec);
+        k_work_reschedule_for_queue(&ota_workq, &ota_check_work, K_SECONDS(delay_sec));
+    }
+}
+
 static int ota_mgmt_init(void)
 {
+    struct k_work_queue_config workq_cfg = {
+        .name = "ota_workq",
+    };
+
+    k_work_queue_start(&ota_workq, ota_workq_stack, K_THREAD_STACK_SIZEOF(ota_workq_stack), OTA_WORKQ_PRIORITY,
+                       &workq_cfg);
     k_work_init_delayable(&ota_check_work, ota_check_work_handler);
+    k_work_init(&ota_request_work, ota_request_work_handler);
+    mbedtls_sha256_init(&image_sha);
+    ota_http_session_init(&http_session, OTA_SERVER_HOST, OTA_SERVER_PORT);
+    http_session.record_stats = true;
+
+    /* without an ID the server tells devices apart by their address */
+    int ret = ota_get_device_id(device_id, sizeof(device_id));
+    if (ret != 0) {
+        device_id[0] = '\0';
+    }
+
+    ret = settings_subsys_init();
+    if (ret != 0) {
+        LOG_WRN("Settings unavailable, downloads can't be resumed after reboot: %d", ret);
+    }
 
     if (boot_is_img_confirmed()) {
-        LOG_INF("Scheduling initial OTA check in 30 seconds.");
-        k_work_schedule(&ota_check_work, K_SECONDS(30));
+        /* a test image is checked once it is confirmed, see main.c */
+        LOG_INF("Initial OTA check runs once the network is ready.");
+        check_on_ready = true;
     }
+    wifi_register_ready_callback(network_ready_changed);
 
     LOG_INF("OTA management subsystem initialized");
     return 0;
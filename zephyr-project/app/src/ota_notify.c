@@ -0,0 +1,169 @@
+#include "app_config.h"
+#include "ota_http.h"
+#include "ota_mgmt.h"
+#include "utils.h"
+#include "wifi_mgmt.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/http/client.h>
+#include <zephyr/data/json.h>
+
+
+LOG_MODULE_REGISTER(ota_notify, LOG_LEVEL_INF);
+
+/*
+ * Push channel for new releases: the server holds a GET on /api/wait until the
+ * served image differs from the release ID we name, or OTA_PUSH_WAIT_SEC passed.
+ * The ID is part of the image hash, so a rebuild of the same version wakes us
+ * too, as the version check treats it as an update. The first wait asks with a
+ * zero timeout to learn the ID of what the server serves.
+ * A release then triggers an update check right away instead of waiting for
+ * the next hourly poll, which stays in place as the fallback.
+ */
+#if OTA_PUSH_ENABLED
+
+#define OTA_WAIT_URL "/api/wait"
+
+struct wait_info {
+    const char *version;
+    const char *release;
+};
+
+static const struct json_obj_descr wait_descr[] = {
+    JSON_OBJ_DESCR_PRIM(struct wait_info, version, JSON_TOK_STRING),
+    JSON_OBJ_DESCR_PRIM(struct wait_info, release, JSON_TOK_STRING),
+};
+
+static struct ota_http_session notify_session;
+static struct http_request wait_req;
+static uint8_t wait_recv_buf[256];
+static char wait_url[160];
+static char wait_body[96];
+static size_t wait_body_len = 0;
+static int wait_status = 0;
+static char known_version[16];           // version the server last told us about
+static char known_release[20];           // release ID the server last told us about, empty before the first answer
+static bool first_wait = true;           // ask for the current release without waiting
+
+// Forward declarations
+static void ota_notify_thread(void *p1, void *p2, void *p3);
+static int wait_for_release(void);
+static int wait_response_cb(struct http_response *rsp, enum http_final_call final_data, void *user_data);
+
+K_THREAD_DEFINE(ota_notify, OTA_NOTIFY_STACK_SIZE, ota_notify_thread, NULL, NULL, NULL,
+                OTA_NOTIFY_PRIORITY, 0, 0);
+
+// private static functions
+static void ota_notify_thread(void *p1, void *p2, void *p3)
+{
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    ota_http_session_init(&notify_session, OTA_SERVER_HOST, OTA_SERVER_PORT);
+    /* the server answers only after the wait is over */
+    notify_session.recv_timeout_sec = OTA_PUSH_WAIT_SEC + OTA_HTTP_RECV_TIMEOUT_SEC;
+
+    if (ota_get_running_firmware_version(known_version, sizeof(known_version)) != 0) {
+        known_version[0] = '\0';
+    }
+
+    while (true) {
+        if (!wifi_is_network_ready()) {
+            k_sleep(K_SECONDS(5));
+            continue;
+        }
+
+        if (wait_for_release() < 0) {
+            ota_http_close(&notify_session);
+            k_sleep(K_SECONDS(OTA_PUSH_RETRY_SEC));
+        }
+    }
+}
+
+static int wait_for_release(void)
+{
+    struct wait_info info = {0};
+
+    snprintf(wait_url, sizeof(wait_url), "%s?version=%s&release=%s&board=%s&timeout=%d", OTA_WAIT_URL,
+             known_version, known_release, OTA_BOARD_ID, first_wait ? 0 : OTA_PUSH_WAIT_SEC);
+
+    memset(&wait_req, 0, sizeof(wait_req));
+    wait_req.method = HTTP_GET;
+    wait_req.url = wait_url;
+    wait_req.host = OTA_SERVER_HOST;
+    wait_req.protocol = "HTTP/1.1";
+    wait_req.response = wait_response_cb;
+    wait_req.recv_buf = wait_recv_buf;
+    wait_req.recv_buf_len = sizeof(wait_recv_buf);
+
+    wait_body_len = 0;
+    wait_status = 0;
+
+    LOG_DBG("Waiting for a release other than %s (%s)", known_version, known_release);
+    int ret = ota_http_request(&notify_session, &wait_req, (OTA_PUSH_WAIT_SEC + OTA_HTTP_RECV_TIMEOUT_SEC) * MSEC_PER_SEC);
+    if (ret < 0) {
+        LOG_WRN("Release wait failed: %d", ret);
+        return ret;
+    }
+
+    if (wait_status != 200) {
+        LOG_WRN("Server does not support push notifications (status %d)", wait_status);
+        return -ENOTSUP;
+    }
+
+    ret = json_obj_parse(wait_body, wait_body_len, wait_descr, ARRAY_SIZE(wait_descr), &info);
+    if (ret <= 0 || !info.version) {
+        LOG_ERR("Failed to parse release notification");
+        return -EINVAL;
+    }
+
+    /* the first answer only tells which release the server has, unless its version is new to us */
+    bool changed = strcmp(info.version, known_version) != 0 ||
+                   (!first_wait && info.release && strcmp(info.release, known_release) != 0);
+
+    first_wait = false;
+    strncpy(known_version, info.version, sizeof(known_version) - 1);
+    known_version[sizeof(known_version) - 1] = '\0';
+    if (info.release) {
+        strncpy(known_release, info.release, sizeof(known_release) - 1);
+        known_release[sizeof(known_release) - 1] = '\0';
+    }
+
+    if (!changed) {
+        /* wait timed out without a release, just ask again */
+        return 0;
+    }
+
+    LOG_INF("Server announced release %s (%s), checking for update now", info.version, known_release);
+
+    ret = ota_check_for_update();
+    if (ret != 0) {
+        LOG_WRN("Update check not requested (%d)", ret);
+    }
+    return 0;
+}
+
+static int wait_response_cb(struct http_response *rsp, enum http_final_call final_data, void *user_data)
+{
+    ARG_UNUSED(final_data);
+    ARG_UNUSED(user_data);
+
+    wait_status = rsp->http_status_code;
+
+    if (rsp->body_frag_len > 0) {
+        /* the answer is tiny, but may still be split across receive buffers */
+        size_t n = MIN(rsp->body_frag_len, sizeof(wait_body) - 1 - wait_body_len);
+        memcpy(&wait_body[wait_body_len], rsp->body_frag_start, n);
+        wait_body_len += n;
+        wait_body[wait_body_len] = '\0';
+    }
+
+    return 0;
+}
+
+#endif /* OTA_PUSH_ENABLED */
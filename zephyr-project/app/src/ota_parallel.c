@@ -0,0 +1,363 @@
+#include "ota_parallel.h"
+#include "app_config.h"
+#include "ota_http.h"
+#include "ota_stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/net/http/client.h>
+#include <zephyr/sys/util.h>
+
+
+LOG_MODULE_REGISTER(ota_parallel, LOG_LEVEL_INF);
+
+/* the worker threads and their buffers only exist if the mode is enabled */
+#if OTA_PARALLEL_ENABLE && OTA_PARALLEL_CONNECTIONS > 1
+
+struct chunk_worker {
+    struct k_thread thread;
+    struct ota_http_session session;
+    struct http_request req;
+    uint8_t recv_buf[1024];
+    char range_header[48];
+    const char *headers[2];
+
+    /* chunk being fetched, the sink owns buf while ready is set */
+    uint32_t index;
+    size_t len;
+    size_t received;
+    int status;
+    bool ready;
+    uint8_t buf[OTA_PARALLEL_CHUNK_MAX];
+
+    /* counters of the current download, summed up when it ends */
+    size_t bytes_received;
+    uint32_t requests;
+    uint32_t refetched;
+    uint32_t max_chunk_us;
+};
+
+K_THREAD_STACK_ARRAY_DEFINE(worker_stacks, OTA_PARALLEL_CONNECTIONS, OTA_PARALLEL_STACK_SIZE);
+static struct chunk_worker workers[OTA_PARALLEL_CONNECTIONS];
+static bool workers_started = false;
+
+static K_SEM_DEFINE(start_sem, 0, OTA_PARALLEL_CONNECTIONS);
+static K_SEM_DEFINE(done_sem, 0, OTA_PARALLEL_CONNECTIONS);
+
+/* State of the running download, the chunk counters are protected by lock */
+static K_MUTEX_DEFINE(lock);
+static K_CONDVAR_DEFINE(changed);
+static const struct ota_manifest *manifest;
+static const char *image_url;
+static const atomic_t *abort_flag;
+static uint32_t next_chunk = 0;          // next chunk a worker takes
+static uint32_t commit_chunk = 0;        // next chunk the sink gets
+static atomic_t first_error = ATOMIC_INIT(0);   // stops all workers, also checked while receiving
+
+// Forward declarations
+static void start_workers(void);
+static void worker_thread(void *p1, void *p2, void *p3);
+static void run_worker(struct chunk_worker *w);
+static int fetch_chunk(struct chunk_worker *w);
+static int chunk_response_cb(struct http_response *rsp, enum http_final_call final_data, void *user_data);
+static struct chunk_worker *ready_worker(uint32_t index);
+static void fail(int error);
+static uint32_t elapsed_us(uint64_t start);
+
+// public functions
+bool ota_parallel_supported(const struct ota_manifest *m)
+{
+    return m->chunk_count > 0 && m->chunk_size > 0 && m->chunk_size <= OTA_PARALLEL_CHUNK_MAX;
+}
+
+int ota_parallel_download(const struct ota_manifest *m, const char *url, size_t offset,
+                          ota_parallel_sink_t sink, const atomic_t *abort, struct ota_parallel_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!ota_parallel_supported(m) || offset > m->size) {
+        return -ENOTSUP;
+    }
+    start_workers();
+
+    manifest = m;
+    image_url = url;
+    abort_flag = abort;
+    next_chunk = offset / m->chunk_size;
+    commit_chunk = next_chunk;
+    atomic_set(&first_error, 0);
+
+    for (int i = 0; i < OTA_PARALLEL_CONNECTIONS; i++) {
+        struct chunk_worker *w = &workers[i];
+
+        memset(&w->req, 0, sizeof(w->req));
+        w->req.method = HTTP_GET;
+        w->req.url = url;
+        w->req.host = OTA_SERVER_HOST;
+        w->req.protocol = "HTTP/1.1";
+        w->req.response = chunk_response_cb;
+        w->req.recv_buf = w->recv_buf;
+        w->req.recv_buf_len = sizeof(w->recv_buf);
+        w->headers[0] = w->range_header;
+        w->headers[1] = NULL;
+        w->req.header_fields = w->headers;
+        w->ready = false;
+        w->bytes_received = 0;
+        w->requests = 0;
+        w->refetched = 0;
+        w->max_chunk_us = 0;
+        k_sem_give(&start_sem);
+    }
+
+    uint64_t start = ota_stats_now();
+    size_t skip = offset - (size_t)commit_chunk * m->chunk_size;
+    int ret = 0;
+
+    while (commit_chunk < m->chunk_count) {
+        struct chunk_worker *w = NULL;
+
+        k_mutex_lock(&lock, K_FOREVER);
+        while ((ret = (int)atomic_get(&first_error)) == 0 && (w = ready_worker(commit_chunk)) == NULL) {
+            k_condvar_wait(&changed, &lock, K_FOREVER);
+        }
+        k_mutex_unlock(&lock);
+        if (ret != 0) {
+            break;
+        }
+
+        /* the worker waits until its buffer is consumed, no need to hold the lock meanwhile */
+        if (stats->chunks == 0) {
+            stats->first_byte_us = elapsed_us(start);
+        }
+        ret = sink(&w->buf[skip], w->len - skip);
+        skip = 0;
+        stats->chunks++;
+
+        k_mutex_lock(&lock, K_FOREVER);
+        w->ready = false;
+        commit_chunk++;
+        if (ret != 0) {
+            fail(ret);
+        } else {
+            k_condvar_broadcast(&changed);
+        }
+        k_mutex_unlock(&lock);
+        if (ret != 0) {
+            break;
+        }
+    }
+
+    /* workers finish their current request and give their buffers back */
+    for (int i = 0; i < OTA_PARALLEL_CONNECTIONS; i++) {
+        k_sem_take(&done_sem, K_FOREVER);
+    }
+
+    for (int i = 0; i < OTA_PARALLEL_CONNECTIONS; i++) {
+        stats->bytes_received += workers[i].bytes_received;
+        stats->requests += workers[i].requests;
+        stats->refetched += workers[i].refetched;
+        stats->max_chunk_us = MAX(stats->max_chunk_us, workers[i].max_chunk_us);
+    }
+
+    if (atomic_get(abort)) {
+        return -ECANCELED;
+    }
+    return ret;
+}
+
+// private static functions
+static void start_workers(void)
+{
+    if (workers_started) {
+        return;
+    }
+
+    for (int i = 0; i < OTA_PARALLEL_CONNECTIONS; i++) {
+        char name[16];
+
+        ota_http_session_init(&workers[i].session, OTA_SERVER_HOST, OTA_SERVER_PORT);
+        k_thread_create(&workers[i].thread, worker_stacks[i], K_THREAD_STACK_SIZEOF(worker_stacks[i]),
+                        worker_thread, &workers[i], NULL, NULL, OTA_PARALLEL_PRIORITY, 0, K_NO_WAIT);
+        snprintf(name, sizeof(name), "ota_chunk%d", i);
+        k_thread_name_set(&workers[i].thread, name);
+    }
+    workers_started = true;
+}
+
+static void worker_thread(void *p1, void *p2, void *p3)
+{
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    struct chunk_worker *w = p1;
+
+    while (true) {
+        k_sem_take(&start_sem, K_FOREVER);
+        run_worker(w);
+        /* the server would close the idle connection long before the next update */
+        ota_http_close(&w->session);
+        k_sem_give(&done_sem);
+    }
+}
+
+static void run_worker(struct chunk_worker *w)
+{
+    k_mutex_lock(&lock, K_FOREVER);
+
+    while (atomic_get(&first_error) == 0) {
+        /* stay at most one chunk per worker ahead of the sink */
+        if (next_chunk < manifest->chunk_count && next_chunk >= commit_chunk + OTA_PARALLEL_CONNECTIONS) {
+            k_condvar_wait(&changed, &lock, K_FOREVER);
+            continue;
+        }
+        if (next_chunk >= manifest->chunk_count) {
+            break;
+        }
+        w->index = next_chunk++;
+        k_mutex_unlock(&lock);
+
+        int ret = fetch_chunk(w);
+
+        k_mutex_lock(&lock, K_FOREVER);
+        if (ret != 0) {
+            fail(ret);
+            break;
+        }
+        w->ready = true;
+        k_condvar_broadcast(&changed);
+        while (w->ready && atomic_get(&first_error) == 0) {
+            k_condvar_wait(&changed, &lock, K_FOREVER);
+        }
+    }
+
+    k_mutex_unlock(&lock);
+}
+
+/* Fetches one chunk until it matches its hash or the attempts are used up */
+static int fetch_chunk(struct chunk_worker *w)
+{
+    size_t start = (size_t)w->index * manifest->chunk_size;
+    uint64_t chunk_start = ota_stats_now();
+    int ret = -EIO;
+
+    w->len = MIN(manifest->chunk_size, manifest->size - start);
+    snprintf(w->range_header, sizeof(w->range_header), "Range: bytes=%zu-%zu\r\n", start, start + w->len - 1);
+
+    for (int attempt = 1; attempt <= OTA_PARALLEL_CHUNK_ATTEMPTS; attempt++) {
+        if (attempt > 1) {
+            LOG_WRN("Fetching chunk %u again (attempt %d of %d) after %d", w->index, attempt,
+                    OTA_PARALLEL_CHUNK_ATTEMPTS, ret);
+            w->refetched++;
+            k_sleep(K_MSEC(OTA_PARALLEL_RETRY_DELAY_MS));
+        }
+        if (atomic_get(abort_flag)) {
+            return -ECANCELED;
+        }
+        if (atomic_get(&first_error) != 0) {
+            return (int)atomic_get(&first_error);
+        }
+
+        w->received = 0;
+        w->status = 0;
+        w->requests++;
+        ret = ota_http_request(&w->session, &w->req, OTA_DOWNLOAD_TIMEOUT_MS);
+        if (ret < 0) {
+            continue;
+        }
+
+        if (w->status == 503) {
+            /* no download slot free on the server, asking again right away won't help */
+            return -EAGAIN;
+        }
+        if (w->status != 206 || w->received != w->len) {
+            LOG_WRN("Chunk %u: status %d, %zu of %zu bytes", w->index, w->status, w->received, w->len);
+            ret = -EIO;
+            continue;
+        }
+        if (!ota_manifest_chunk_matches(manifest, w->index, w->buf, w->len)) {
+            LOG_WRN("Chunk %u doesn't match the manifest", w->index);
+            ret = -EBADMSG;
+            continue;
+        }
+
+        w->max_chunk_us = MAX(w->max_chunk_us, elapsed_us(chunk_start));
+        return 0;
+    }
+
+    LOG_ERR("Giving up on chunk %u at offset %zu: %d", w->index, start, ret);
+    return ret;
+}
+
+static int chunk_response_cb(struct http_response *rsp, enum http_final_call final_data, void *user_data)
+{
+    ARG_UNUSED(final_data);
+    ARG_UNUSED(user_data);
+
+    struct http_request *req = CONTAINER_OF(rsp, struct http_request, internal.response);
+    struct chunk_worker *w = CONTAINER_OF(req, struct chunk_worker, req);
+
+    if (atomic_get(abort_flag) || atomic_get(&first_error) != 0) {
+        return -ECANCELED;
+    }
+
+    w->status = rsp->http_status_code;
+    if (w->status != 206 || rsp->body_frag_len == 0) {
+        /* e.g. the text of a 503 while the server's download slots are busy */
+        return 0;
+    }
+    if (w->received + rsp->body_frag_len > w->len) {
+        LOG_ERR("Chunk %u: server sent more than the requested range", w->index);
+        return -EMSGSIZE;
+    }
+
+    memcpy(&w->buf[w->received], rsp->body_frag_start, rsp->body_frag_len);
+    w->received += rsp->body_frag_len;
+    w->bytes_received += rsp->body_frag_len;
+    return 0;
+}
+
+static struct chunk_worker *ready_worker(uint32_t index)
+{
+    for (int i = 0; i < OTA_PARALLEL_CONNECTIONS; i++) {
+        if (workers[i].ready && workers[i].index == index) {
+            return &workers[i];
+        }
+    }
+    return NULL;
+}
+
+/* Records the first error and wakes everyone waiting, callers hold lock */
+static void fail(int error)
+{
+    atomic_cas(&first_error, 0, error);
+    k_condvar_broadcast(&changed);
+}
+
+static uint32_t elapsed_us(uint64_t start)
+{
+    return (uint32_t)MIN(k_cyc_to_us_floor64(ota_stats_now() - start), UINT32_MAX);
+}
+
+#else
+
+bool ota_parallel_supported(const struct ota_manifest *m)
+{
+    ARG_UNUSED(m);
+    return false;
+}
+
+int ota_parallel_download(const struct ota_manifest *m, const char *url, size_t offset,
+                          ota_parallel_sink_t sink, const atomic_t *abort, struct ota_parallel_stats *stats)
+{
+    ARG_UNUSED(m);
+    ARG_UNUSED(url);
+    ARG_UNUSED(offset);
+    ARG_UNUSED(sink);
+    ARG_UNUSED(abort);
+    memset(stats, 0, sizeof(*stats));
+    return -ENOTSUP;
+}
+
+#endif /* OTA_PARALLEL_ENABLE && OTA_PARALLEL_CONNECTIONS > 1 */
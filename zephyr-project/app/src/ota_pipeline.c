@@ -0,0 +1,124 @@
+#include "ota_pipeline.h"
+#include "app_config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+
+
+LOG_MODULE_REGISTER(ota_pipeline, LOG_LEVEL_INF);
+
+struct pipeline_buf {
+    size_t len;
+    uint8_t data[OTA_PIPELINE_BUF_SIZE];
+};
+
+/* Ring of receive buffers, a NULL entry in the queue is a sync marker */
+K_MEM_SLAB_DEFINE_STATIC(buf_slab, sizeof(struct pipeline_buf), OTA_PIPELINE_DEPTH, 4);
+K_MSGQ_DEFINE(buf_queue, sizeof(struct pipeline_buf *), OTA_PIPELINE_DEPTH + 1, 4);
+static K_SEM_DEFINE(sync_sem, 0, 1);
+
+static ota_pipeline_sink_t sink = NULL;
+static atomic_t sink_error = ATOMIC_INIT(0);
+static struct pipeline_buf *fill_buf = NULL;   // partially filled buffer owned by the producer
+
+// Forward declarations
+static void writer_thread(void *p1, void *p2, void *p3);
+static int submit_fill_buf(void);
+
+K_THREAD_DEFINE(ota_writer, OTA_FLASH_WRITER_STACK_SIZE, writer_thread, NULL, NULL, NULL,
+                OTA_FLASH_WRITER_PRIORITY, 0, 0);
+
+// public functions
+void ota_pipeline_start(ota_pipeline_sink_t new_sink)
+{
+    sink = new_sink;
+    atomic_set(&sink_error, 0);
+    k_sem_reset(&sync_sem);
+}
+
+int ota_pipeline_submit(const uint8_t *data, size_t len)
+{
+    while (len > 0) {
+        int ret = (int)atomic_get(&sink_error);
+        if (ret != 0) {
+            return ret;
+        }
+
+        if (fill_buf == NULL) {
+            /* backpressure: wait for the writer to hand a buffer back */
+            if (k_mem_slab_alloc(&buf_slab, (void **)&fill_buf, K_MSEC(OTA_DOWNLOAD_TIMEOUT_MS)) != 0) {
+                LOG_ERR("Flash writer stalled, no free buffer");
+                fill_buf = NULL;
+                return -ETIMEDOUT;
+            }
+            fill_buf->len = 0;
+        }
+
+        size_t n = MIN(len, sizeof(fill_buf->data) - fill_buf->len);
+        memcpy(&fill_buf->data[fill_buf->len], data, n);
+        fill_buf->len += n;
+        data += n;
+        len -= n;
+
+        if (fill_buf->len == sizeof(fill_buf->data)) {
+            submit_fill_buf();
+        }
+    }
+
+    return 0;
+}
+
+int ota_pipeline_sync(void)
+{
+    struct pipeline_buf *marker = NULL;
+
+    if (fill_buf != NULL) {
+        submit_fill_buf();
+    }
+
+    k_msgq_put(&buf_queue, &marker, K_FOREVER);
+    k_sem_take(&sync_sem, K_FOREVER);
+
+    return (int)atomic_get(&sink_error);
+}
+
+// private static functions
+static int submit_fill_buf(void)
+{
+    /* the queue holds one more entry than there are buffers, so this never blocks */
+    int ret = k_msgq_put(&buf_queue, &fill_buf, K_FOREVER);
+    fill_buf = NULL;
+    return ret;
+}
+
+static void writer_thread(void *p1, void *p2, void *p3)
+{
+    ARG_UNUSED(p1);
+    ARG_UNUSED(p2);
+    ARG_UNUSED(p3);
+
+    struct pipeline_buf *buf;
+
+    while (1) {
+        k_msgq_get(&buf_queue, &buf, K_FOREVER);
+
+        if (buf == NULL) {
+            k_sem_give(&sync_sem);
+            continue;
+        }
+
+        /* after an error the remaining buffers are only drained */
+        if (atomic_get(&sink_error) == 0 && sink != NULL) {
+            int ret = sink(buf->data, buf->len);
+            if (ret != 0) {
+                LOG_ERR("Flash writer sink failed: %d", ret);
+                atomic_set(&sink_error, ret);
+            }
+        }
+
+        k_mem_slab_free(&buf_slab, (void *)buf);
+    }
+}
@@ -0,0 +1,232 @@
+#include "app_config.h"
+#include "ota_bench.h"
+#include "ota_mgmt.h"
+#include "ota_stats.h"
+#include "utils.h"
+#include "work_latency.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/shell/shell.h>
+
+
+static const char *const status_names[OTA_STATS_STATUS_COUNT] = {
+    [OTA_STATUS_IDLE] = "idle",
+    [OTA_STATUS_CHECKING] = "checking",
+    [OTA_STATUS_UPDATE_AVAILABLE] = "update available",
+    [OTA_STATUS_DOWNLOADING] = "downloading",
+    [OTA_STATUS_DOWNLOAD_COMPLETE] = "download complete",
+    [OTA_STATUS_APPLYING] = "applying",
+    [OTA_STATUS_ERROR] = "error",
+    [OTA_STATUS_SLEEPING] = "sleeping",
+};
+
+static struct ota_stats shell_stats;
+static struct ota_bench_result bench_result;
+
+// Forward declarations
+static int cmd_status(const struct shell *sh, size_t argc, char **argv);
+static int cmd_check(const struct shell *sh, size_t argc, char **argv);
+static int cmd_abort(const struct shell *sh, size_t argc, char **argv);
+static int cmd_stats(const struct shell *sh, size_t argc, char **argv);
+static int cmd_bench(const struct shell *sh, size_t argc, char **argv);
+static int cmd_latency(const struct shell *sh, size_t argc, char **argv);
+static void print_histogram(const struct shell *sh, const char *name, const uint32_t *hist, size_t count,
+                            const char *unit);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(ota_cmds,
+    SHELL_CMD_ARG(status, NULL, "Show OTA status and download progress", cmd_status, 1, 0),
+    SHELL_CMD_ARG(check, NULL, "Check for an update now", cmd_check, 1, 0),
+    SHELL_CMD_ARG(abort, NULL, "Abort the running update cycle", cmd_abort, 1, 0),
+    SHELL_CMD_ARG(stats, NULL, "Show timings of the current cycle, 'ota stats last' for the last update",
+                  cmd_stats, 1, 1),
+    SHELL_CMD_ARG(bench, NULL,
+                  "Measure throughput: 'ota bench network|flash|pipeline [bytes]'. "
+                  "flash and pipeline overwrite slot1 and drop a paused download",
+                  cmd_bench, 2, 1),
+    SHELL_CMD_ARG(latency, NULL, "Show the worst latency of other work items, overall and during the last update",
+                  cmd_latency, 1, 0),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(ota, &ota_cmds, "OTA update commands", NULL);
+
+// private static functions
+static int cmd_status(const struct shell *sh, size_t argc, char **argv)
+{
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    char version[16];
+    size_t written;
+    size_t total;
+    ota_status_t status = ota_get_status();
+
+    if (ota_get_running_firmware_version(version, sizeof(version)) != 0) {
+        strcpy(version, "unknown");
+    }
+    ota_get_download_progress(&written, &total);
+    ota_stats_get(&shell_stats, NULL);
+
+    shell_print(sh, "status:   %s", status < OTA_STATS_STATUS_COUNT ? status_names[status] : "unknown");
+    shell_print(sh, "error:    %d", ota_get_last_error());
+    shell_print(sh, "running:  %s (%s)", version, OTA_BOARD_ID);
+    shell_print(sh, "cycle:    %u", shell_stats.cycle);
+    if (total > 0) {
+        shell_print(sh, "progress: %zu / %zu bytes (%zu%%)", written, total, written * 100 / total);
+    }
+    return 0;
+}
+
+static int cmd_check(const struct shell *sh, size_t argc, char **argv)
+{
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    int ret = ota_check_for_update();
+    if (ret != 0) {
+        shell_error(sh, "Update check not requested (%d)", ret);
+        return ret;
+    }
+    shell_print(sh, "Update check requested, see the log for the result");
+    return 0;
+}
+
+static int cmd_abort(const struct shell *sh, size_t argc, char **argv)
+{
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    int ret = ota_abort_update();
+    if (ret == -EALREADY) {
+        shell_print(sh, "No update running");
+        return 0;
+    }
+    if (ret != 0) {
+        shell_error(sh, "Can't abort, the update is being applied");
+        return ret;
+    }
+    shell_print(sh, "Abort requested");
+    return 0;
+}
+
+static int cmd_stats(const struct shell *sh, size_t argc, char **argv)
+{
+    bool last = (argc > 1 && strcmp(argv[1], "last") == 0);
+
+    if (last) {
+        ota_stats_get(NULL, &shell_stats);
+    } else {
+        ota_stats_get(&shell_stats, NULL);
+    }
+
+    if (shell_stats.cycle == 0) {
+        shell_print(sh, "No %s yet", last ? "update" : "update cycle");
+        return 0;
+    }
+
+    shell_print(sh, "cycle %u, result %d, %u bytes received, %u bytes written", shell_stats.cycle,
+                shell_stats.result, shell_stats.bytes_received, shell_stats.bytes_written);
+    for (int i = 0; i < OTA_PHASE_COUNT; i++) {
+        if (shell_stats.phase_count[i] > 0) {
+            shell_print(sh, "  %-14s %8u us (%u times)", ota_stats_phase_name(i), shell_stats.phase_us[i],
+                        shell_stats.phase_count[i]);
+        }
+    }
+    for (int i = 0; i < OTA_STATS_STATUS_COUNT; i++) {
+        if (i == OTA_STATUS_CHECKING || shell_stats.status_at_us[i] > 0) {
+            shell_print(sh, "  entered %-17s at %u us", status_names[i], shell_stats.status_at_us[i]);
+        }
+    }
+    print_histogram(sh, "chunk sizes", shell_stats.chunk_hist, OTA_STATS_CHUNK_BUCKETS, "B");
+    print_histogram(sh, "flash writes", shell_stats.write_hist, OTA_STATS_LATENCY_BUCKETS, "us");
+    shell_print(sh, "  slowest flash write %u us", shell_stats.write_max_us);
+    return 0;
+}
+
+static int cmd_bench(const struct shell *sh, size_t argc, char **argv)
+{
+    enum ota_bench_mode mode;
+    size_t size = (argc > 2) ? strtoul(argv[2], NULL, 0) : 0;
+    int ret;
+
+    if (strcmp(argv[1], "network") == 0) {
+        mode = OTA_BENCH_NETWORK;
+    } else if (strcmp(argv[1], "flash") == 0) {
+        mode = OTA_BENCH_FLASH;
+    } else if (strcmp(argv[1], "pipeline") == 0) {
+        mode = OTA_BENCH_PIPELINE;
+    } else {
+        shell_error(sh, "Unknown mode %s, use network, flash or pipeline", argv[1]);
+        return -EINVAL;
+    }
+
+    /* the flash modes need slot1, the network mode only needs an idle connection to the server */
+    if (mode == OTA_BENCH_NETWORK) {
+        ota_status_t status = ota_get_status();
+        ret = (status == OTA_STATUS_IDLE || status == OTA_STATUS_SLEEPING) ? 0 : -EBUSY;
+    } else {
+        ret = ota_pause();
+    }
+    if (ret != 0) {
+        shell_error(sh, "An update is running, try again later or use 'ota abort'");
+        return ret;
+    }
+
+    shell_print(sh, "Running %s benchmark...", argv[1]);
+    ret = ota_bench_run(mode, size, &bench_result);
+
+    if (mode != OTA_BENCH_NETWORK) {
+        ota_resume();
+    }
+    if (ret != 0) {
+        shell_error(sh, "Benchmark failed: %d", ret);
+        return ret;
+    }
+
+    shell_print(sh, "%s: %zu bytes in %u ms, %u bytes/s", argv[1], bench_result.bytes,
+                bench_result.elapsed_us / USEC_PER_MSEC, ota_bench_bytes_per_sec(&bench_result));
+    if (mode != OTA_BENCH_FLASH) {
+        shell_print(sh, "  first byte after %u us", bench_result.first_byte_us);
+    }
+    if (mode != OTA_BENCH_NETWORK) {
+        shell_print(sh, "  erasing took %u us", bench_result.erase_us);
+    }
+    shell_print(sh, "  %s latency (%u samples): p50 %u us, p90 %u us, p99 %u us, max %u us",
+                mode == OTA_BENCH_FLASH ? "write" : "chunk", bench_result.samples, bench_result.p50_us,
+                bench_result.p90_us, bench_result.p99_us, bench_result.max_us);
+    return 0;
+}
+
+static int cmd_latency(const struct shell *sh, size_t argc, char **argv)
+{
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+
+    const struct work_latency *wl;
+
+    for (size_t i = 0; (wl = work_latency_get(i)) != NULL; i++) {
+        shell_print(sh, "%-10s %8u runs, max %u us, max during the last update %u us", wl->name, wl->runs,
+                    wl->max_us, wl->window_max_us);
+    }
+    return 0;
+}
+
+/* Prints the non-empty buckets of a log2 histogram */
+static void print_histogram(const struct shell *sh, const char *name, const uint32_t *hist, size_t count,
+                            const char *unit)
+{
+    shell_print(sh, "  %s:", name);
+    for (size_t i = 0; i < count; i++) {
+        if (hist[i] == 0) {
+            continue;
+        }
+        if (i == count - 1) {
+            shell_print(sh, "    >= %u %s: %u", 1U << i, unit, hist[i]);
+        } else {
+            shell_print(sh, "    %u..%u %s: %u", i == 0 ? 0U : 1U << i, (2U << i) - 1, unit, hist[i]);
+        }
+    }
+}
@@ -0,0 +1,207 @@
+#include "ota_stats.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+
+
+static struct k_spinlock lock;
+static struct ota_stats current;
+static struct ota_stats last_update;
+static uint64_t cycle_start = 0;
+
+#ifndef CONFIG_TIMER_HAS_64BIT_CYCLE_COUNTER
+static uint64_t cycles_widened = 0;
+static uint32_t cycles_last = 0;
+static int64_t cycles_last_ms = 0;
+#endif
+
+static const char *const phase_names[OTA_PHASE_COUNT] = {
+    [OTA_PHASE_DNS] = "dns",
+    [OTA_PHASE_CONNECT] = "connect",
+    [OTA_PHASE_VERSION_CHECK] = "version_check",
+    [OTA_PHASE_PREPARE] = "prepare",
+    [OTA_PHASE_FIRST_BYTE] = "first_byte",
+    [OTA_PHASE_RECEIVE] = "receive",
+    [OTA_PHASE_ERASE] = "erase",
+    [OTA_PHASE_FLASH_WRITE] = "flash_write",
+    [OTA_PHASE_VERIFY] = "verify",
+    [OTA_PHASE_VALIDATE] = "validate",
+    [OTA_PHASE_APPLY] = "apply",
+};
+
+// Forward declarations
+static uint32_t elapsed_us(uint64_t start);
+static uint32_t log2_bucket(uint32_t value, uint32_t buckets);
+static int append_array(char *buf, size_t len, int pos, const char *name, const uint32_t *values, size_t count);
+
+// Public functions
+uint64_t ota_stats_now(void)
+{
+#ifdef CONFIG_TIMER_HAS_64BIT_CYCLE_COUNTER
+    return k_cycle_get_64();
+#else
+    /*
+     * Widen the 32 bit counter. It is read far more often than it wraps while an
+     * update runs, longer gaps (e.g. a stalled connection) fall back to uptime.
+     */
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint32_t now = k_cycle_get_32();
+    int64_t now_ms = k_uptime_get();
+    uint64_t gap_cycles = (uint64_t)(now_ms - cycles_last_ms) * (sys_clock_hw_cycles_per_sec() / MSEC_PER_SEC);
+
+    if (gap_cycles >= UINT32_MAX / 2) {
+        cycles_widened += gap_cycles;
+    } else {
+        cycles_widened += (uint32_t)(now - cycles_last);
+    }
+    cycles_last = now;
+    cycles_last_ms = now_ms;
+    uint64_t ret = cycles_widened;
+    k_spin_unlock(&lock, key);
+    return ret;
+#endif
+}
+
+void ota_stats_status(ota_status_t status)
+{
+    uint64_t now = ota_stats_now();
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    if (status == OTA_STATUS_CHECKING) {
+        uint32_t cycle = current.cycle + 1;
+        memset(&current, 0, sizeof(current));
+        current.cycle = cycle;
+        cycle_start = now;
+    }
+    if (status < OTA_STATS_STATUS_COUNT) {
+        current.status_at_us[status] = (uint32_t)k_cyc_to_us_floor64(now - cycle_start);
+    }
+
+    k_spin_unlock(&lock, key);
+}
+
+void ota_stats_phase(enum ota_phase phase, uint64_t start)
+{
+    uint32_t us = elapsed_us(start);
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    current.phase_us[phase] += us;
+    current.phase_count[phase]++;
+
+    k_spin_unlock(&lock, key);
+}
+
+void ota_stats_chunk(size_t len)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    current.bytes_received += len;
+    current.chunk_hist[log2_bucket(len, OTA_STATS_CHUNK_BUCKETS)]++;
+
+    k_spin_unlock(&lock, key);
+}
+
+void ota_stats_flash_write(size_t len, uint64_t start)
+{
+    uint32_t us = elapsed_us(start);
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    current.bytes_written += len;
+    current.phase_us[OTA_PHASE_FLASH_WRITE] += us;
+    current.phase_count[OTA_PHASE_FLASH_WRITE]++;
+    current.write_hist[log2_bucket(us, OTA_STATS_LATENCY_BUCKETS)]++;
+    current.write_max_us = MAX(current.write_max_us, us);
+
+    k_spin_unlock(&lock, key);
+}
+
+void ota_stats_end_cycle(int result)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    current.result = result;
+    if (current.bytes_received > 0) {
+        last_update = current;
+    }
+
+    k_spin_unlock(&lock, key);
+}
+
+void ota_stats_get(struct ota_stats *cur, struct ota_stats *last)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    if (cur != NULL) {
+        *cur = current;
+    }
+    if (last != NULL) {
+        *last = last_update;
+    }
+
+    k_spin_unlock(&lock, key);
+}
+
+const char *ota_stats_phase_name(enum ota_phase phase)
+{
+    return phase < OTA_PHASE_COUNT ? phase_names[phase] : "unknown";
+}
+
+int ota_stats_to_json(const struct ota_stats *stats, char *buf, size_t len)
+{
+    int pos = snprintf(buf, len, "{\"cycle\":%u,\"result\":%d,\"bytes_received\":%u,\"bytes_written\":%u,"
+                       "\"write_max_us\":%u,\"phases_us\":{",
+                       stats->cycle, stats->result, stats->bytes_received, stats->bytes_written,
+                       stats->write_max_us);
+
+    for (int i = 0; i < OTA_PHASE_COUNT && pos < (int)len; i++) {
+        pos += snprintf(&buf[pos], len - pos, "%s\"%s\":%u", i > 0 ? "," : "", phase_names[i],
+                        stats->phase_us[i]);
+    }
+    if (pos < (int)len) {
+        pos += snprintf(&buf[pos], len - pos, "}");
+    }
+
+    pos = append_array(buf, len, pos, "phase_count", stats->phase_count, OTA_PHASE_COUNT);
+    pos = append_array(buf, len, pos, "status_at_us", stats->status_at_us, OTA_STATS_STATUS_COUNT);
+    pos = append_array(buf, len, pos, "chunk_hist", stats->chunk_hist, OTA_STATS_CHUNK_BUCKETS);
+    pos = append_array(buf, len, pos, "write_hist", stats->write_hist, OTA_STATS_LATENCY_BUCKETS);
+
+    if (pos < (int)len) {
+        pos += snprintf(&buf[pos], len - pos, "}");
+    }
+
+    return pos < (int)len ? pos : -ENOMEM;
+}
+
+// private static functions
+static uint32_t elapsed_us(uint64_t start)
+{
+    return (uint32_t)MIN(k_cyc_to_us_floor64(ota_stats_now() - start), UINT32_MAX);
+}
+
+static uint32_t log2_bucket(uint32_t value, uint32_t buckets)
+{
+    if (value == 0) {
+        return 0;
+    }
+    return MIN(31 - __builtin_clz(value), buckets - 1);
+}
+
+static int append_array(char *buf, size_t len, int pos, const char *name, const uint32_t *values, size_t count)
+{
+    if (pos >= (int)len) {
+        return pos;
+    }
+    pos += snprintf(&buf[pos], len - pos, ",\"%s\":[", name);
+
+    for (size_t i = 0; i < count && pos < (int)len; i++) {
+        pos += snprintf(&buf[pos], len - pos, "%s%u", i > 0 ? "," : "", values[i]);
+    }
+    if (pos < (int)len) {
+        pos += snprintf(&buf[pos], len - pos, "]");
+    }
+    return pos;
+}
@@ -0,0 +1,287 @@
+#include "ota_verify.h"
+#include "app_config.h"
+#include "mcuboot_image.h"
+#include "ota_stats.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/sys/util.h>
+#include <mbedtls/sha256.h>
+#ifdef OTA_VERIFY_SIGNATURE
+#include <mbedtls/pk.h>
+#endif
+
+
+LOG_MODULE_REGISTER(ota_verify, LOG_LEVEL_INF);
+
+#ifdef OTA_VERIFY_SIGNATURE
+/* generated by 'imgtool getpub' from the MCUboot signing key, DER SubjectPublicKeyInfo */
+extern const unsigned char ecdsa_pub_key[];
+extern const unsigned int ecdsa_pub_key_len;
+#endif
+
+/* what the unprotected TLV area holds for the checks */
+struct image_tlvs {
+    uint8_t sha256[IMAGE_HASH_LEN];
+    bool sha256_found;
+    uint8_t key_hash[IMAGE_HASH_LEN];
+    bool key_hash_found;
+    uint8_t signature[IMAGE_ECDSA_SIG_MAX_LEN];
+    size_t signature_len;
+};
+
+static uint8_t read_buf[OTA_VERIFY_READ_SIZE];
+static struct image_tlvs tlvs;
+
+// Forward declarations
+static int check_layout(const struct flash_area *fa, struct raw_image_header *hdr, size_t *hashed_len);
+static int read_tlvs(const struct flash_area *fa, size_t off, struct image_tlvs *out);
+static int hash_image(const struct flash_area *fa, size_t len, uint8_t *digest);
+#ifdef OTA_VERIFY_SIGNATURE
+static int verify_signature(const uint8_t *digest, const struct image_tlvs *t);
+#endif
+static uint32_t elapsed_us(uint64_t start);
+
+// Public functions
+int ota_verify_image(uint8_t area_id, struct ota_verify_result *result)
+{
+    const struct flash_area *fa;
+    struct raw_image_header hdr;
+    uint8_t digest[IMAGE_HASH_LEN];
+    size_t hashed_len;
+    uint64_t start = ota_stats_now();
+    int rc;
+
+    memset(result, 0, sizeof(*result));
+
+    rc = flash_area_open(area_id, &fa);
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = check_layout(fa, &hdr, &hashed_len);
+    if (rc == 0) {
+        rc = read_tlvs(fa, hashed_len, &tlvs);
+    }
+    if (rc == 0 && !tlvs.sha256_found) {
+        LOG_ERR("Image has no SHA-256 TLV");
+        rc = -EBADMSG;
+    }
+
+    if (rc == 0) {
+        uint64_t hash_start = ota_stats_now();
+
+        rc = hash_image(fa, hashed_len, digest);
+        result->hashed_bytes = hashed_len;
+        result->hash_us = elapsed_us(hash_start);
+        if (rc == 0 && memcmp(digest, tlvs.sha256, sizeof(digest)) != 0) {
+            LOG_ERR("Image hash in slot doesn't match its SHA-256 TLV");
+            rc = -EBADMSG;
+        }
+    }
+    flash_area_close(fa);
+
+#ifdef OTA_VERIFY_SIGNATURE
+    if (rc == 0) {
+        uint64_t sig_start = ota_stats_now();
+
+        rc = verify_signature(digest, &tlvs);
+        result->signature_us = elapsed_us(sig_start);
+        result->signature_checked = true;
+    }
+#endif
+
+    result->total_us = elapsed_us(start);
+    if (rc == 0) {
+        LOG_INF("Image %u.%u.%u+%u in area %u is valid (%u bytes hashed in %u us, signature %s in %u us)",
+                hdr.ver_major, hdr.ver_minor, hdr.ver_revision, hdr.ver_build_num, area_id, result->hashed_bytes,
+                result->hash_us, result->signature_checked ? "checked" : "not checked", result->signature_us);
+    }
+    return rc;
+}
+
+// private static functions
+/* Checks that header, payload and both TLV areas fit the slot, as bootutil checks them before hashing */
+static int check_layout(const struct flash_area *fa, struct raw_image_header *hdr, size_t *hashed_len)
+{
+    struct raw_tlv_info info;
+    int rc = flash_area_read(fa, 0, hdr, sizeof(*hdr));
+
+    if (rc != 0) {
+        return rc;
+    }
+    if (hdr->magic != IMAGE_MAGIC) {
+        LOG_ERR("No image header (magic 0x%08x)", hdr->magic);
+        return -EBADMSG;
+    }
+
+    /* 64 bit sums, a corrupted header must not wrap around the slot size */
+    uint64_t end = (uint64_t)hdr->hdr_size + hdr->img_size + hdr->protect_tlv_size;
+    if (hdr->hdr_size < sizeof(*hdr) || end + sizeof(info) > fa->fa_size) {
+        LOG_ERR("Image of %u + %u bytes does not fit the slot", hdr->hdr_size, hdr->img_size);
+        return -EBADMSG;
+    }
+
+    if (hdr->protect_tlv_size > 0) {
+        rc = flash_area_read(fa, hdr->hdr_size + hdr->img_size, &info, sizeof(info));
+        if (rc != 0) {
+            return rc;
+        }
+        if (info.magic != IMAGE_TLV_PROT_INFO_MAGIC || info.tlv_tot != hdr->protect_tlv_size) {
+            LOG_ERR("Protected TLV area doesn't match the header");
+            return -EBADMSG;
+        }
+    }
+
+    *hashed_len = (size_t)end;
+    return 0;
+}
+
+/* Collects hash, key hash and signature from the unprotected TLV area at off */
+static int read_tlvs(const struct flash_area *fa, size_t off, struct image_tlvs *out)
+{
+    struct raw_tlv_info info;
+    struct raw_tlv tlv;
+    int rc;
+
+    memset(out, 0, sizeof(*out));
+
+    rc = flash_area_read(fa, off, &info, sizeof(info));
+    if (rc != 0) {
+        return rc;
+    }
+    if (info.magic != IMAGE_TLV_INFO_MAGIC || off + info.tlv_tot > fa->fa_size) {
+        LOG_ERR("No TLV area after the image");
+        return -EBADMSG;
+    }
+
+    size_t end = off + info.tlv_tot;
+    off += sizeof(info);
+
+    while (off + sizeof(tlv) <= end) {
+        rc = flash_area_read(fa, off, &tlv, sizeof(tlv));
+        if (rc != 0) {
+            return rc;
+        }
+        off += sizeof(tlv);
+        if (off + tlv.len > end) {
+            LOG_ERR("TLV 0x%02x exceeds the TLV area", tlv.type);
+            return -EBADMSG;
+        }
+
+        switch (tlv.type) {
+            case IMAGE_TLV_SHA256:
+                if (tlv.len != IMAGE_HASH_LEN) {
+                    return -EBADMSG;
+                }
+                rc = flash_area_read(fa, off, out->sha256, IMAGE_HASH_LEN);
+                out->sha256_found = true;
+                break;
+
+            case IMAGE_TLV_KEYHASH:
+                if (tlv.len != IMAGE_HASH_LEN) {
+                    return -EBADMSG;
+                }
+                rc = flash_area_read(fa, off, out->key_hash, IMAGE_HASH_LEN);
+                out->key_hash_found = true;
+                break;
+
+            case IMAGE_TLV_ECDSA_SIG:
+                if (tlv.len > IMAGE_ECDSA_SIG_MAX_LEN) {
+                    return -EBADMSG;
+                }
+                rc = flash_area_read(fa, off, out->signature, tlv.len);
+                out->signature_len = tlv.len;
+                break;
+
+            default:
+                break;
+        }
+        if (rc != 0) {
+            return rc;
+        }
+        off += tlv.len;
+    }
+    return 0;
+}
+
+/* Reads the first len bytes of the slot back from flash and hashes them */
+static int hash_image(const struct flash_area *fa, size_t len, uint8_t *digest)
+{
+    mbedtls_sha256_context sha;
+    int rc = 0;
+
+    mbedtls_sha256_init(&sha);
+    mbedtls_sha256_starts(&sha, 0);
+
+    for (size_t off = 0; off < len; off += sizeof(read_buf)) {
+        size_t n = MIN(sizeof(read_buf), len - off);
+
+        rc = flash_area_read(fa, off, read_buf, n);
+        if (rc != 0) {
+            break;
+        }
+        mbedtls_sha256_update(&sha, read_buf, n);
+    }
+
+    if (rc == 0) {
+        mbedtls_sha256_finish(&sha, digest);
+    }
+    mbedtls_sha256_free(&sha);
+    return rc;
+}
+
+#ifdef OTA_VERIFY_SIGNATURE
+/* Checks that the image was signed with MCUboot's key and that the signature covers digest */
+static int verify_signature(const uint8_t *digest, const struct image_tlvs *t)
+{
+    uint8_t key_hash[IMAGE_HASH_LEN];
+    mbedtls_pk_context pk;
+    int rc;
+
+    if (!t->key_hash_found || t->signature_len == 0) {
+        LOG_ERR("Image is not signed");
+        return -EBADMSG;
+    }
+
+    mbedtls_sha256(ecdsa_pub_key, ecdsa_pub_key_len, key_hash, 0);
+    if (memcmp(key_hash, t->key_hash, sizeof(key_hash)) != 0) {
+        LOG_ERR("Image is signed with another key");
+        return -EBADMSG;
+    }
+
+    /* imgtool may pad the DER sequence with zeros, which the DER parser rejects */
+    size_t sig_len = t->signature_len;
+    if (sig_len >= 2 && t->signature[0] == 0x30 && t->signature[1] < 0x80) {
+        sig_len = MIN(sig_len, (size_t)t->signature[1] + 2);
+    }
+
+    mbedtls_pk_init(&pk);
+    rc = mbedtls_pk_parse_public_key(&pk, ecdsa_pub_key, ecdsa_pub_key_len);
+    if (rc != 0) {
+        LOG_ERR("Can't parse the embedded public key: -0x%04x", -rc);
+        mbedtls_pk_free(&pk);
+        return -EINVAL;
+    }
+    rc = mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, digest, IMAGE_HASH_LEN, t->signature, sig_len);
+    mbedtls_pk_free(&pk);
+
+    if (rc == MBEDTLS_ERR_ECP_ALLOC_FAILED || rc == MBEDTLS_ERR_MPI_ALLOC_FAILED) {
+        LOG_ERR("Out of mbedTLS heap while checking the signature");
+        return -ENOMEM;
+    }
+    if (rc != 0) {
+        LOG_ERR("Image signature is invalid: -0x%04x", -rc);
+        return -EBADMSG;
+    }
+    return 0;
+}
+#endif
+
+static uint32_t elapsed_us(uint64_t start)
+{
+    return (uint32_t)MIN(k_cyc_to_us_floor64(ota_stats_now() - start), UINT32_MAX);
+}
@@ -1,11 +1,16 @@
 #include "utils.h"
+#include "app_config.h"
+#include "mcuboot_image.h"
 
 #include <stddef.h>                     // size_t
 #include <stdio.h>                      // snprintf
+#include <errno.h>                      // error codes
 #include <zephyr/devicetree.h>          // DT_FIXED_PARTITION_ID, DT_NODELABEL
 #include <zephyr/dfu/mcuboot.h>         // mcuboot_img_header, boot_* functions
+#include <zephyr/drivers/hwinfo.h>      // hwinfo_get_device_id
 #include <zephyr/logging/log.h>         // LOG_* macros
 #include <zephyr/storage/flash_map.h>   // flash_area_* functions
+#include <zephyr/sys/util.h>            // bin2hex
 
 
 LOG_MODULE_REGISTER(utils, LOG_LEVEL_INF);
@@ -86,4 +91,98 @@ int ota_get_running_firmware_version(char *buf, size_t buf_size)
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+int ota_get_running_firmware_build(uint32_t *build_num)
+{
+    struct mcuboot_img_header header;
+    int rc;
+
+    rc = boot_read_bank_header(DT_FIXED_PARTITION_ID(DT_NODELABEL(slot0_partition)), &header, sizeof(header));
+    if (rc != 0) {
+        LOG_ERR("Failed to read running image header. Error: %d", rc);
+        return rc;
+    }
+
+    *build_num = header.h.v1.sem_ver.build_num;
+    return 0;
+}
+
+int ota_get_image_hash(uint8_t area_id, uint8_t *hash, size_t hash_len)
+{
+    const struct flash_area *fa;
+    struct raw_image_header hdr;
+    struct raw_tlv_info info;
+    struct raw_tlv tlv;
+    int rc;
+
+    if (hash_len < 32) {
+        return -ENOMEM;
+    }
+
+    rc = flash_area_open(area_id, &fa);
+    if (rc != 0) {
+        return rc;
+    }
+
+    rc = flash_area_read(fa, 0, &hdr, sizeof(hdr));
+    if (rc != 0 || hdr.magic != IMAGE_MAGIC) {
+        rc = (rc != 0) ? rc : -EINVAL;
+        goto out;
+    }
+
+    /* TLVs follow the payload, the protected ones (if any) come first */
+    off_t off = hdr.hdr_size + hdr.img_size;
+    if (hdr.protect_tlv_size > 0) {
+        off += hdr.protect_tlv_size;
+    }
+
+    rc = flash_area_read(fa, off, &info, sizeof(info));
+    if (rc != 0 || info.magic != IMAGE_TLV_INFO_MAGIC) {
+        rc = (rc != 0) ? rc : -EINVAL;
+        goto out;
+    }
+
+    off_t end = off + info.tlv_tot;
+    off += sizeof(info);
+    rc = -EINVAL;
+
+    while (off + sizeof(tlv) <= end) {
+        if (flash_area_read(fa, off, &tlv, sizeof(tlv)) != 0) {
+            break;
+        }
+        off += sizeof(tlv);
+
+        if (tlv.type == IMAGE_TLV_SHA256 && tlv.len == 32) {
+            rc = flash_area_read(fa, off, hash, 32);
+            break;
+        }
+        off += tlv.len;
+    }
+
+out:
+    flash_area_close(fa);
+    if (rc != 0) {
+        LOG_DBG("No image hash in area %u: %d", area_id, rc);
+    }
+    return rc;
+}
+
+int ota_get_device_id(char *buf, size_t buf_size)
+{
+    uint8_t id[OTA_DEVICE_ID_MAX_LEN];
+    ssize_t len;
+
+    if (buf_size < 2 * sizeof(id) + 1) {
+        return -ENOMEM;
+    }
+
+    len = hwinfo_get_device_id(id, sizeof(id));
+    if (len <= 0) {
+        LOG_ERR("Failed to read the device ID. Error: %d", (int)len);
+        return (len < 0) ? (int)len : -EIO;
+    }
+
+    bin2hex(id, len, buf, buf_size);
+    return 0;
+}
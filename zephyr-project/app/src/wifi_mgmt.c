@@ -7,21 +7,59 @@
 #include <zephyr/net/socket.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/init.h>
+#include <zephyr/settings/settings.h>
+#include <stdio.h>
 #include <string.h>
 #include "app_config.h"
+#include "wifi_mgmt.h"
 
 LOG_MODULE_REGISTER(wifi_mgmt, LOG_LEVEL_INF);
 
 static struct net_mgmt_event_callback wifi_cb;
+static struct net_mgmt_event_callback ipv4_cb;
 static struct k_work_delayable wifi_connect_work;
+static struct k_work_delayable probe_work;
+static struct k_work_q probe_workq;        // the blocking probe must not hold up the system work queue
+K_THREAD_STACK_DEFINE(probe_workq_stack, WIFI_PROBE_STACK_SIZE);
 static bool wifi_connected = false;
+static bool network_ready = false;         // IPv4 address bound and the OTA server answered
+static void (*ready_callback)(bool ready) = NULL;
+static int probe_retry_sec = 1;
+static int64_t address_at_ms = 0;
+
+/* Last good connection, persisted so a reboot can skip the scan and the DHCP wait */
+#define WIFI_SETTINGS_CACHE_KEY "wifi/cache"
+
+struct wifi_cache {
+    uint8_t bssid[WIFI_MAC_ADDR_LEN];
+    uint8_t channel;                     // 0 = nothing cached
+    struct in_addr addr;
+    struct in_addr netmask;
+    struct in_addr gw;
+    uint32_t lease_left_sec;             // set by wifi_prepare_reboot(), 0 = wait for DHCP
+};
+
+static struct wifi_cache cache;
+static bool use_cache = false;           // the running connect attempt targets the cached AP
+static bool cache_failed = false;        // the cached AP didn't answer, scan until connected
+static bool reuse_lease = false;         // this boot starts with the address of the last one
+static int64_t connect_start_ms = 0;
+static int64_t bound_at_ms = 0;          // when DHCP bound the current lease
+static uint32_t lease_time_sec = 0;
 
 /* Forward declarations */
 static void setup_network_interface(struct net_if *iface);
-static int test_network_connectivity(void);
+static int probe_server(void);
+static void probe_work_handler(struct k_work *work);
+static void set_network_ready(bool ready);
 static void wifi_connect_work_handler(struct k_work *work);
 static void wifi_event_handler(struct net_mgmt_event_callback *cb, uint64_t mgmt_event, struct net_if *iface);
+static void ipv4_event_handler(struct net_mgmt_event_callback *cb, uint64_t mgmt_event, struct net_if *iface);
 static int wifi_get_ip_address(char *ip_str, size_t len);
+static int cache_load_cb(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg, void *param);
+static void load_cache(void);
+static void update_cache(struct net_if *iface);
+static void apply_cached_lease(struct net_if *iface);
 
 
 /* public functions */
@@ -30,11 +68,41 @@ bool wifi_is_connected(void)
     return wifi_connected;
 }
 
+bool wifi_is_network_ready(void)
+{
+    return network_ready;
+}
+
+void wifi_register_ready_callback(void (*callback)(bool ready))
+{
+    ready_callback = callback;
+    if (network_ready && callback != NULL) {
+        callback(true);
+    }
+}
+
 int wifi_get_ip_address_public(char *ip_str, size_t len)
 {
     return wifi_get_ip_address(ip_str, len);
 }
 
+void wifi_prepare_reboot(void)
+{
+    if (!network_ready || lease_time_sec == 0) {
+        return;
+    }
+
+    uint32_t held_sec = (uint32_t)((k_uptime_get() - bound_at_ms) / MSEC_PER_SEC);
+    if (held_sec + WIFI_LEASE_REUSE_MARGIN_SEC >= lease_time_sec) {
+        return;
+    }
+
+    cache.lease_left_sec = lease_time_sec - held_sec;
+    if (settings_save_one(WIFI_SETTINGS_CACHE_KEY, &cache, sizeof(cache)) != 0) {
+        LOG_WRN("Failed to keep the DHCP lease for the next boot");
+    }
+}
+
 
 /* private static functions */
 static void setup_network_interface(struct net_if *iface)
@@ -56,28 +124,76 @@ static void setup_network_interface(struct net_if *iface)
     LOG_INF("Interface up after: %s", net_if_is_up(iface) ? "YES" : "NO");
 }
 
-static int test_network_connectivity(void)
+/*
+ * The network counts as usable once the OTA server accepts a TCP connection,
+ * a public host may not be reachable on isolated networks. A blocking connect
+ * gives up after CONFIG_NET_SOCKETS_CONNECT_TIMEOUT, so this runs on probe_workq.
+ */
+static int probe_server(void)
 {
-    struct sockaddr_in addr;
+    struct zsock_addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct zsock_addrinfo *result;
+    char port_str[8];
 
-    int sock = zsock_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sock < 0) {
-        LOG_ERR("Failed to create socket: %d", errno);
-        return -1;
+    snprintf(port_str, sizeof(port_str), "%d", OTA_SERVER_PORT);
+    int ret = zsock_getaddrinfo(OTA_SERVER_HOST, port_str, &hints, &result);
+    if (ret != 0) {
+        return -EHOSTUNREACH;
     }
-    
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(53);
-    int ret = zsock_inet_pton(AF_INET, "8.8.8.8", &addr.sin_addr);
-    if (ret <= 0) {
-        zsock_close(sock);
-        return -1;
+
+    int sock = zsock_socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (sock < 0) {
+        zsock_freeaddrinfo(result);
+        return -errno;
     }
 
-    ret = zsock_connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+    ret = zsock_connect(sock, result->ai_addr, result->ai_addrlen);
+    if (ret < 0) {
+        ret = -errno;
+    }
     zsock_close(sock);
+    zsock_freeaddrinfo(result);
+    return ret;
+}
+
+static void probe_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
 
-    return (ret == 0) ? 0 : -1;
+    if (network_ready) {
+        return;
+    }
+
+    int64_t start = k_uptime_get();
+    int ret = probe_server();
+    if (ret == 0) {
+        LOG_INF("Update server %s:%d reachable (probe %lld ms, %lld ms after the address was bound)",
+                OTA_SERVER_HOST, OTA_SERVER_PORT, k_uptime_get() - start, k_uptime_get() - address_at_ms);
+        set_network_ready(true);
+        return;
+    }
+
+    LOG_WRN("Update server %s:%d not reachable (%d), probing again in %d s", OTA_SERVER_HOST, OTA_SERVER_PORT, ret,
+            probe_retry_sec);
+    k_work_schedule_for_queue(&probe_workq, &probe_work, K_SECONDS(probe_retry_sec));
+    probe_retry_sec = MIN(probe_retry_sec * 2, WIFI_PROBE_MAX_INTERVAL_SEC);
+}
+
+static void set_network_ready(bool ready)
+{
+    if (network_ready == ready) {
+        return;
+    }
+    network_ready = ready;
+    if (ready) {
+        LOG_INF("Network ready %lld ms after boot", k_uptime_get());
+    }
+    if (ready_callback != NULL) {
+        ready_callback(ready);
+    }
 }
 
 static int wifi_get_ip_address(char *ip_str, size_t len)
@@ -114,66 +230,85 @@ static void wifi_connect_work_handler(struct k_work *work)
 {
     ARG_UNUSED(work);
 
+    // getting default network interface of board
+    struct net_if *iface = net_if_get_default();
+    if (!iface) {
+        LOG_ERR("WiFi interface not available (yet)");
+        k_work_schedule(&wifi_connect_work, K_SECONDS(5));
+        return;
+    }
+
+    /* once connected, the IPv4 events take over (see ipv4_event_handler()), only the cache is refreshed */
     if (wifi_connected) {
-        LOG_INF("WiFi connected! Trying to get IP address and test connectivity");
-        char ip_str[16];
-        int result = wifi_get_ip_address(ip_str, sizeof(ip_str));
-        
-        if (result == 0) {
-            LOG_INF("IP address: %s", ip_str);
-
-            if (test_network_connectivity() == 0) {
-                LOG_INF("Google was pinged successfully!");
-            }
-        } else {
-            LOG_INF("Still waiting for IP address... (retry in 5s)");
-            k_work_schedule(&wifi_connect_work, K_SECONDS(5));
-        }
+        update_cache(iface);
+        return;
+    }
+
+    if (use_cache) {
+        LOG_WRN("Cached AP did not answer within %d s, scanning", WIFI_FAST_CONNECT_TIMEOUT_SEC);
+        cache_failed = true;
+    }
+    use_cache = (cache.channel != 0 && !cache_failed);
+
+    struct wifi_connect_req_params params = {
+        .ssid = WIFI_SSID,
+        .ssid_length = strlen(WIFI_SSID),
+        .psk = WIFI_PSK,
+        .psk_length = strlen(WIFI_PSK),
+        .channel = WIFI_CHANNEL_ANY,
+        .security = WIFI_SECURITY_TYPE_PSK,
+    };
+
+    if (use_cache) {
+        /* straight to the last AP, no scan */
+        params.channel = cache.channel;
+        memcpy(params.bssid, cache.bssid, sizeof(params.bssid));
+        LOG_INF("Attempting WiFi connection to: %s (cached AP on channel %d)", WIFI_SSID, cache.channel);
     } else {
-        // getting default network interface of board
-        struct net_if *iface = net_if_get_default();
-        if (!iface) {
-            LOG_ERR("WiFi interface not available (yet)");
-            k_work_schedule(&wifi_connect_work, K_SECONDS(5));
-            return;
-        }
-        
-        struct wifi_connect_req_params params = {
-            .ssid = WIFI_SSID,
-            .ssid_length = strlen(WIFI_SSID),
-            .psk = WIFI_PSK,
-            .psk_length = strlen(WIFI_PSK),
-            .channel = WIFI_CHANNEL_ANY,
-            .security = WIFI_SECURITY_TYPE_PSK,
-        };
-        
         LOG_INF("Attempting WiFi connection to: %s", WIFI_SSID);
-        int ret = net_mgmt(NET_REQUEST_WIFI_CONNECT, iface, &params, sizeof(params));
-        
-        if (ret) {
-            LOG_ERR("WiFi connection request failed: %d", ret);
-            k_work_schedule(&wifi_connect_work, K_SECONDS(10));
-        }
+    }
+
+    connect_start_ms = k_uptime_get();
+    int ret = net_mgmt(NET_REQUEST_WIFI_CONNECT, iface, &params, sizeof(params));
+
+    if (ret) {
+        LOG_ERR("WiFi connection request failed: %d", ret);
+        k_work_schedule(&wifi_connect_work, use_cache ? K_NO_WAIT : K_SECONDS(10));
+    } else if (use_cache) {
+        k_work_schedule(&wifi_connect_work, K_SECONDS(WIFI_FAST_CONNECT_TIMEOUT_SEC));
     }
 }
 
 static void wifi_event_handler(struct net_mgmt_event_callback *cb, uint64_t mgmt_event, struct net_if *iface)
 {
-    ARG_UNUSED(cb);
-    
+    const struct wifi_status *status = (const struct wifi_status *)cb->info;
+
     switch (mgmt_event) {
         case NET_EVENT_WIFI_CONNECT_RESULT:
-            LOG_INF("WiFi connected successfully");
+            if (status != NULL && status->status != 0) {
+                LOG_ERR("WiFi connection failed: %d", status->status);
+                /* a failed cached AP is retried with a scan right away */
+                k_work_reschedule(&wifi_connect_work, use_cache ? K_NO_WAIT : K_SECONDS(10));
+                break;
+            }
+            LOG_INF("WiFi connected in %lld ms (%s)", k_uptime_get() - connect_start_ms,
+                    use_cache ? "cached AP" : "scan");
             wifi_connected = true;
+            use_cache = false;
+            cache_failed = false;
+            if (reuse_lease) {
+                apply_cached_lease(iface);
+            }
             setup_network_interface(iface);
-            
-            /* Wait for DHCP */
-            k_work_schedule(&wifi_connect_work, K_SECONDS(10));
+            /* remember this AP, also stops the cached AP timeout */
+            k_work_reschedule(&wifi_connect_work, K_NO_WAIT);
             break;
             
         case NET_EVENT_WIFI_DISCONNECT_RESULT:
             LOG_WRN("WiFi disconnected - will retry");
             wifi_connected = false;
+            k_work_cancel_delayable(&probe_work);
+            set_network_ready(false);
             k_work_schedule(&wifi_connect_work, K_SECONDS(5));
             break;
             
@@ -182,12 +317,131 @@ static void wifi_event_handler(struct net_mgmt_event_callback *cb, uint64_t mgmt
     }
 }
 
+static void ipv4_event_handler(struct net_mgmt_event_callback *cb, uint64_t mgmt_event, struct net_if *iface)
+{
+    ARG_UNUSED(cb);
+
+    switch (mgmt_event) {
+        case NET_EVENT_IPV4_DHCP_BOUND:
+            bound_at_ms = k_uptime_get();
+            lease_time_sec = iface->config.dhcpv4.lease_time;
+            LOG_INF("DHCP bound %lld ms after connect (lease %u s)", bound_at_ms - connect_start_ms, lease_time_sec);
+            if (reuse_lease) {
+                /* DHCP handed out another address than last time, drop the old one */
+                reuse_lease = false;
+                if (iface->config.dhcpv4.requested_ip.s_addr != cache.addr.s_addr) {
+                    net_if_ipv4_addr_rm(iface, &cache.addr);
+                }
+            }
+            k_work_reschedule(&wifi_connect_work, K_NO_WAIT);
+            __fallthrough;
+
+        case NET_EVENT_IPV4_ADDR_ADD:
+            if (!network_ready) {
+                address_at_ms = k_uptime_get();
+                LOG_INF("IPv4 address bound %lld ms after boot, %lld ms after connect", address_at_ms,
+                        address_at_ms - connect_start_ms);
+                probe_retry_sec = 1;
+                k_work_reschedule_for_queue(&probe_workq, &probe_work, K_NO_WAIT);
+            }
+            break;
+
+        case NET_EVENT_IPV4_ADDR_DEL:
+            LOG_WRN("IPv4 address lost");
+            k_work_cancel_delayable(&probe_work);
+            set_network_ready(false);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static int cache_load_cb(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg, void *param)
+{
+    ARG_UNUSED(key);
+
+    if (len == sizeof(struct wifi_cache)) {
+        read_cb(cb_arg, param, len);
+    }
+    return 0;
+}
+
+static void load_cache(void)
+{
+    if (settings_subsys_init() != 0) {
+        return;
+    }
+    settings_load_subtree_direct(WIFI_SETTINGS_CACHE_KEY, cache_load_cb, &cache);
+
+    if (cache.lease_left_sec > 0) {
+        /* only good for the boot right after wifi_prepare_reboot(), a power cycle may take hours */
+        reuse_lease = true;
+        cache.lease_left_sec = 0;
+        settings_save_one(WIFI_SETTINGS_CACHE_KEY, &cache, sizeof(cache));
+    }
+}
+
+/* Stores the current AP and lease if they changed */
+static void update_cache(struct net_if *iface)
+{
+    struct wifi_iface_status status = {0};
+    struct wifi_cache fresh = cache;
+
+    if (net_mgmt(NET_REQUEST_WIFI_IFACE_STATUS, iface, &status, sizeof(status)) == 0 && status.channel > 0) {
+        memcpy(fresh.bssid, status.bssid, sizeof(fresh.bssid));
+        fresh.channel = status.channel;
+    }
+
+    struct in_addr *addr = net_if_ipv4_get_global_addr(iface, NET_ADDR_PREFERRED);
+    if (addr != NULL && lease_time_sec > 0) {
+        fresh.addr = *addr;
+        fresh.netmask = net_if_ipv4_get_netmask_by_addr(iface, addr);
+        fresh.gw = net_if_ipv4_get_gw(iface);
+    }
+    fresh.lease_left_sec = 0;
+
+    if (memcmp(&fresh, &cache, sizeof(fresh)) != 0) {
+        cache = fresh;
+        if (settings_save_one(WIFI_SETTINGS_CACHE_KEY, &cache, sizeof(cache)) != 0) {
+            LOG_WRN("Failed to store the WiFi connection cache");
+        }
+    }
+}
+
+/* Starts with the address of the last boot, DHCP confirms or replaces it in the background */
+static void apply_cached_lease(struct net_if *iface)
+{
+    char ip_str[INET_ADDRSTRLEN];
+
+    if (net_if_ipv4_addr_add(iface, &cache.addr, NET_ADDR_DHCP, cache.lease_left_sec) == NULL) {
+        reuse_lease = false;
+        return;
+    }
+    net_if_ipv4_set_netmask_by_addr(iface, &cache.addr, &cache.netmask);
+    net_if_ipv4_set_gw(iface, &cache.gw);
+
+    net_addr_ntop(AF_INET, &cache.addr, ip_str, sizeof(ip_str));
+    LOG_INF("Reusing address %s from before the reboot", ip_str);
+}
+
 static int wifi_mgmt_init(void)
 {
+    struct k_work_queue_config probe_cfg = {
+        .name = "wifi_probe",
+    };
+
     net_mgmt_init_event_callback(&wifi_cb, wifi_event_handler, NET_EVENT_WIFI_CONNECT_RESULT | NET_EVENT_WIFI_DISCONNECT_RESULT);
     net_mgmt_add_event_callback(&wifi_cb);
+    net_mgmt_init_event_callback(&ipv4_cb, ipv4_event_handler,
+                                 NET_EVENT_IPV4_ADDR_ADD | NET_EVENT_IPV4_ADDR_DEL | NET_EVENT_IPV4_DHCP_BOUND);
+    net_mgmt_add_event_callback(&ipv4_cb);
     
     k_work_init_delayable(&wifi_connect_work, wifi_connect_work_handler);
+    k_work_init_delayable(&probe_work, probe_work_handler);
+    k_work_queue_start(&probe_workq, probe_workq_stack, K_THREAD_STACK_SIZEOF(probe_workq_stack),
+                       WIFI_PROBE_PRIORITY, &probe_cfg);
+    load_cache();
     k_work_schedule(&wifi_connect_work, K_SECONDS(2));
     
     LOG_INF("WiFi management subsystem initialized");
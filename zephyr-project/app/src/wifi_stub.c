@@ -0,0 +1,43 @@
+#include "wifi_mgmt.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+
+
+/*
+ * wifi_mgmt for boards without WiFi (native_sim), sockets go through the
+ * host's network stack, which is up before the application starts.
+ */
+
+/* public functions */
+bool wifi_is_connected(void)
+{
+    return true;
+}
+
+bool wifi_is_network_ready(void)
+{
+    return true;
+}
+
+void wifi_register_ready_callback(void (*callback)(bool ready))
+{
+    if (callback != NULL) {
+        callback(true);
+    }
+}
+
+int wifi_get_ip_address_public(char *ip_str, size_t len)
+{
+    if (!ip_str || len < sizeof("127.0.0.1")) {
+        return -EINVAL;
+    }
+
+    strcpy(ip_str, "127.0.0.1");
+    return 0;
+}
+
+void wifi_prepare_reboot(void)
+{
+}
@@ -0,0 +1,116 @@
+#include "work_latency.h"
+#include "app_config.h"
+#include "ota_stats.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/spinlock.h>
+#include <zephyr/sys/util.h>
+
+
+LOG_MODULE_REGISTER(work_latency, LOG_LEVEL_INF);
+
+static struct work_latency *items[WORK_LATENCY_MAX_ITEMS];
+static size_t item_count = 0;
+static struct k_spinlock lock;
+static bool window_open = false;
+
+// Forward declarations
+static void probe_work_handler(struct k_work *work);
+
+/* Probe on the system work queue, measures the queue itself while a window is open */
+static struct work_latency probe_latency;
+static K_WORK_DELAYABLE_DEFINE(probe_work, probe_work_handler);
+
+// public functions
+void work_latency_register(struct work_latency *wl, const char *name)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    wl->name = name;
+    if (item_count < ARRAY_SIZE(items)) {
+        items[item_count++] = wl;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void work_latency_armed(struct work_latency *wl, uint32_t delay_ms)
+{
+    wl->due = ota_stats_now() + k_ms_to_cyc_ceil64(delay_ms);
+}
+
+void work_latency_ran(struct work_latency *wl)
+{
+    uint64_t now = ota_stats_now();
+
+    if (wl->due == 0) {
+        return;
+    }
+
+    uint32_t late_us = (now > wl->due) ? (uint32_t)MIN(k_cyc_to_us_floor64(now - wl->due), UINT32_MAX) : 0;
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    wl->due = 0;
+    wl->runs++;
+    wl->max_us = MAX(wl->max_us, late_us);
+    if (window_open) {
+        wl->window_max_us = MAX(wl->window_max_us, late_us);
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void work_latency_window_start(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    if (probe_latency.name == NULL) {
+        probe_latency.name = "sysworkq";
+        if (item_count < ARRAY_SIZE(items)) {
+            items[item_count++] = &probe_latency;
+        }
+    }
+    for (size_t i = 0; i < item_count; i++) {
+        items[i]->window_max_us = 0;
+    }
+    window_open = true;
+    k_spin_unlock(&lock, key);
+
+    work_latency_armed(&probe_latency, WORK_LATENCY_PROBE_MS);
+    k_work_reschedule(&probe_work, K_MSEC(WORK_LATENCY_PROBE_MS));
+}
+
+void work_latency_window_end(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    bool was_open = window_open;
+
+    window_open = false;
+    k_spin_unlock(&lock, key);
+
+    k_work_cancel_delayable(&probe_work);
+    if (!was_open) {
+        return;
+    }
+
+    for (size_t i = 0; i < item_count; i++) {
+        LOG_INF("Worst latency of %s during the update: %u us (%u us since boot)", items[i]->name,
+                items[i]->window_max_us, items[i]->max_us);
+    }
+}
+
+const struct work_latency *work_latency_get(size_t idx)
+{
+    return (idx < item_count) ? items[idx] : NULL;
+}
+
+// private static functions
+static void probe_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    work_latency_ran(&probe_latency);
+    if (window_open) {
+        work_latency_armed(&probe_latency, WORK_LATENCY_PROBE_MS);
+        k_work_schedule(&probe_work, K_MSEC(WORK_LATENCY_PROBE_MS));
+    }
+}